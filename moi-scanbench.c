@@ -0,0 +1,346 @@
+/*****************************************************************************
+ *
+ * $Id$
+ *
+ * This file is free software. You can redistribute it and/or modify it
+ * under the terms of the FreeBSD License. See header in main `moi.c` file.
+ *
+ * # moi-scanbench - time the sequence header search kernels
+ *
+ * Runs every kernel in scan.c that this CPU supports over in-memory buffers
+ * and reports GB/s and cycles per byte (TSC cycles, on x86). The buffers
+ * are filled a few different ways:
+ *
+ *    mpeg       random bytes with start codes every few hundred bytes and
+ *               a sequence header every half a MB, roughly what a MOD is
+ *    random     uniform random bytes, a 00 every 256 bytes
+ *    nozero     no 00 bytes at all, the best case for everyone
+ *    zeros      all 00, every byte starts a candidate
+ *    nearmiss   00 00 01 00 over and over, every other byte a candidate
+ *               that fails on the last byte
+ *
+ * Every kernel must find exactly the same headers as the others, or we
+ * say so and stop. With --record the fastest on the mpeg buffer is saved
+ * to ~/.moi-scanner, which moi uses from then on.
+ *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>   /* __rdtsc */
+#define HAVE_TSC 1
+#endif
+
+#include "scan.h"
+
+#define DEFAULT_SIZE (64 * 1024 * 1024)  /* bytes per buffer */
+#define DEFAULT_REPS 5
+
+typedef struct dist {
+   const char *name;
+   void      (*fill)(unsigned char *buf, size_t len);
+} dist_type;
+
+/*
+ * globals
+ */
+char *this;
+int verbose = 0;
+
+/*
+ * function prototypes
+ */
+void usage();
+static unsigned long long rnd();
+static void fill_mpeg(unsigned char *buf, size_t len);
+static void fill_random(unsigned char *buf, size_t len);
+static void fill_nozero(unsigned char *buf, size_t len);
+static void fill_zeros(unsigned char *buf, size_t len);
+static void fill_nearmiss(unsigned char *buf, size_t len);
+static long long count_seqh(seqh_find_fn find, unsigned char *buf, size_t len);
+static double now_sec();
+static unsigned long long cycles();
+void * mymalloc(size_t size);
+
+static dist_type dists[] = {
+   { "mpeg",     fill_mpeg },      /* the one --record goes by */
+   { "random",   fill_random },
+   { "nozero",   fill_nozero },
+   { "zeros",    fill_zeros },
+   { "nearmiss", fill_nearmiss },
+   { NULL, NULL }
+};
+
+
+/*****************************************************************************
+ * MAIN
+ ****************************************************************************/
+int main(int argc, char *argv[]) {
+   int c, r, reps = DEFAULT_REPS, record = 0;
+   size_t size = DEFAULT_SIZE;
+   char *only = NULL, fname[2048];
+   unsigned char *buf;
+   dist_type *d;
+   scan_kernel_type *k, *best = NULL;
+   long long want, got;
+   double t, best_t, best_mpeg = 0;
+   unsigned long long cy, best_cy;
+   int option_index = 0;
+   static struct option long_options[] = {
+      {"verbose",          no_argument,       0, 'v'},
+      {"help",             no_argument,       0, 'h'},
+      {"size",             required_argument, 0, 's'},
+      {"reps",             required_argument, 0, 'r'},
+      {"kernel",           required_argument, 0, 'k'},
+      {"record",           no_argument,       0, 'R'},
+      {0, 0, 0, 0}
+   };
+
+   this = argv[0];
+
+   while ( (c = getopt_long(argc, argv, "vhs:r:k:", long_options, &option_index)) != -1 ) {
+      switch(c) {
+         case 's':
+            if ( (size = strtoul(optarg, NULL, 10) * 1024 * 1024) < 1024 ) {
+               fprintf(stderr, "%s: Error: --size is in MB and must be at least 1\n", this);
+               exit(1);
+            }
+            break;
+         case 'r':
+            if ( (reps = atoi(optarg)) < 1 ) {
+               fprintf(stderr, "%s: Error: --reps must be at least 1\n", this);
+               exit(1);
+            }
+            break;
+         case 'k':
+            only = optarg;
+            break;
+         case 'R':
+            record = 1;
+            break;
+         case 'v':
+            verbose++;
+            break;
+         case 'h':
+            usage();
+            exit(1);
+         default:
+            exit(1);
+      }
+   }
+   if ( argc > optind ) {
+      fprintf(stderr, "%s: Error: unknown options or extra stuff on the command line.\n", this);
+      exit(1);
+   }
+
+   buf = (unsigned char *) mymalloc(size);
+
+   printf("%-10s %-8s %10s %12s\n", "buffer", "kernel", "GB/s", "cycles/byte");
+   for (d = dists; d->name; d++) {
+      d->fill(buf, size);
+      want = -1;
+
+      for (k = scan_kernels; k->name; k++) {
+         if ( (only && strcmp(only, k->name) != 0) || !k->supported() )
+            continue;
+
+         /* best of reps, after one untimed pass to warm the caches */
+         got = count_seqh(k->find, buf, size);
+         best_t = 0;
+         best_cy = 0;
+         for (r = 0; r < reps; r++) {
+            t = now_sec();
+            cy = cycles();
+            count_seqh(k->find, buf, size);
+            cy = cycles() - cy;
+            t = now_sec() - t;
+            if ( r == 0 || t < best_t ) {
+               best_t = t;
+               best_cy = cy;
+            }
+         }
+
+         /* they had all better agree */
+         if ( want < 0 )
+            want = got;
+         else if ( got != want ) {
+            fprintf(stderr, "%s: Error: %s found %lld sequence headers in the %s buffer, expected %lld\n",
+                  this, k->name, got, d->name, want);
+            exit(1);
+         }
+
+         printf("%-10s %-8s %10.2f %12.3f\n", d->name, k->name, size / best_t / 1e9,
+               best_cy ? (double) best_cy / size : 0.0);
+         if ( verbose )
+            printf("   %lld headers, %.6f sec\n", got, best_t);
+
+         if ( d == dists && (best == NULL || best_t < best_mpeg) ) {
+            best = k;
+            best_mpeg = best_t;
+         }
+      }
+   }
+   free(buf);
+
+   if ( best == NULL ) {
+      fprintf(stderr, "%s: Error: no kernel to run\n", this);
+      exit(1);
+   }
+   printf("fastest on mpeg data: %s\n", best->name);
+   if ( record ) {
+      if ( !scan_save_choice(best->name) )
+         exit(1);
+      scan_record_fname(fname, sizeof(fname));
+      printf("recorded in %s\n", fname);
+   }
+
+   return 0;
+}
+
+/*****************************************************************************
+ * count the sequence headers in buf the way make_mpeg() walks a block
+ ****************************************************************************/
+static long long count_seqh(seqh_find_fn find, unsigned char *buf, size_t len) {
+   unsigned char *p = buf, *lim = buf + len;
+   long long n = 0;
+
+   while ( (p = find(p, lim)) != NULL ) {
+      n++;
+      p++;
+   }
+   return n;
+}
+
+/*****************************************************************************
+ * Buffer fillers
+ ****************************************************************************/
+
+/* xorshift, so every run and every machine sees the same data */
+static unsigned long long rnd() {
+   static unsigned long long x = 88172645463325252ULL;
+
+   x ^= x << 13;
+   x ^= x >> 7;
+   x ^= x << 17;
+   return x;
+}
+
+static void fill_random(unsigned char *buf, size_t len) {
+   size_t i;
+
+   for (i = 0; i < len; i++)
+      buf[i] = rnd() >> 56;
+}
+
+static void fill_mpeg(unsigned char *buf, size_t len) {
+   static const unsigned char codes[] = { 0xBA, 0xBB, 0xE0, 0xC0, 0xBD, 0x00, 0x01, 0x02, 0x10, 0x2C, 0xAF, 0xB5, 0xB8 };
+   size_t i, next_seqh = 0;
+
+   fill_random(buf, len);
+   for (i = 0; i + 16 < len; i += 100 + rnd() % 1500) {
+      buf[i] = 0x00;
+      buf[i + 1] = 0x00;
+      buf[i + 2] = 0x01;
+      if ( i >= next_seqh ) {
+         buf[i + 3] = 0xB3;
+         next_seqh = i + 512 * 1024;
+      }
+      else
+         buf[i + 3] = codes[rnd() % sizeof(codes)];
+   }
+}
+
+static void fill_nozero(unsigned char *buf, size_t len) {
+   size_t i;
+
+   for (i = 0; i < len; i++)
+      buf[i] = 1 + (rnd() >> 56) % 255;
+}
+
+static void fill_zeros(unsigned char *buf, size_t len) {
+   memset(buf, 0x00, len);
+}
+
+static void fill_nearmiss(unsigned char *buf, size_t len) {
+   size_t i;
+
+   for (i = 0; i < len; i++)
+      buf[i] = (i & 3) == 2 ? 0x01 : 0x00;
+}
+
+/*****************************************************************************
+ * timers
+ ****************************************************************************/
+static double now_sec() {
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long long cycles() {
+#ifdef HAVE_TSC
+   return __rdtsc();
+#else
+   return 0;   /* reported as 0 cycles/byte */
+#endif
+}
+
+/*****************************************************************************
+ * print usage message
+ ****************************************************************************/
+void usage() {
+   scan_kernel_type *k;
+
+   printf(" NAME\n");
+   printf("    %s - time moi's sequence header search kernels on this machine\n", this);
+   printf("\n");
+   printf(" SYNOPSIS\n");
+   printf("    %s [-v] [-s MB] [-r reps] [-k kernel] [--record]\n", this);
+   printf("\n");
+   printf(" DESCRITION\n");
+   printf("    Runs each kernel this CPU supports over buffers of MPEG-like and\n");
+   printf("    worst case data, and prints GB/s and cycles per byte for each.\n");
+   printf("    Kernels:");
+   for (k = scan_kernels; k->name; k++)
+      printf(" %s%s", k->name, k->supported() ? "" : " (not on this CPU)");
+   printf("\n");
+   printf("\n");
+   printf(" OPTIONS\n");
+   printf("    -s, --size=MB\n");
+   printf("             Size of each test buffer. Default is %d.\n", DEFAULT_SIZE / (1024 * 1024));
+   printf("\n");
+   printf("    -r, --reps=N\n");
+   printf("             Time each kernel N times and keep the best. Default is %d.\n", DEFAULT_REPS);
+   printf("\n");
+   printf("    -k, --kernel=name\n");
+   printf("             Only run this kernel.\n");
+   printf("\n");
+   printf("    --record\n");
+   printf("             Save the fastest kernel on the mpeg buffer in ~/.moi-scanner,\n");
+   printf("             where moi will find it.\n");
+   printf("\n");
+   printf("    -v, --verbose\n");
+   printf("             Also print headers found and best time.\n");
+   printf("\n");
+   printf("    -h, --help\n");
+   printf("             Prints this help message\n");
+   printf("\n");
+}
+
+/*************************************************************************
+ * combine malloc with error check and die
+ ************************************************************************/
+void * mymalloc(size_t size) {
+   void *p = NULL;
+
+   if ( (p = malloc(size)) == NULL ) {
+      fprintf(stderr, "cannot allocate memory");
+      exit(1);
+   }
+   return p;
+}
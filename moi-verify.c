@@ -0,0 +1,605 @@
+/*****************************************************************************
+ *
+ * $Id$
+ *
+ * This file is free software. You can redistribute it and/or modify it
+ * under the terms of the FreeBSD License. See header in main `moi.c` file.
+ *
+ * # moi-verify - check an mpeg made by moi against its MOD file
+ *
+ * moi copies the MOD file byte for byte, except for offset 7 of each
+ * sequence header, where the aspect ratio (upper nibble) is set to what the
+ * MOI file says and the frame rate (lower nibble) is kept. This reads the
+ * MOD and the mpeg side by side and makes sure that is all that changed:
+ * every byte that differs must be offset 7 of a sequence header in the MOD,
+ * carrying the expected aspect ratio and the MOD's own frame rate.
+ *
+ * This replaces the old bdiff script (od + diff), which needed minutes and
+ * gigabytes of temp files for a single clip. Equal stretches are skipped 16
+ * or 32 bytes at a time, so this runs at about the speed of reading the two
+ * files.
+ *
+ * For .TOD (transport stream) files a header can be split across packets,
+ * so the signature in front of a patched byte isn't always contiguous. We
+ * go packet by packet there, and look back through the last few payload
+ * bytes of the same PID; a header found that way is counted as "split".
+ *
+ * With -r and --fix-display it checks what moi's --frame-rate and
+ * --fix-display change as well: the frame rate nibble, and the display
+ * size of each sequence display extension. Without them those changes
+ * are reported as failures, with a hint.
+ *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#define MAX_PATH_LEN 2048        /* max length for a path/filename string */
+#define RW_BLOCK_SIZE 1048576    /* read 1MB chunks at a time */
+#define HIST 16                  /* MOD bytes kept from the previous block (or packet) */
+#define NPIDS 8192               /* transport stream PIDs */
+
+#define DIFF_PATCHED    0        /* what check_diff() made of a byte */
+#define DIFF_SPLIT      1
+#define DIFF_DISPLAY    2
+#define DIFF_WRONG      3
+#define DIFF_RATE       4
+#define DIFF_NODISPLAY  5
+#define DIFF_UNEXPECTED 6
+
+typedef struct result {
+   long long     patched;          /* headers set to the expected aspect ratio */
+   long long     split;            /* .TOD: right byte, signature split across packets */
+   long long     display;          /* --fix-display: display size bytes set right */
+   long long     wrong;            /* header patched to the wrong value */
+   long long     rate;             /* ... right aspect ratio, other frame rate (no -r) */
+   long long     nodisplay;        /* display extensions changed without --fix-display */
+   long long     unexpected;       /* differences that aren't a header at all */
+   long long     first_bad;        /* offset of the first wrong/unexpected byte */
+   unsigned char first_mod, first_mpeg;
+   int           width, height;    /* coded size from the first sequence header, 0 until seen */
+} result_type;
+
+/*
+ * globals
+ */
+char *this;
+int verbose = 0;
+int aspect_opt = 0;              /* -a, 0 = take it from the MOI file */
+int rate_opt = 0;                /* -r, 0 = the MOD's frame rate is kept */
+int fix_display = 0;             /* --fix-display */
+
+/*
+ * function prototypes
+ */
+void usage();
+int verify(char *mod_fname, char *mpeg_fname);
+static void count_diff(result_type *r, int kind, long long pos, unsigned char a, unsigned char b);
+static int check_diff(result_type *r, const unsigned char *a, const unsigned char *b, size_t o, size_t start, int expect);
+static void find_size(result_type *r, const unsigned char *p, size_t n);
+static void ts_packet(result_type *r, unsigned char *pa, unsigned char *pb, int pkt, long long pos,
+      unsigned char (*tails)[HIST], int expect);
+int aspect_code(char *str);
+int parse_frame_rate(char *s);
+int moi_aspect(char *mod_fname);
+int is_ts(int fd);
+static size_t first_diff(const unsigned char *a, const unsigned char *b, size_t n);
+void * mymalloc(size_t size);
+
+static char *aspect_str[] = { "forbidden", "1:1", "4:3", "16:9", "2.21:1" };
+
+
+/*****************************************************************************
+ * MAIN
+ ****************************************************************************/
+int main(int argc, char *argv[]) {
+   int c, i, files = 0, failed = 0;
+   int option_index = 0;
+   static struct option long_options[] = {
+      {"verbose",          no_argument,       0, 'v'},
+      {"help",             no_argument,       0, 'h'},
+      {"aspect",           required_argument, 0, 'a'},
+      {"frame-rate",       required_argument, 0, 'r'},
+      {"fix-display",      no_argument,       &fix_display, 1},
+      {0, 0, 0, 0}
+   };
+
+   this = argv[0];
+
+   while ( (c = getopt_long(argc, argv, "vha:r:", long_options, &option_index)) != -1 ) {
+      switch(c) {
+         case 0:
+            break;
+         case 'r':
+            if ( (rate_opt = parse_frame_rate(optarg)) == 0 ) {
+               fprintf(stderr, "%s: Error: frame rate must be 23.976, 24, 25, 29.97, 30, 50, 59.94 or 60\n", this);
+               exit(1);
+            }
+            break;
+         case 'a':
+            if ( (aspect_opt = aspect_code(optarg)) == 0 ) {
+               fprintf(stderr, "%s: Error: aspect ratio must be 1:1, 4:3, 16:9 or 2.21:1\n", this);
+               exit(1);
+            }
+            break;
+         case 'v':
+            verbose++;
+            break;
+         case 'h':
+            usage();
+            exit(1);
+         default:
+            exit(1);
+      }
+   }
+
+   if ( argc == optind || (argc - optind) % 2 != 0 ) {
+      fprintf(stderr, "%s: Error: expecting pairs of MOD and mpeg files (see -h)\n", this);
+      exit(1);
+   }
+
+   for (i = optind; i < argc; i += 2) {
+      files++;
+      if ( !verify(argv[i], argv[i + 1]) )
+         failed++;
+   }
+
+   if ( files > 1 )
+      printf("%s: %d files, %d OK, %d FAILED\n", this, files, files - failed, failed);
+
+   return failed ? 1 : 0;
+}
+
+/*****************************************************************************
+ * Compare one MOD/mpeg pair and print a one line report. Returns 1 if the
+ * mpeg is what moi should have made, 0 if not.
+ ****************************************************************************/
+int verify(char *mod_fname, char *mpeg_fname) {
+   int ma_fd, mb_fd, expect, ts;
+   unsigned char *ma, *mb;        /* MOD, mpeg. HIST bytes of history, then the block */
+   unsigned char (*tails)[HIST] = NULL;
+   size_t n, i, want = RW_BLOCK_SIZE;
+   ssize_t na, nb;
+   long long pos = 0;
+   struct stat sa, sb;
+   result_type r;
+
+   memset(&r, 0, sizeof(r));
+   r.first_bad = -1;
+
+   if ( (expect = aspect_opt ? aspect_opt : moi_aspect(mod_fname)) == 0 ) {
+      printf("FAIL %s: no aspect ratio (no .MOI next to %s, and no -a)\n", mpeg_fname, mod_fname);
+      return 0;
+   }
+
+   if ( (ma_fd = open(mod_fname, O_RDONLY)) < 0 ) {
+      printf("FAIL %s: %s: %s\n", mpeg_fname, mod_fname, strerror(errno));
+      return 0;
+   }
+   if ( (mb_fd = open(mpeg_fname, O_RDONLY)) < 0 ) {
+      printf("FAIL %s: %s\n", mpeg_fname, strerror(errno));
+      close(ma_fd);
+      return 0;
+   }
+   fstat(ma_fd, &sa);
+   fstat(mb_fd, &sb);
+   if ( sa.st_size != sb.st_size ) {
+      printf("FAIL %s: %lld bytes, %s is %lld\n", mpeg_fname,
+            (long long) sb.st_size, mod_fname, (long long) sa.st_size);
+      close(ma_fd);
+      close(mb_fd);
+      return 0;
+   }
+   posix_fadvise(ma_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+   posix_fadvise(mb_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+   /* a transport stream goes a whole number of packets at a time, with
+    * the last payload bytes of each PID kept for the next of its packets */
+   if ( (ts = is_ts(ma_fd)) != 0 ) {
+      want = RW_BLOCK_SIZE / ts * ts;
+      tails = (unsigned char (*)[HIST]) mymalloc(NPIDS * HIST);
+      memset(tails, 0xFF, NPIDS * HIST);
+   }
+
+   ma = (unsigned char *) mymalloc(HIST + RW_BLOCK_SIZE);
+   mb = (unsigned char *) mymalloc(HIST + RW_BLOCK_SIZE);
+   memset(ma, 0xFF, HIST);   /* can't look like part of a signature */
+   memset(mb, 0xFF, HIST);
+
+   while ( 1 ) {
+      na = read(ma_fd, ma + HIST, want);
+      nb = read(mb_fd, mb + HIST, want);
+      if ( na < 0 || nb < 0 ) {
+         printf("FAIL %s: read error: %s\n", mpeg_fname, strerror(errno));
+         goto fail;
+      }
+      if ( na != nb ) {
+         /* same size files, regular reads; one of them changed under us */
+         printf("FAIL %s: short read at byte %lld\n", mpeg_fname, pos + (na < nb ? na : nb));
+         goto fail;
+      }
+      if ( (n = na) == 0 )
+         break;
+      if ( r.width == 0 )
+         find_size(&r, ma + HIST, n);
+
+      if ( ts ) {
+         for (i = 0; i + ts <= n; i += ts) {
+            if ( first_diff(ma + HIST + i, mb + HIST + i, ts) < (size_t) ts )
+               ts_packet(&r, ma + HIST + i, mb + HIST + i, ts, pos + i, tails, expect);
+            else
+               ts_packet(&r, ma + HIST + i, NULL, ts, pos + i, tails, expect);
+         }
+         /* a piece of a packet at the very end has no payload to speak of */
+         for ( ; (i += first_diff(ma + HIST + i, mb + HIST + i, n - i)) < n; i++)
+            count_diff(&r, DIFF_UNEXPECTED, pos + i, ma[HIST + i], mb[HIST + i]);
+      }
+      else {
+         for (i = 0; (i += first_diff(ma + HIST + i, mb + HIST + i, n - i)) < n; i++)
+            count_diff(&r, check_diff(&r, ma, mb, HIST + i, 0, expect), pos + i, ma[HIST + i], mb[HIST + i]);
+      }
+
+      memmove(ma, ma + n, HIST);
+      memmove(mb, mb + n, HIST);
+      pos += n;
+   }
+
+   free(ma);
+   free(mb);
+   free(tails);
+   close(ma_fd);
+   close(mb_fd);
+
+   if ( r.wrong || r.rate || r.nodisplay || r.unexpected ) {
+      printf("FAIL %s: %lld unexpected differences, %lld headers with the wrong aspect ratio/frame rate"
+            " (first at byte %lld: MOD 0x%02X, mpeg 0x%02X)", mpeg_fname, r.unexpected, r.wrong + r.rate,
+            r.first_bad, r.first_mod, r.first_mpeg);
+      if ( r.rate )
+         printf(", %lld with another frame rate (made with --frame-rate? check with -r)", r.rate);
+      if ( r.nodisplay )
+         printf(", %lld display extension bytes changed (made with --fix-display? check with --fix-display)", r.nodisplay);
+      printf("\n");
+      return 0;
+   }
+   printf("OK   %s: %lld sequence headers set to %s", mpeg_fname, r.patched + r.split, aspect_str[expect]);
+   if ( r.split )
+      printf(" (%lld split across packets)", r.split);
+   if ( r.display )
+      printf(", %lld display size bytes set to %dx%d", r.display, r.width, r.height);
+   printf("\n");
+   return 1;
+
+fail:
+   free(ma);
+   free(mb);
+   free(tails);
+   close(ma_fd);
+   close(mb_fd);
+   return 0;
+}
+
+static void count_diff(result_type *r, int kind, long long pos, unsigned char a, unsigned char b) {
+   switch ( kind ) {
+      case DIFF_PATCHED:    r->patched++;    return;
+      case DIFF_SPLIT:      r->split++;      return;
+      case DIFF_DISPLAY:    r->display++;    return;
+      case DIFF_WRONG:      r->wrong++;      break;
+      case DIFF_RATE:       r->rate++;       break;
+      case DIFF_NODISPLAY:  r->nodisplay++;  break;
+      default:              r->unexpected++; break;
+   }
+   if ( verbose )
+      printf("   %lld: MOD 0x%02X, mpeg 0x%02X\n", pos, a, b);
+   if ( r->first_bad < 0 ) {
+      r->first_bad = pos;
+      r->first_mod = a;
+      r->first_mpeg = b;
+   }
+}
+
+/*
+ * What is the difference at a[o] vs b[o]? a has at least HIST bytes of the
+ * same stream before o; those before start came from earlier packets.
+ *
+ *    00 00 01 B3 .. .. .. [o]      seqh offset 7: aspect ratio, frame rate
+ *    00 00 01 B5 2x [c c c] [o]    display size, o 0-3 bytes in, after
+ *                                  the colour description if there is one
+ */
+static int check_diff(result_type *r, const unsigned char *a, const unsigned char *b, size_t o, size_t start, int expect) {
+   const unsigned char *p, *d;
+   unsigned char want;
+   int colour, j, w, h;
+
+   p = a + o - 7;
+   if ( p[0] == 0x00 && p[1] == 0x00 && p[2] == 0x01 && p[3] == 0xB3 ) {
+      if ( (b[o] >> 4) != expect )
+         return DIFF_WRONG;
+      if ( (b[o] & 0x0F) != (rate_opt ? rate_opt : (a[o] & 0x0F)) )
+         return rate_opt ? DIFF_WRONG : DIFF_RATE;
+      if ( r->width == 0 ) {
+         r->width = (p[4] << 4) | (p[5] >> 4);
+         r->height = ((p[5] & 0x0F) << 8) | p[6];
+      }
+      return o - 7 < start ? DIFF_SPLIT : DIFF_PATCHED;
+   }
+
+   for (colour = 0; colour <= 3; colour += 3) {
+      for (j = 0; j < 4; j++) {
+         p = a + o - (5 + colour + j);
+         if ( !(p[0] == 0x00 && p[1] == 0x00 && p[2] == 0x01 && p[3] == 0xB5)
+               || (p[4] >> 4) != 2 || (p[4] & 0x01) != (colour != 0) )
+            continue;
+         if ( !fix_display )
+            return DIFF_NODISPLAY;
+         if ( (w = r->width) == 0 )
+            return DIFF_WRONG;
+         h = r->height;
+         d = p + 5 + colour;
+         switch ( j ) {   /* see rewrite_display() in moi.c */
+            case 0:  want = w >> 6; break;
+            case 1:  want = ((w & 0x3F) << 2) | 0x02 | (h >> 13); break;
+            case 2:  want = (h >> 5) & 0xFF; break;
+            default: want = ((h & 0x1F) << 3) | (d[3] & 0x07); break;
+         }
+         return b[o] == want ? DIFF_DISPLAY : DIFF_WRONG;
+      }
+   }
+   return DIFF_UNEXPECTED;
+}
+
+/* the coded size from the first whole sequence header in p */
+static void find_size(result_type *r, const unsigned char *p, size_t n) {
+   const unsigned char *q;
+
+   if ( n >= 7 && (q = memmem(p, n - 3, "\x00\x00\x01\xB3", 4)) != NULL && q + 7 <= p + n ) {
+      r->width = (q[4] << 4) | (q[5] >> 4);
+      r->height = ((q[5] & 0x0F) << 8) | q[6];
+   }
+}
+
+/*
+ * One transport stream packet. Its payload goes after the last HIST
+ * payload bytes of the same PID, so a header split over packets is seen
+ * whole. pb is NULL when the packet is the same in both files, and we
+ * only need to remember its tail.
+ */
+static void ts_packet(result_type *r, unsigned char *pa, unsigned char *pb, int pkt, long long pos,
+      unsigned char (*tails)[HIST], int expect) {
+   unsigned char ca[HIST + 188], cb[HIST + 188], *h = pa + pkt - 188;
+   int pid = -1, pl = 188, len = 0, i;
+
+   /* where the payload is, if there is one we can find */
+   if ( h[0] == 0x47 ) {
+      pid = ((h[1] & 0x1F) << 8) | h[2];
+      pl = 4;
+      if ( h[3] & 0x20 )
+         pl += 1 + h[4];
+      if ( !(h[3] & 0x10) || pl > 188 )
+         pl = 188;
+      len = 188 - pl;
+   }
+
+   if ( pb ) {
+      /* anywhere but the payload, any change is wrong */
+      for (i = 0; i < pkt - 188 + pl; i++) {
+         if ( pa[i] != pb[i] )
+            count_diff(r, DIFF_UNEXPECTED, pos + i, pa[i], pb[i]);
+      }
+      if ( len ) {
+         memcpy(ca, tails[pid], HIST);
+         memcpy(ca + HIST, h + pl, len);
+         memcpy(cb, ca, HIST);
+         memcpy(cb + HIST, pb + pkt - 188 + pl, len);
+         for (i = 0; (i += first_diff(ca + HIST + i, cb + HIST + i, len - i)) < len; i++)
+            count_diff(r, check_diff(r, ca, cb, HIST + i, HIST, expect), pos + pkt - 188 + pl + i,
+                  ca[HIST + i], cb[HIST + i]);
+      }
+   }
+
+   /* keep the end of this payload for the next packet on this PID */
+   if ( len >= HIST )
+      memcpy(tails[pid], h + 188 - HIST, HIST);
+   else if ( len > 0 ) {
+      memmove(tails[pid], tails[pid] + len, HIST - len);
+      memcpy(tails[pid] + HIST - len, h + pl, len);
+   }
+}
+
+/*****************************************************************************
+ * offset of the first byte where a and b differ, n if they don't
+ ****************************************************************************/
+static size_t first_diff(const unsigned char *a, const unsigned char *b, size_t n) {
+   size_t i = 0;
+
+#if defined(__AVX2__)
+   unsigned int m;
+
+   for ( ; i + 32 <= n; i += 32) {
+      m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (a + i)),
+                                                  _mm256_loadu_si256((const __m256i *) (b + i))));
+      if ( m != 0xFFFFFFFFu )
+         return i + __builtin_ctz(~m);
+   }
+#elif defined(__SSE2__)
+   unsigned int m;
+
+   /* 64 bytes a go while it's all the same, which it nearly always is */
+   for ( ; i + 64 <= n; i += 64) {
+      __m128i e = _mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (a + i)),
+                                         _mm_loadu_si128((const __m128i *) (b + i))),
+                          _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (a + i + 16)),
+                                         _mm_loadu_si128((const __m128i *) (b + i + 16)))),
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (a + i + 32)),
+                                         _mm_loadu_si128((const __m128i *) (b + i + 32))),
+                          _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (a + i + 48)),
+                                         _mm_loadu_si128((const __m128i *) (b + i + 48)))));
+      if ( _mm_movemask_epi8(e) != 0xFFFF )
+         break;
+   }
+   for ( ; i + 16 <= n; i += 16) {
+      m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (a + i)),
+                                           _mm_loadu_si128((const __m128i *) (b + i))));
+      if ( m != 0xFFFF )
+         return i + __builtin_ctz(~m);
+   }
+#else
+   unsigned long long x, y;
+
+   for ( ; i + 8 <= n; i += 8) {
+      memcpy(&x, a + i, 8);
+      memcpy(&y, b + i, 8);
+      if ( x != y )
+         break;
+   }
+#endif
+   for ( ; i < n; i++) {
+      if ( a[i] != b[i] )
+         return i;
+   }
+   return n;
+}
+
+/*****************************************************************************
+ * sequence header aspect ratio code for "16:9" etc, 0 if we don't know it
+ ****************************************************************************/
+int aspect_code(char *str) {
+   int i;
+
+   for (i = 1; i < 5; i++) {
+      if ( strcmp(str, aspect_str[i]) == 0 )
+         return i;
+   }
+   return 0;
+}
+
+/*****************************************************************************
+ * frame rate code for -r, as moi's --frame-rate takes it, 0 if we don't
+ * know it
+ ****************************************************************************/
+int parse_frame_rate(char *s) {
+   static const double rates[] = { 0, 24000.0 / 1001, 24, 25, 30000.0 / 1001, 30, 50, 60000.0 / 1001, 60 };
+   double r;
+   char *e;
+   int c;
+
+   r = strtod(s, &e);
+   if ( e == s || *e != '\0' )
+      return 0;
+   for (c = 1; c <= 8; c++) {
+      if ( r > rates[c] - 0.01 && r < rates[c] + 0.01 )
+         return c;
+   }
+   return 0;
+}
+
+/*****************************************************************************
+ * aspect ratio code from the MOI file next to mod_fname, the same way moi
+ * reads it (see get_moi_info() in moi.c). 0 if there isn't one.
+ ****************************************************************************/
+int moi_aspect(char *mod_fname) {
+   char moi_fname[MAX_PATH_LEN];
+   size_t len = strlen(mod_fname);
+   int fd, tries;
+   unsigned char ar;
+
+   if ( len < 4 || len >= MAX_PATH_LEN )
+      return 0;
+   for (tries = 0; tries < 2; tries++) {
+      memcpy(moi_fname, mod_fname, len - 4);
+      strcpy(moi_fname + len - 4, tries ? ".moi" : ".MOI");
+      if ( (fd = open(moi_fname, O_RDONLY)) >= 0 )
+         break;
+   }
+   if ( fd < 0 )
+      return 0;
+   if ( pread(fd, &ar, 1, 0x80) != 1 )
+      ar = 0;
+   close(fd);
+
+   if ( ar == 0x40 || ar == 0x50 || ar == 0x51 )
+      return aspect_code("4:3");
+   if ( ar == 0x44 || ar == 0x54 || ar == 0x55 )
+      return aspect_code("16:9");
+   fprintf(stderr, "%s: unknown aspect ratio value in %s: %02X\n", this, moi_fname, ar);
+   return 0;
+}
+
+/*****************************************************************************
+ * packet size if fd looks like an MPEG transport stream (.TOD), 0 if not
+ ****************************************************************************/
+int is_ts(int fd) {
+   unsigned char b[4 * 192];
+   int i, pkt;
+
+   if ( pread(fd, b, sizeof(b), 0) != sizeof(b) )
+      return 0;
+   for (pkt = 188; pkt <= 192; pkt += 4) {
+      for (i = 0; i < 4 && b[i * pkt + pkt - 188] == 0x47; i++)
+         ;
+      if ( i == 4 )
+         return pkt;
+   }
+   return 0;
+}
+
+/*****************************************************************************
+ * print usage message
+ ****************************************************************************/
+void usage() {
+   printf(" NAME\n");
+   printf("    %s - check mpeg files made by moi against their MOD files\n", this);
+   printf("\n");
+   printf(" SYNOPSIS\n");
+   printf("    %s [-v] [-a aspect] [-r rate] [--fix-display] file.MOD file.mpeg [...]\n", this);
+   printf("\n");
+   printf(" DESCRITION\n");
+   printf("    Makes sure the only bytes that differ between each MOD and its mpeg\n");
+   printf("    are the aspect ratios moi set in the sequence headers, and that\n");
+   printf("    they were set to what the MOI file says. Prints one OK or FAIL line\n");
+   printf("    per pair, and exits non-zero if any failed.\n");
+   printf("\n");
+   printf(" OPTIONS\n");
+   printf("    -a, --aspect=1:1|4:3|16:9|2.21:1\n");
+   printf("             Expected aspect ratio. By default it is read from the .MOI\n");
+   printf("             file next to each MOD file.\n");
+   printf("\n");
+   printf("    -r, --frame-rate=rate\n");
+   printf("             The mpeg was made with moi --frame-rate=rate: every sequence\n");
+   printf("             header should have it rather than the MOD's frame rate.\n");
+   printf("\n");
+   printf("    --fix-display\n");
+   printf("             The mpeg was made with moi --fix-display: the display size in\n");
+   printf("             sequence display extensions may be set to the coded size.\n");
+   printf("             Without it, such changes fail.\n");
+   printf("\n");
+   printf("    -v, --verbose\n");
+   printf("             List the offset of every byte that shouldn't differ.\n");
+   printf("\n");
+   printf("    -h, --help\n");
+   printf("             Prints this help message\n");
+   printf("\n");
+}
+
+/*************************************************************************
+ * combine malloc with error check and die
+ ************************************************************************/
+void * mymalloc(size_t size) {
+   void *p = NULL;
+
+   if ( (p = malloc(size)) == NULL ) {
+      fprintf(stderr, "cannot allocate memory");
+      exit(1);
+   }
+   return p;
+}
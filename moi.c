@@ -112,6 +112,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>    /* strcpy, strdup, etc */
+#include <strings.h>   /* strcasecmp */
+#include <ctype.h>     /* tolower */
 #include <sys/types.h> /* stat, mkdir */
 #include <sys/stat.h>  /* stat, mkdir */
 #include <errno.h>
@@ -121,7 +123,52 @@
 #include <libgen.h>    /* basename, dirname */
 #include <getopt.h>    /* getopt_long */
 //#include <ftw.h>       /* recursive directory traversal - not portable... */
-//#include <fcntl.h>     /* old, lower level file stuff - open, read, etc */
+#include <fcntl.h>     /* open, O_EXCL, etc */
+#include <sys/wait.h>  /* waitpid */
+#include <sys/statvfs.h> /* statvfs */
+#include <sys/sysmacros.h> /* major, minor */
+#include <stdarg.h>    /* va_list */
+#include <limits.h>    /* PIPE_BUF */
+#include <pthread.h>   /* log writer thread */
+#include <signal.h>    /* sigaction */
+#include <sys/mman.h>  /* mmap */
+#include <sys/file.h>  /* flock */
+#include <sys/socket.h> /* --serve */
+#include <sys/un.h>
+#include "scan.h"      /* seqh_find */
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>      /* FS_IOC_FIEMAP */
+#include <linux/fiemap.h>  /* struct fiemap */
+#include <sys/prctl.h>     /* PR_SET_PDEATHSIG */
+#endif
+
+/*
+ * Static tracepoints, for perf/bpftrace on a running moi without -v:
+ *
+ *    file__start(mod)              file__done(mod, outputs written)
+ *    block__read(blk, bytes)       block__write(blk, bytes)
+ *    seqh__patch(blk, n, arfr)     seqh__reject(blk, n)
+ *    moi__start(moi)               moi__done(moi, ok)
+ *    mkdir__start(dir, reldir)     mkdir__done(dir, reldir, result)
+ *
+ * e.g. bpftrace -e 'usdt:./moi:moi:block__read { @[arg1] = count(); }'
+ * They are USDT probes (a nop each) where <sys/sdt.h> is around, and
+ * nothing at all otherwise or with -DMOI_NO_PROBES.
+ */
+#if !defined(MOI_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE1(name, a)       DTRACE_PROBE1(moi, name, a)
+#define PROBE2(name, a, b)    DTRACE_PROBE2(moi, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(moi, name, a, b, c)
+#endif
+#endif
+#ifndef PROBE1
+#define PROBE1(name, a)       do { } while (0)
+#define PROBE2(name, a, b)    do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+#endif
 
 
 #ifndef FALSE
@@ -133,8 +180,67 @@
 
 #define MAX_PATH_LEN 2048        /* max length for a path/filename string */
 #define RW_BLOCK_SIZE 1048576    /* read 1MB chunks at a time */
+#define PREFETCH_LEN (8 * RW_BLOCK_SIZE) /* of the next MOD, read ahead as this one ends */
 #define MTIME_DATE 1
 #define MOI_DATE   2
+#define NAME_INDEX_INIT_SIZE 64  /* initial slots in a destination name index */
+#define CHECKPOINT_BLOCKS 64     /* commit a checkpoint every 64 blocks (64MB) */
+#define CHECKPOINT_MAGIC "MOICKPT3"
+#define MAX_DESTS 8              /* max number of -d options */
+#define FSYNC_NONE       0       /* never fsync outputs */
+#define FSYNC_CHECKPOINT 1       /* fdatasync at each checkpoint (default) */
+#define FSYNC_CLOSE      2       /* ... and fsync each file before closing it */
+#define TAR_BLOCK 512            /* tar record size */
+#define LOG_RING_SIZE 262144     /* per thread log buffer */
+#define LOG_LINE_MAX  2048       /* longest single log message */
+#define LOG_INTERVAL_MS 50       /* how often the log writer wakes up on its own */
+#define CATALOG_NAME  ".moi-catalog"  /* default catalog, in the first -d dir */
+#define CATALOG_MAGIC "MOICAT01"
+#define JOURNAL_MAGIC "MOIJRNL1"
+#define IN_PLACE_FIX      1      /* --in-place */
+#define IN_PLACE_ROLLBACK 2      /* --in-place=rollback */
+#define TS_PROBE_PACKETS 4       /* sync bytes that must line up to call it a TS */
+#define REWRITE_LEN 12           /* bytes of header, signature and all, a rewrite rule may use */
+#define TS_TAIL (REWRITE_LEN - 1) /* bytes a header can still be pending on */
+#define DEMUX_SYNC    0          /* demux_feed(): looking for a start code */
+#define DEMUX_HEADER  1          /*    collecting the bytes after one */
+#define DEMUX_SKIP    2          /*    skipping a packet we don't want */
+#define DEMUX_PAYLOAD 3          /*    passing a stream on */
+#define POSTER_MAX_LEN (8 * 1024 * 1024) /* most video we hold for a poster frame */
+#define TS_MAX_AUDIO  8          /* audio PIDs we keep from the PMT */
+#define SIDECAR_MAX   8          /* --demux: most elementary streams per mpeg */
+#define SIDECAR_BUF_SIZE (256 * 1024) /* ... and what we hold of each before writing */
+#define MP4_MAX_TRACKS 4         /* --mp4: video and up to three audio streams */
+#define MP4_FRAG_MAX (16 * 1024 * 1024) /* most sample data we hold for one fragment */
+#define MP4_VIDEO     1          /* mp4 track kinds */
+#define MP4_MPA       2
+#define MP4_AC3       3
+#define SERVE_LINE_MAX (4 * MAX_PATH_LEN) /* --serve: longest job line */
+#define SERVE_MAX_ARGS 64        /* ... and most words in one */
+#define LAYOUT_DATE    0         /* --layout: dest_dir/YYYY/MM/DD/mov-*.mpeg */
+#define LAYOUT_SHARDED 1         /*    dest_dir/objects/ab/cd/<key>.mpeg */
+#define SHARD_DIR "objects"      /* ... under each dest dir */
+#define SHARD_KEY_LEN 16         /* hex digits in a key */
+#define SHARD_SAMPLE (64 * 1024) /* bytes from each end of the MOD that go into it */
+#define SHARD_MAKE 0             /* shard_claim(): ours to make (or finish) */
+#define SHARD_DONE 1             /*    archived already */
+#define SHARD_BUSY 2             /*    another worker is making it */
+#define HASH_SEED 14695981039346656037ULL /* FNV-1a offset basis, see block_hash() */
+#define PROGRESS_TTY   1         /* --progress: one line on stderr, redrawn */
+#define PROGRESS_LINES 2         /*    a log line every so often */
+#define PROGRESS_TTY_NS   500000000LL   /* how often each is updated */
+#define PROGRESS_LINES_NS 10000000000LL
+#define TS_MAX_HOLD (RW_BLOCK_SIZE / 4) /* most we hold back waiting for the rest of one */
+#define THROTTLE_READ  0
+#define THROTTLE_WRITE 1
+#define THROTTLE_SLICE_NS 100000000LL /* longest single sleep in throttle_io() */
+#define LOG_TEXT 0               /* --log-format: messages as they always were */
+#define LOG_KV   1               /* --log-format: one key=value record per line */
+
+/* log a message if we are at least this verbose; arguments are not even
+ * evaluated otherwise */
+#define LOG(level, event, ...) \
+   do { if ( verbose >= (level) ) log_msg((level), (event), __VA_ARGS__); } while (0)
 
 //typedef struct stat Stat;
 
@@ -160,20 +266,421 @@ typedef struct moi_info {
    char          now_sec[24];        /* cheesy hack to make unique file names */
 } moi_info_type;
 
+typedef struct name_index {
+   /* every file name in one destination directory, loaded with a single
+    * listing and then kept up to date as we hand out names */
+   char          *dir;
+   char         **slots;          /* open addressing hash table of names */
+   size_t         size;           /* number of slots, always a power of 2 */
+   size_t         count;          /* number of names stored */
+   struct name_index *next;
+} name_index_type;
+
+typedef struct checkpoint {
+   /* progress of one in-progress mpeg, kept next to it as .mov-*.mpeg.ckpt
+    * so an interrupted conversion can pick up where it left off */
+   char          magic[8];
+   char          mod_fname[MAX_PATH_LEN]; /* real path of the source */
+   long long     mod_size;
+   long long     mod_mtime;
+   long long     committed;        /* bytes of mpeg known to be on disk */
+   unsigned long long tail_hash;   /* hash of the last committed block ... */
+   int           tail_len;         /* ... and its length */
+   int           blk;              /* scan state at the commit */
+   int           seqh;
+   unsigned char reference_seqh[12];
+   unsigned char arfr;
+   int           video_pid;        /* transport stream: where the video is */
+   unsigned char ar;               /* the rules it was made with, which a */
+   unsigned char fr;               /* resume has to have too, see */
+   unsigned char fix_display;      /* rewrite_compile() */
+   int           ext;
+} checkpoint_type;
+
+typedef struct dest {
+   /* one -d destination directory */
+   char            *dir;           /* absolute path */
+   int              dirfd;         /* open handle on dir */
+   name_index_type *dir_cache;     /* dirs under dir known to exist */
+   int              fsync_mode;    /* FSYNC_* */
+   dev_t            dev;
+} dest_type;
+
+typedef struct output {
+   /* one mpeg being written for the job in hand, one per destination */
+   dest_type      *dest;
+   char            fname[MAX_PATH_LEN];
+   int             fd;
+   FILE           *fp;
+   checkpoint_type ckpt;
+   int             failed;         /* stopped writing this one after an error */
+   int             stream;         /* sequential only: no seeking, no checkpoints */
+   long long       size;           /* stream: exactly how many bytes to write, -1 for
+                                    * a sink that checks for itself */
+} output_type;
+
+typedef struct job {
+   /* one MOD/MOI pair waiting to be converted */
+   char          *mod_fname;
+   char          *moi_fname;
+   char          *mpeg_reldir;     /* YYYY/MM/DD, relative to each dest dir ("" if -m) */
+   moi_info_type *info;
+   off_t          mod_size;
+   off_t          moi_size;
+   dev_t          dev;             /* source device */
+   long long      phys;            /* where the MOD starts on dev, see plan_jobs() */
+   int            lane;            /* which worker reads this job */
+} job_type;
+
+typedef struct catalog_hdr {
+   /* start of the catalog file; the records and the names follow */
+   char          magic[8];
+   unsigned int  count;            /* records */
+   unsigned int  strtab_len;       /* bytes of NUL terminated names */
+} catalog_hdr_type;
+
+typedef struct catalog_rec {
+   /* one mpeg we made, see catalog_add() */
+   long long     when;             /* recording time from the MOI, YYYYMMDDHHMM */
+   long long     mtime;            /* of the MOI */
+   long long     mod_size;         /* = mpeg size */
+   long long     moi_size;
+   unsigned int  mod_name;         /* offsets of the names in the string table */
+   unsigned int  moi_name;
+   unsigned int  mpeg_name;
+   unsigned char aspect_ratio;     /* as found in the MOI */
+   unsigned char pad[3];
+} catalog_rec_type;
+
+typedef struct rewrite rewrite_type;
+typedef int (*rewrite_fn)(rewrite_type *rw, unsigned char *p, int blk);
+
+struct rewrite {
+   /* the header fixes make_mpeg() applies, see rewrite_compile() */
+   rewrite_fn    on[256];          /* by start code, NULL to leave alone */
+   int           seqh_only;        /* no rules but the sequence header's */
+   unsigned char ar;               /* aspect ratio code the seqh gets */
+   unsigned char fr;               /* frame rate code, 0 to keep the MOD's */
+   /* scan state, kept in checkpoints */
+   unsigned char reference_seqh[12];
+   unsigned char arfr;             /* seqh offset 7 */
+   int           seqh;             /* sequence headers found */
+   int           ext;              /* display extensions patched */
+};
+
+typedef struct ts {
+   /* where make_mpeg() is in a transport stream */
+   int            pkt;             /* packet size, 188 or 192; 0 if not a TS */
+   int            sync;            /* offset of the 0x47 sync byte in a packet */
+   int            pmt_pid;         /* -1 until we've seen the PAT */
+   int            video_pid;       /* -1 until we've seen the PMT */
+   int            audio_pid[TS_MAX_AUDIO]; /* and the audio, for --demux */
+   int            audio_stream[TS_MAX_AUDIO]; /* demux stream of each, see ts_psi() */
+   int            naudio;
+   unsigned char *tail[TS_TAIL];   /* last bytes of video payload, oldest first */
+   int            ntail;
+   int            lost_sync;       /* packets without a sync byte */
+} ts_type;
+
+typedef struct extent {
+   /* a run of adjacent clusters of a file in a card image */
+   long long     off;              /* in the file */
+   long long     phys;             /* in the image */
+   long long     len;
+} extent_type;
+
+typedef struct image_file {
+   /* a file or directory in the card image */
+   char         *path;             /* /DIR/NAME, "" for the root */
+   int           is_dir;
+   long long     size;
+   time_t        mtime;
+   extent_type  *ext;              /* where it is, in order */
+   int           next;
+} image_file_type;
+
+typedef struct image {
+   /* the FAT32/exFAT card image --image reads from, see image_open() */
+   char            *fname;
+   int              fd;
+   dev_t            dev;
+   int              exfat;
+   long long        base;          /* where the file system starts in the image */
+   long long        heap;          /* ... and cluster 2 */
+   long long        cluster_size;
+   unsigned int    *fat;
+   unsigned int     nclusters;     /* FAT entries, counting the first two */
+   unsigned char   *dir_seen;      /* a bit per cluster: directories walked, see image_add() */
+   image_file_type *files;         /* everything in it, sorted by path */
+   int              nfiles, size;
+} image_type;
+
+typedef struct image_stream {
+   /* src_fopen() of a file in the image */
+   image_file_type *file;
+   long long        pos;
+   int              ext;           /* extent pos was last in */
+} image_stream_type;
+
+typedef struct demux demux_type;
+
+struct demux {
+   /* pulls the elementary streams out of an mpeg, see demux_feed() */
+   ts_type      *ts;               /* transport stream state, if it is one */
+   void        (*es)(demux_type *dm, int stream, unsigned char *p, size_t n); /* gets them */
+   void         *arg;              /* for es */
+   int           done;             /* es has all it wants */
+   int           state;            /* DEMUX_* */
+   unsigned int  sc;               /* last four bytes, for start codes */
+   int           code;             /* start code of the header in hand */
+   unsigned char hdr[5 + 255 + 7]; /* bytes after it we have ... */
+   int           nhdr, need;       /* ... how many, and how many we want */
+   int           pes;              /* length of the whole PES header, once known */
+   long long     left;             /* bytes left of the packet in hand */
+   int           stream;           /* what the payload in hand is */
+   long long     pts;              /* its PTS (90kHz) while es has its first bytes, else -1 */
+   int           video;            /* stream id we follow, -1 for the first */
+   int           audio;            /* pass the audio streams on too */
+};
+
+typedef struct poster {
+   /* --poster: the I-frame we are after, see poster_es() */
+   output_type   *out;             /* mpegs it goes next to */
+   int            nout;
+   int            seen;            /* I-frames so far */
+   unsigned char *seq;             /* last whole sequence header, extensions and all */
+   size_t         nseq;
+   unsigned char *buf;             /* video we may still need */
+   size_t         len, size;
+   size_t         scan;            /* start codes before this are done with */
+   long           seq_at, pic_at;  /* where they are in buf, -1 if not */
+   int            done;            /* written, or given up on */
+} poster_type;
+
+typedef struct sidecar {
+   /* --demux: one elementary stream, written next to each mpeg */
+   int            stream;          /* demux stream, see sidecar_ext() */
+   int            fd[MAX_DESTS];   /* -1 where it isn't being written */
+   unsigned char *buf;             /* SIDECAR_BUF_SIZE, written out when full */
+   size_t         len;
+   long long      size;            /* bytes so far */
+} sidecar_type;
+
+typedef struct mp4_buf {
+   unsigned char *p;
+   size_t         len, size;
+} mp4_buf_type;
+
+typedef struct mp4_sample {
+   unsigned int   size, duration, flags;
+   int            cts;             /* composition time - decode time */
+} mp4_sample_type;
+
+typedef struct mp4_track {
+   /* one stream of an mp4, see mp4_es() */
+   int            stream;          /* demux stream */
+   int            kind;            /* MP4_* */
+   int            id;              /* track_ID once it is in the moov, else 0 */
+   int            ok;              /* we know enough to describe it */
+   unsigned int   timescale, dur;  /* of one sample (video: one frame) */
+   long long      first_pts;       /* 90kHz, -1 until seen */
+   int            first_cts;       /* composition offset of the first sample */
+   long long      dts;             /* decode time of the fragment in hand */
+   mp4_buf_type   es;              /* elementary stream not yet cut into samples */
+   mp4_buf_type   data;            /* samples for the fragment in hand ... */
+   mp4_sample_type *smp;           /* ... and what they are */
+   int            nsmp, smp_size;
+   mp4_buf_type   config;          /* sequence header and extensions, or dac3 */
+   int            rate, channels;  /* audio */
+   size_t         scan;            /* video: start codes in es before this are done with */
+   long           au_at, cfg_at;   /* where the access unit and config start in es, -1 if not */
+   int            au_pic, au_type, au_tref; /* picture in the access unit */
+   int            synced;          /* seen the first I-frame */
+   long long      decoded, gop_base; /* frames so far, and at the last GOP header */
+} mp4_track_type;
+
+typedef struct mp4 {
+   /* --mp4: a fragmented mp4 next to each mpeg, see mp4_es() */
+   output_type   *out;
+   int            nout;
+   FILE          *fp[MAX_DESTS];   /* NULL where it isn't being written */
+   mp4_track_type trk[MP4_MAX_TRACKS];
+   int            ntrk;
+   int            started;         /* ftyp and moov are out; -1 if we gave up */
+   unsigned int   seq;             /* fragments so far */
+   long long      held;            /* sample bytes waiting for the next fragment */
+} mp4_type;
+
+typedef struct split {
+   /* where make_mpeg() sends the streams demux_feed() finds */
+   output_type   *out;             /* mpegs they go next to */
+   int            nout;
+   poster_type   *pf;              /* --poster, NULL if not */
+   int            demux;           /* --demux */
+   mp4_type      *mp4;             /* --mp4, NULL if not */
+   sidecar_type   side[SIDECAR_MAX];
+   int            nside;
+   int            full;            /* side[] ran out, and we said so */
+} split_type;
+
+typedef struct patch {
+   /* --in-place: one byte make_mpeg() changed */
+   long long      off;
+   unsigned char  was, now;
+} patch_type;
+
+typedef struct journal {
+   /* head of the .<file>.fix journal, followed by npatch patch_types */
+   char           magic[8];
+   long long      size;            /* of the file being patched */
+   int            npatch;
+   unsigned long long hash;        /* block_hash() of the patches */
+} journal_type;
+
+typedef struct patch_sink {
+   /* --in-place: what make_mpeg() writes to. Compares, doesn't write. */
+   int            fd;              /* the file, read only */
+   long long      off;             /* where the next write would go */
+   int            lost;            /* the file came up short of what was written */
+   unsigned char *orig;            /* what is there now */
+   patch_type    *patch;           /* bytes that differ, in file order */
+   int            npatch, size;
+} patch_sink_type;
+
+typedef struct bucket {
+   double         rate;            /* per second, 0 = unlimited */
+   double         tokens;          /* negative = debt still to be slept off */
+   long long      last;            /* when tokens was last topped up (ns) */
+   int            gen;             /* bumped when the rate changes */
+} bucket_type;
+
+typedef struct throttle {
+   /* --read-limit etc. Lives in shared memory so every worker draws on the
+    * same buckets */
+   pthread_mutex_t lock;           /* process shared */
+   bucket_type    read;            /* bytes */
+   bucket_type    write;           /* bytes, counting each destination */
+   bucket_type    ops;             /* read and write calls */
+   int            reload;          /* SIGHUP seen, re-read the control file */
+   long long      ctl_mtime;       /* control file as of the last read */
+   long long      ctl_checked;     /* when we last looked at it */
+} throttle_type;
+
+typedef struct serve_stats {
+   /* --serve: what the job in hand has done, counted by the process running
+    * it and reported by its worker. Shared memory. */
+   int            files;           /* MOD files converted or tried */
+   int            mpegs;           /* mpegs written (or files fixed in place) */
+   int            failed;          /* files that got none */
+   long long      bytes;           /* in those MOD files */
+} serve_stats_type;
+
+typedef struct progress_slot {
+   /* --progress: one running worker's counters. Only that worker writes
+    * them and each has a cache line to itself, so counting a block is an
+    * add nobody else contends for */
+   long long      read;            /* bytes read from MODs and MOIs */
+   long long      done;            /* ... and the bytes of jobs that needed less */
+   long long      job_read;        /* read for the job in hand */
+   int            files;           /* jobs finished */
+   char           pad[64 - 3 * sizeof(long long) - sizeof(int)];
+} progress_slot_type;
+
+typedef struct progress {
+   /* --progress: set up by run_jobs(), shared with the -j workers */
+   long long           total;      /* bytes in every MOD and MOI planned */
+   long long           start;      /* now_ns() */
+   int                 nfiles;
+   int                 nslots;     /* max_workers */
+   progress_slot_type *slots;      /* in the same mapping */
+} progress_type;
+
+typedef struct log_ring {
+   /* log messages queued by one thread. head and tail only ever grow;
+    * head is moved by the owning thread, tail by whoever drains it */
+   char            *buf;
+   size_t           head;
+   size_t           tail;
+   struct log_ring *next;
+} log_ring_type;
+
+typedef struct log_rec {
+   /* queued ahead of each message */
+   struct timespec  ts;
+   const char      *event;         /* always a string literal */
+   int              level;
+   int              len;           /* message bytes that follow */
+} log_rec_type;
+
 
 /*
  * globals
  */
 char *this;
 int verbose = 0;
-char *dest_dir;
+dest_type dests[MAX_DESTS];  /* where the mpegs go, one copy in each */
+int ndests = 0;
+int fsync_mode = FSYNC_CHECKPOINT; /* fsync policy for the -d options that follow */
+char *tar_fname = NULL;      /* if set, write everything to this tar file ("-" = stdout) */
+FILE *tar = NULL;
+name_index_type *tar_names = NULL; /* every path written to the tar so far */
 int make_dirs = 1;           /* if set, create seperate directories for each date */
 int recursive = 0;           /* if set, process subdirs */
 int date_to_use = MOI_DATE;  /* default to using date in MOI file */
 int info_only = 0;           /* if set, don't copy, only report MOI info */
 int noclobber = 1;           /* if set, do not overwrite existing mpeg files */
-static char *mod_suffix[] = { ".mod", ".MOD", NULL };
+int max_workers = 1;         /* max conversions to run at once */
+int plan_only = 0;           /* if set, report what we would do and stop */
+int resume = 1;              /* if set, finish interrupted mpegs rather than starting over */
+name_index_type *name_indexes = NULL;  /* one per destination directory */
+job_type *jobs = NULL;                 /* MOD/MOI pairs found by process_dir() */
+int njobs = 0;
+int jobs_size = 0;
+double read_limit = 0;       /* bytes/sec, 0 = unlimited */
+double write_limit = 0;
+double iops_limit = 0;
+char *throttle_fname = NULL; /* control file for the above, re-read when it changes */
+throttle_type *throttle = NULL;        /* NULL unless some limit was asked for */
+char *catalog_fname = NULL; /* where to record what we make, NULL for nowhere */
+int use_catalog = 1;         /* --no-catalog clears */
+int query = 0;               /* if set, answer from the catalog and stop */
+char *query_from = NULL;     /* --query filters */
+char *query_to = NULL;
+char *query_aspect = NULL;
+int fix_display = 0;         /* --fix-display */
+int poster_nth = 0;          /* --poster: save this I-frame, 0 for none */
+int demux_es = 0;            /* --demux */
+int in_place = 0;            /* --in-place: IN_PLACE_FIX or IN_PLACE_ROLLBACK */
+int make_mp4 = 0;            /* --mp4 */
+int layout = LAYOUT_DATE;    /* --layout */
+int progress_mode = 0;       /* --progress: PROGRESS_TTY or PROGRESS_LINES */
+progress_type *progress = NULL;        /* ... its counters, see progress_read() */
+int progress_slot = 0;       /* ... and which of them are ours */
+pthread_t progress_thread;
+pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t progress_wake = PTHREAD_COND_INITIALIZER;
+int progress_stop = 0;
+int prefetch = 1;            /* --no-prefetch clears */
+job_type *next_job = NULL;   /* queued after the one in hand, see prefetch_job() */
+char *image_fname = NULL;    /* --image: read from this card image */
+image_type *image = NULL;    /* ... once it is open */
+unsigned char frame_rate = 0; /* --frame-rate code, 0 to keep the MOD's */
+char *scanner = NULL;        /* --scanner, else what moi-scanbench recorded */
+char *serve_path = NULL;     /* --serve: take jobs on this socket */
+serve_stats_type *job_stats = NULL; /* --serve: the job in hand, see count_job() */
+volatile sig_atomic_t serve_stop = 0; /* --serve: SIGTERM or SIGINT seen */
+int log_format = LOG_TEXT;
+log_ring_type *log_rings = NULL;       /* every thread's ring, see log_msg() */
+static __thread log_ring_type *log_ring = NULL;
+pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;
+pthread_t log_thread;
+int log_running = 0;         /* writer thread started in this process */
+int log_stop = 0;
+pid_t log_pid;
+static char *mod_suffix[] = { ".mod", ".MOD", ".tod", ".TOD", NULL };
 static char *moi_suffix[] = { ".moi", ".MOI", NULL };
+static char *mpeg_suffix[] = { ".mpeg", NULL };
 static char *mpeg_seqh_ar_codes[] = {   /* mpeg sequence header aspect ratio codes */
    "forbidden!",
    "1:1",
@@ -196,6 +703,50 @@ static char *mpeg_seqh_fr_codes[] = {   /* mpeg sequence header frame rate codes
    "reserved","reserved","reserved","reserved","reserved","reserved","reserved"
 }; /* 9-15 reserved */
 
+/* getopt_long structures, for the command line and for --serve jobs */
+static struct option long_options[] = {
+   {"verbose",          no_argument,       0, 'v'},
+   {"help",             no_argument,       0, 'h'},
+   {"info",             no_argument,       0, 'i'},
+   {"clobber",          no_argument,       0, 'c'},
+   {"modification-time",no_argument,       0, 't'},
+   {"mtime",            no_argument,       0, 't'},  /* alias */
+   {"make-dirs",        no_argument,       0, 'm'},  /* c for create dirs */
+   {"recursive",        no_argument,       0, 'r'},
+   {"mod-file",         required_argument, 0, 'f'},
+   {"src-dir",          required_argument, 0, 's'},
+   {"dest-dir",         required_argument, 0, 'd'},
+   {"fsync",            required_argument, 0, 'F'},
+   {"tar",              required_argument, 0, 'T'},
+   {"jobs",             required_argument, 0, 'j'},
+   {"plan",             no_argument,       0, 'n'},
+   {"no-resume",        no_argument,       &resume, 0},
+   {"log-format",       required_argument, 0, 'L'},
+   {"scanner",          required_argument, 0, 'S'},
+   {"catalog",          required_argument, 0, 'K'},
+   {"no-catalog",       no_argument,       &use_catalog, 0},
+   {"no-prefetch",      no_argument,       &prefetch, 0},
+   {"fix-display",      no_argument,       &fix_display, 1},
+   {"demux",            no_argument,       &demux_es, 1},
+   {"mp4",              no_argument,       &make_mp4, 1},
+   {"frame-rate",       required_argument, 0, 'P'},
+   {"poster",           optional_argument, 0, 'I'},
+   {"image",            required_argument, 0, 'J'},
+   {"in-place",         optional_argument, 0, 'G'},
+   {"serve",            required_argument, 0, 'U'},
+   {"layout",           required_argument, 0, 'Y'},
+   {"progress",         optional_argument, 0, 'Z'},
+   {"query",            no_argument,       0, 'Q'},
+   {"from",             required_argument, 0, 'B'},
+   {"to",               required_argument, 0, 'E'},
+   {"aspect",           required_argument, 0, 'A'},
+   {"read-limit",       required_argument, 0, 'R'},
+   {"write-limit",      required_argument, 0, 'W'},
+   {"iops",             required_argument, 0, 'O'},
+   {"throttle-file",    required_argument, 0, 'C'},
+   {0, 0, 0, 0}
+};
+
 
 /*
  * function prototypes
@@ -208,16 +759,170 @@ static int isdir(char *name);
 int ignore_ent(char *name);
 //int is_search_ent(char *fname);
 int is_file_type(char *fname, char **suffixes);
+void queue_sources(char *src_dir, char *src_file);
 void process_dir(char *dirname);
 void process_file(char *dir, char *fname);
 void process_mod(char *dir, char *fname);
+void add_job(char *mod_fname, char *moi_fname, char *mpeg_reldir, moi_info_type *info);
+void plan_jobs();
+void run_jobs();
+void print_plan();
+int check_space();
+void run_lane(int lane);
+void prefetch_job(job_type *job);
+static void prefetch_file(char *fname, long long len);
+void process_job(job_type *job);
+long long first_extent(int fd);
+int is_rotational(dev_t dev);
 int file_exists(char *fname);
-void make_mpeg(char *mod_fname, char *output_dir, moi_info_type *info);
-void copy_moi(char *moi_fname, char *output_dir, moi_info_type *info);
+name_index_type *new_name_index(char *dir);
+name_index_type *get_name_index(char *dir);
+int name_index_has(name_index_type *idx, char *name);
+void name_index_add(name_index_type *idx, char *name);
+void next_dest_name(name_index_type *idx, char *base, char *name);
+int claim_dest_name(char *dir, char *base, char *dest_fname);
+int make_mpeg(char *mod_fname, output_type *out, int nout, moi_info_type *info);
+void rewrite_compile(rewrite_type *rw, moi_info_type *info);
+static unsigned char *rewrite_find(rewrite_type *rw, unsigned char *p, unsigned char *lim);
+static int rewrite_seqh(rewrite_type *rw, unsigned char *p, int blk);
+static int rewrite_display(rewrite_type *rw, unsigned char *p, int blk);
+int parse_frame_rate(char *s);
+int ts_detect(FILE *f, ts_type *ts);
+unsigned char *ts_scan(ts_type *ts, unsigned char *buf, unsigned char *from, unsigned char *end,
+      rewrite_type *rw, int blk);
+void ts_rebase(ts_type *ts, long off);
+static void ts_video(ts_type *ts, unsigned char *pl, unsigned char *pe, rewrite_type *rw, int blk);
+static void ts_psi(ts_type *ts, int pid, unsigned char *pl, unsigned char *pe);
+int write_outputs(output_type *out, int nout, unsigned char *buf, size_t len);
+void output_failed(output_type *out, char *what);
+void tar_job(job_type *job);
+void tar_dirs(char *reldir, time_t mtime);
+void tar_header(char *name, long long size, time_t mtime, char type);
+void tar_pad(off_t size);
+void tar_file(char *name, char *fname, off_t size, time_t mtime);
+void tar_finish();
+void init_checkpoint(checkpoint_type *ckpt, char *mod_fname);
+void checkpoint_fname(char *ckpt_fname, char *mpeg_fname);
+int write_checkpoint(checkpoint_type *ckpt, char *mpeg_fname, int sync);
+int find_checkpoint(checkpoint_type *ckpt, char *mod_fname, char *dir, char *base, char *dest_fname);
+static unsigned long long block_hash(unsigned char *p, size_t len);
+static unsigned long long hash_more(unsigned long long h, unsigned char *p, size_t len);
+void copy_moi(char *moi_fname, output_type *out, int nout);
 int set_mpeg_ar(FILE *mpeg, char *moi_ar_str);
 void * mymalloc(size_t size);
-static int do_mkdir(const char *path, mode_t mode);
-int mkpath(const char *path, mode_t mode);
+void * myrealloc(void *p, size_t size);
+int add_dest(char *dir);
+int make_date_dir(dest_type *dest, char *reldir);
+char *aspect_ratio_name(unsigned char ar);
+void catalog_add(job_type *job, char *mpeg_fname);
+int catalog_merge(int wait);
+static catalog_hdr_type *catalog_fold(char *tail_fname, size_t *image_len, unsigned int *added);
+catalog_hdr_type *catalog_map(char *fname, size_t *len);
+static int catalog_cmp(long long when_a, char *mpeg_a, long long when_b, char *mpeg_b);
+static unsigned int catalog_str(char **tab, size_t *len, size_t *size, char *s);
+static long long catalog_when(moi_info_type *info);
+static long long catalog_date(char *s, char fill);
+void catalog_query();
+int image_open(char *fname);
+static void image_add(char *path, int is_dir, long long size, time_t mtime, unsigned int cluster, int contiguous);
+static void image_fat_dir(char *dir, unsigned char *buf, long long size);
+static void image_exfat_dir(char *dir, unsigned char *buf, long long size);
+static time_t dos_time(unsigned int date, unsigned int time);
+static int cmp_image_file(const void *a, const void *b);
+image_file_type *image_lookup(char *fname);
+static char *image_path(char *fname);
+void image_process_dir(char *path);
+FILE *src_fopen(char *fname);
+int src_stat(char *fname, struct stat *st);
+static ssize_t image_read(void *cookie, char *buf, size_t size);
+static int image_seek(void *cookie, off64_t *offset, int whence);
+static int image_close(void *cookie);
+void demux_init(demux_type *dm, ts_type *ts, void (*es)(demux_type *dm, int stream, unsigned char *p, size_t n), void *arg);
+void demux_feed(demux_type *dm, unsigned char *p, size_t len);
+static void demux_header(demux_type *dm);
+static long long demux_pts(unsigned char *p);
+void poster_init(poster_type *pf, output_type *out, int nout);
+static void poster_es(poster_type *pf, unsigned char *p, size_t n);
+void poster_finish(poster_type *pf);
+static void poster_write(poster_type *pf, unsigned char *pic, size_t n);
+void split_init(split_type *sp, output_type *out, int nout, poster_type *pf, int demux, mp4_type *mp4);
+static void split_es(demux_type *dm, int stream, unsigned char *p, size_t n);
+void split_finish(split_type *sp);
+static sidecar_type * sidecar_open(split_type *sp, int stream);
+static void sidecar_flush(split_type *sp, sidecar_type *sc);
+static const char * sidecar_ext(int stream);
+void mp4_init(mp4_type *mp4, output_type *out, int nout);
+void mp4_es(mp4_type *mp4, int stream, long long pts, unsigned char *p, size_t n);
+void mp4_finish(mp4_type *mp4);
+static mp4_track_type * mp4_track(mp4_type *mp4, int stream);
+static void mp4_video(mp4_type *mp4, mp4_track_type *t, int last);
+static void mp4_audio(mp4_type *mp4, mp4_track_type *t);
+static int mpa_frame(mp4_track_type *t, unsigned char *h);
+static int ac3_frame(mp4_track_type *t, unsigned char *h);
+static void mp4_sample(mp4_type *mp4, mp4_track_type *t, unsigned char *p, size_t n, unsigned int flags, int cts);
+static void mp4_flush(mp4_type *mp4);
+static int mp4_start(mp4_type *mp4);
+static void mp4_trak(mp4_buf_type *b, mp4_track_type *t);
+static void mp4_write(mp4_type *mp4, void *p, size_t n);
+static void mp4_put(mp4_buf_type *b, const void *p, size_t n);
+static void mp4_u8(mp4_buf_type *b, unsigned int v);
+static void mp4_u16(mp4_buf_type *b, unsigned int v);
+static void mp4_u32(mp4_buf_type *b, unsigned int v);
+static void mp4_u64(mp4_buf_type *b, unsigned long long v);
+static size_t mp4_box(mp4_buf_type *b, const char *type);
+static size_t mp4_full(mp4_buf_type *b, const char *type, int version, unsigned int flags);
+static size_t mp4_desc(mp4_buf_type *b, int tag);
+static void mp4_end(mp4_buf_type *b, size_t at);
+static void mp4_desc_end(mp4_buf_type *b, size_t at);
+int fix_in_place(job_type *job);
+static ssize_t patch_sink_write(void *cookie, const char *buf, size_t n);
+static int journal_replay(char *fname, char *jfname, int undo);
+static int apply_patches(int fd, patch_type *patch, int n, int undo);
+void journal_fname(char *jfname, char *fname);
+void serve();
+static void serve_signal(int sig);
+static void serve_worker(int lfd);
+static void serve_job(int cfd, int n, char *line);
+static int serve_run(char *line);
+static int serve_split(char *line, char **argv, int max);
+static int serve_dest(char *dir, dest_type *known, int nknown);
+static void count_job(job_type *job, int ok);
+int shard_key(job_type *job, char *key);
+int shard_archived(dest_type *dest, char *reldir, char *key, long long size);
+int shard_claim(dest_type *dest, char *reldir, char *key, long long size, int *lock_fd);
+void shard_link(dest_type *dest, char *reldir, char *base, char *mpeg_fname);
+void progress_start();
+void progress_end();
+static void progress_read(size_t n);
+static void progress_job(job_type *job);
+static void *progress_main(void *arg);
+static void progress_report(long long *last, long long now, long long since, int final);
+static char *size_str(char *s, double n);
+void throttle_init();
+static void throttle_sighup(int sig);
+void throttle_io(int dir, size_t n);
+static long long bucket_take(bucket_type *b, double n, long long now);
+static void bucket_set(bucket_type *b, double rate, long long now);
+static void throttle_check(long long now);
+static void throttle_load(long long now);
+double parse_rate(char *s);
+static long long now_ns();
+static void sleep_ns(long long ns);
+void log_init();
+void log_msg(int level, const char *event, const char *fmt, ...);
+void log_flush();
+void log_shutdown();
+static void log_start();
+static void *log_writer(void *arg);
+static void log_drain();
+static int log_format_rec(char *line, log_rec_type *rec, char *msg);
+static void log_write(char *buf, int len);
+static void log_ring_put(log_ring_type *ring, size_t pos, const void *src, size_t len);
+static void log_ring_get(log_ring_type *ring, size_t pos, void *dst, size_t len);
+static void log_fork_prepare();
+static void log_fork_parent();
+static void log_fork_child();
+static char *hex_str(char *str, unsigned char *p, int n);
 
 
 
@@ -227,36 +932,22 @@ int mkpath(const char *path, mode_t mode);
 int main(int argc, char *argv[]) {
    int c;
    char *src_dir = NULL;
-   char *src_file = NULL, *src_file_base = NULL, *src_file_cpy1 = NULL, *src_file_cpy2 = NULL;
-   char abs_dest_dir[MAX_PATH_LEN];  /* used to make dest_dir an absolute path */
-   char cwd[MAX_PATH_LEN];
-   DIR *dir;
-   /* getopt_long structures */
+   char *src_file = NULL;
+   char *dest_dir_opts[MAX_DESTS];   /* -d options, in order */
+   int dest_fsync[MAX_DESTS];        /* fsync mode in effect for each */
+   int i;
+   double d;
    int option_index = 0;
-   static struct option long_options[] = {
-      {"verbose",          no_argument,       0, 'v'},
-      {"help",             no_argument,       0, 'h'},
-      {"info",             no_argument,       0, 'i'},
-      {"clobber",          no_argument,       0, 'c'},
-      {"modification-time",no_argument,       0, 't'},
-      {"mtime",            no_argument,       0, 't'},  /* alias */
-      {"make-dirs",        no_argument,       0, 'm'},  /* c for create dirs */
-      {"recursive",        no_argument,       0, 'r'},
-      {"mod-file",         required_argument, 0, 'f'},
-      {"src-dir",          required_argument, 0, 's'},
-      {"dest-dir",         required_argument, 0, 'd'},
-      {0, 0, 0, 0}
-   };
 
 
    this = argv[0];
-   setlinebuf(stdout); /* flush every line, even if redirected to file */
+   log_init();   /* all progress output goes through the log writer */
 
 
    optarg = NULL;
    //while ((c = getopt_long(argc, argv, "itvho", long_options, &option_index)) != -1 ) {
    while (1) {
-      c = getopt_long(argc, argv, "vhictmrf:s:d:", long_options, &option_index);
+      c = getopt_long(argc, argv, "vhictmrnf:s:d:j:T:", long_options, &option_index);
 
       /* Detect the end of the options. */
       if (c == -1)
@@ -298,12 +989,142 @@ int main(int argc, char *argv[]) {
          case 's':
             src_dir = optarg;
             break;
+         /* may be given more than once - every destination gets a copy */
          case 'd':
-            dest_dir = optarg;
+            if ( ndests == MAX_DESTS ) {
+               fprintf(stderr, "%s: Error: at most %d destination directories\n", this, MAX_DESTS);
+               exit(1);
+            }
+            dest_fsync[ndests] = fsync_mode;
+            dest_dir_opts[ndests++] = optarg;
+            break;
+         /* write one tar stream instead of files in a dest dir */
+         case 'T':
+            tar_fname = optarg;
+            break;
+         /* fsync policy for the -d options that follow */
+         case 'F':
+            if ( strcmp(optarg, "none") == 0 )
+               fsync_mode = FSYNC_NONE;
+            else if ( strcmp(optarg, "checkpoint") == 0 )
+               fsync_mode = FSYNC_CHECKPOINT;
+            else if ( strcmp(optarg, "close") == 0 )
+               fsync_mode = FSYNC_CLOSE;
+            else {
+               fprintf(stderr, "%s: Error: --fsync must be none, checkpoint or close\n", this);
+               exit(1);
+            }
+            break;
+         case 'L':
+            if ( strcmp(optarg, "text") == 0 )
+               log_format = LOG_TEXT;
+            else if ( strcmp(optarg, "kv") == 0 )
+               log_format = LOG_KV;
+            else {
+               fprintf(stderr, "%s: Error: --log-format must be text or kv\n", this);
+               exit(1);
+            }
+            break;
+         /* I/O limits, see throttle_io() */
+         case 'R':
+         case 'W':
+         case 'O':
+            if ( (d = parse_rate(optarg)) < 0 ) {
+               fprintf(stderr, "%s: Error: bad rate %s, expecting a number with optional k, M or G\n", this, optarg);
+               exit(1);
+            }
+            if ( c == 'R' )
+               read_limit = d;
+            else if ( c == 'W' )
+               write_limit = d;
+            else
+               iops_limit = d;
+            break;
+         case 'C':
+            throttle_fname = optarg;
+            break;
+         case 'S':
+            scanner = optarg;
+            break;
+         case 'K':
+            catalog_fname = optarg;
+            break;
+         case 'J':
+            image_fname = optarg;
+            break;
+         case 'U':
+            serve_path = optarg;
+            break;
+         case 'Y':
+            if ( strcmp(optarg, "date") == 0 )
+               layout = LAYOUT_DATE;
+            else if ( strcmp(optarg, "sharded") == 0 )
+               layout = LAYOUT_SHARDED;
+            else {
+               fprintf(stderr, "%s: Error: --layout must be date or sharded\n", this);
+               exit(1);
+            }
+            break;
+         case 'Z':
+            if ( !optarg )
+               progress_mode = isatty(2) ? PROGRESS_TTY : PROGRESS_LINES;
+            else if ( strcmp(optarg, "tty") == 0 )
+               progress_mode = PROGRESS_TTY;
+            else if ( strcmp(optarg, "lines") == 0 )
+               progress_mode = PROGRESS_LINES;
+            else {
+               fprintf(stderr, "%s: Error: --progress takes no value, tty or lines\n", this);
+               exit(1);
+            }
+            break;
+         case 'G':
+            if ( !optarg )
+               in_place = IN_PLACE_FIX;
+            else if ( strcmp(optarg, "rollback") == 0 )
+               in_place = IN_PLACE_ROLLBACK;
+            else {
+               fprintf(stderr, "%s: Error: --in-place takes no value, or rollback\n", this);
+               exit(1);
+            }
+            break;
+         case 'I':
+            if ( (poster_nth = optarg ? atoi(optarg) : 1) < 1 ) {
+               fprintf(stderr, "%s: Error: --poster=N counts I-frames from 1\n", this);
+               exit(1);
+            }
+            break;
+         case 'P':
+            if ( (frame_rate = parse_frame_rate(optarg)) == 0 ) {
+               fprintf(stderr, "%s: Error: --frame-rate must be 23.976, 24, 25, 29.97, 30, 50, 59.94 or 60\n", this);
+               exit(1);
+            }
+            break;
+         /* look things up in the catalog */
+         case 'Q':
+            query = 1;
+            break;
+         case 'B':
+            query_from = optarg;
+            break;
+         case 'E':
+            query_to = optarg;
+            break;
+         case 'A':
+            query_aspect = optarg;
             break;
          case 'r':
             recursive = 1;
             break;
+         /* dry run - show what would be done */
+         case 'n':
+            plan_only = 1;
+            break;
+         case 'j':
+            if ( (max_workers = atoi(optarg)) < 1 ) {
+               fprintf(stderr, "%s: Error: --jobs must be at least 1\n", this);
+               exit(1);
+            }
+            break;
          case 'v':
             verbose++;
             break;
@@ -336,18 +1157,54 @@ int main(int argc, char *argv[]) {
       exit(1);
    }
 
+   /* --serve: sources come with each job */
+   if ( serve_path && (src_dir || src_file || info_only || plan_only || in_place || tar_fname || image_fname || query || progress_mode) ) {
+      fprintf(stderr, "%s: Error: with --serve, -s, -f, -i, -n and --in-place go with each job, and there is no --tar, --image, --query or --progress\n", this);
+      exit(1);
+   }
+
+   /* queries only need a catalog */
+   if ( query ) {
+      if ( !catalog_fname && ndests ) {
+         catalog_fname = (char *) mymalloc(strlen(dest_dir_opts[0]) + strlen(CATALOG_NAME) + 2);
+         sprintf(catalog_fname, "%s/%s", dest_dir_opts[0], CATALOG_NAME);
+      }
+      if ( !catalog_fname ) {
+         fprintf(stderr, "%s: Error: --query needs --catalog or -d\n", this);
+         exit(1);
+      }
+      catalog_query();
+      return(0);
+   }
+
    /* help, version, etc. should have been taken care of above,
     * for anything else we need an input source */
-   if ( !(src_dir || src_file) ) {
+   if ( image_fname && !(src_dir || src_file) )
+      src_dir = "/";
+   if ( !(src_dir || src_file || serve_path) ) {
       fprintf(stderr, "%s: Error: missing input source option - either -s or -f\n", this);
       exit(1);
    }
 
+   /* --in-place writes nowhere else */
+   if ( in_place && (ndests || tar_fname || image_fname || info_only) ) {
+      fprintf(stderr, "%s: Error: --in-place patches the files themselves, no -d, --tar, --image or -i\n", this);
+      exit(1);
+   }
+
    /* unless info_only, we also need an output dir */
-   if ( !info_only && !dest_dir ) {
+   if ( !info_only && !in_place && !ndests && !tar_fname && !serve_path ) {
       fprintf(stderr, "%s: Error: missing output source option -d\n", this);
       exit(1);
    } 
+   if ( ndests && tar_fname ) {
+      fprintf(stderr, "%s: Error: use either -d or --tar, not both\n", this);
+      exit(1);
+   }
+   if ( layout == LAYOUT_SHARDED && (tar_fname || in_place) ) {
+      fprintf(stderr, "%s: Error: --layout=sharded is for -d, not --tar or --in-place\n", this);
+      exit(1);
+   }
 
    /* if asking for info only, we need an MOI file */
    /*
@@ -363,32 +1220,72 @@ int main(int argc, char *argv[]) {
     * Do the work
     */
 
-   /* strip trailing / if any from dest_dir */
-   if ( !info_only ) {
-      if ( dest_dir && dest_dir[strlen(dest_dir)-1] == '/' )
-         dest_dir[strlen(dest_dir)-1] = '\0';
-
-      /* turn dest_dir into an absolute path */
-      if ( dest_dir[0] != '/' ) {
-         if ( !getcwd(cwd, sizeof cwd) ) {
-            perror("cannot get cwd\n");
+   if ( !info_only && tar_fname && !plan_only ) {
+      if ( strcmp(tar_fname, "-") == 0 ) {
+         /* tar goes to the real stdout, everything we print goes to stderr */
+         fflush(stdout);
+         if ( (i = dup(1)) < 0 || (tar = fdopen(i, "wb")) == NULL || dup2(2, 1) < 0 ) {
+            perror("stdout");
             exit(1);
          }
-         sprintf(abs_dest_dir, "%s/%s", cwd, dest_dir);
-         dest_dir = abs_dest_dir;
-      }
-
-      /* check to see if dir exists.
-       * note, in general this is not a great idea to check dir, close it, then use it later
-       * since it can cause an obvious race condition... */
-      dir = opendir(dest_dir);
-      if ( dir ) {
-         closedir(dir);  /* dir exists */
-      } else {
-         fprintf(stderr, "%s: destination directory does not exist: %s\n", this, dest_dir);
+      }
+      else if ( (tar = fopen(tar_fname, "wb")) == NULL ) {
+         fprintf(stderr, "%s: unable to open %s\n", this, tar_fname);
+         perror(tar_fname);
          exit(1);
       }
+      tar_names = new_name_index("");
+   }
+   if ( !info_only ) {
+      i = ndests;
+      for (ndests = 0; ndests < i; ) {
+         fsync_mode = dest_fsync[ndests];
+         if ( !add_dest(dest_dir_opts[ndests]) )
+            exit(1);
+      }
+      if ( !use_catalog )
+         catalog_fname = NULL;
+      else if ( !catalog_fname && ndests ) {
+         catalog_fname = (char *) mymalloc(strlen(dests[0].dir) + strlen(CATALOG_NAME) + 2);
+         sprintf(catalog_fname, "%s/%s", dests[0].dir, CATALOG_NAME);
+      }
+   }
+
+   if ( scanner && !scan_select(scanner) ) {
+      fprintf(stderr, "%s: Error: no scanner %s on this machine (see moi-scanbench -h)\n", this, scanner);
+      exit(1);
    }
+   if ( !scanner )
+      scan_load_choice();
+   LOG(3, "scan", "%s: using the %s scanner\n", this, scan_selected());
+
+   if ( !info_only && !plan_only && (read_limit || write_limit || iops_limit || throttle_fname) )
+      throttle_init();
+
+   if ( image_fname && !image_open(image_fname) )
+      exit(1);
+
+   /* from here on we take jobs over the socket */
+   if ( serve_path )
+      serve();
+
+   queue_sources(src_dir, src_file);
+
+   /* process_file() only queues up the conversions */
+   run_jobs();
+   if ( tar )
+      tar_finish();
+
+   return(0);
+}
+
+
+/*****************************************************************************
+ * Queue up the job(s) for -f file, or for everything in -s dir
+ ****************************************************************************/
+void queue_sources(char *src_dir, char *src_file) {
+   char *src_file_base = NULL, *src_file_cpy1 = NULL, *src_file_cpy2 = NULL;
+   char image_dir[MAX_PATH_LEN];     /* --image -f: the MOD's directory in the image */
 
    if ( src_file ) {
       /* man page says dirname/basename may clobber string, so make copies */
@@ -401,13 +1298,23 @@ int main(int argc, char *argv[]) {
          fprintf(stderr, "%s: unable to extract MOI info from an MOD file\n", this);
          exit(1);
       }
-      process_file(src_dir, src_file_base);
+      if ( image ) {
+         /* -f is the path of the MOD in the image */
+         src_dir += strspn(src_dir, "/");
+         if ( *src_dir == '\0' || strcmp(src_dir, ".") == 0 )
+            snprintf(image_dir, sizeof(image_dir), "%s::", image_fname);
+         else
+            snprintf(image_dir, sizeof(image_dir), "%s::/%s", image_fname, src_dir);
+         process_file(image_dir, src_file_base);
+      }
+      else
+         process_file(src_dir, src_file_base);
    }
+   else if ( image )
+      image_process_dir(src_dir);
    else {
       process_dir(src_dir);
    }
-
-   return(0);
 }
 
 
@@ -433,8 +1340,7 @@ void process_dir(char *dirname) {
       perror("cannot get cwd for new dir\n");
       exit(1);
    }
-   if ( verbose >= 2 )
-      printf("%s: processing %s\n", this, newd);
+   LOG(2, "dir", "%s: processing %s\n", this, newd);
 
    if ( !(dir = opendir(".")) ) {
       perror(dirname);
@@ -463,16 +1369,13 @@ void process_dir(char *dirname) {
  *
  * 1) check for sister MOI file
  * 2) extract necessary info from MOI file
- * 3) create mpeg file in target dir
+ * 3) queue up the job to create the mpeg file in target dir
  ****************************************************************************/
 void process_file(char *dir, char *fname) {
    moi_info_type *info;
    char moi_fname[MAX_PATH_LEN];
    char mod_fname[MAX_PATH_LEN];
-   char mpeg_dirname[MAX_PATH_LEN];
-   char dest_fname[MAX_PATH_LEN];
-   char dest_fname_base[MAX_PATH_LEN];
-   int len = 0, funiq = 0;
+   char mpeg_reldir[MAX_PATH_LEN];
 
 
    /* if called with --info-only, we only process MOI files */
@@ -486,17 +1389,15 @@ void process_file(char *dir, char *fname) {
       return;
    }
 
-   /* we only care about MOD files at this point */
-   if ( ! is_file_type(fname, mod_suffix) )
+   /* we only care about MOD files at this point, and with --in-place
+    * mpegs we made before */
+   if ( ! is_file_type(fname, mod_suffix) && !(in_place && is_file_type(fname, mpeg_suffix)) )
       return;
 
    info = (moi_info_type *) mymalloc(sizeof(moi_info_type));
    sprintf(mod_fname, "%s/%s", dir, fname);
 
-   if ( verbose >= 2 )
-      printf("-----------------------------------\n");
-   if ( verbose >= 1 )
-      printf("%s: processing %s\n", this, mod_fname);
+   LOG(2, "found", "%s: found %s\n", this, mod_fname);
 
    if ( ! locate_moi(moi_fname, mod_fname) ) {
       fprintf(stderr, "%s: WARNING: no matching .MOI file for %s\n", this, mod_fname);
@@ -510,168 +1411,949 @@ void process_file(char *dir, char *fname) {
       return;
    }
 
+   /* output dir structure, created in one go by run_jobs() */
+   mpeg_reldir[0] = '\0';
    if ( make_dirs ) {
-      /* build output dir structure */
       if ( date_to_use == MTIME_DATE )
-         sprintf(mpeg_dirname, "%s/%04d/%02d/%02d", dest_dir, info->mtime_year, info->mtime_mon, info->mtime_day);
+         sprintf(mpeg_reldir, "%04d/%02d/%02d", info->mtime_year, info->mtime_mon, info->mtime_day);
       else
-         sprintf(mpeg_dirname, "%s/%04d/%02d/%02d", dest_dir, info->moi_year, info->moi_mon, info->moi_day);
-
-      if ( verbose >= 3 )
-         printf("%s: creating target dir %s\n", this, mpeg_dirname);
-      mkpath(mpeg_dirname, 0777);
+         sprintf(mpeg_reldir, "%04d/%02d/%02d", info->moi_year, info->moi_mon, info->moi_day);
    }
-   else {
-      sprintf(mpeg_dirname, "%s", dest_dir);
+
+   add_job(mod_fname, moi_fname, mpeg_reldir, info);
+}
+
+/*****************************************************************************
+ * append a MOD/MOI pair to the job list. The job list takes ownership of
+ * info.
+ ****************************************************************************/
+void add_job(char *mod_fname, char *moi_fname, char *mpeg_reldir, moi_info_type *info) {
+   job_type *job;
+
+   if ( njobs == jobs_size ) {
+      jobs_size = jobs_size ? jobs_size * 2 : 64;
+      if ( (jobs = (job_type *) realloc(jobs, jobs_size * sizeof(job_type))) == NULL ) {
+         fprintf(stderr, "cannot allocate memory");
+         exit(1);
+      }
    }
+   job = &jobs[njobs++];
+   job->mod_fname = strdup(mod_fname);
+   job->moi_fname = strdup(moi_fname);
+   job->mpeg_reldir = strdup(mpeg_reldir);
+   job->info = info;
+}
 
-   /* build destination file name */
-   if ( date_to_use == MTIME_DATE )
-      sprintf(dest_fname_base, "%s/mov-%s", mpeg_dirname, info->mtime_date_str);
-   else 
-      sprintf(dest_fname_base, "%s/mov-%s", mpeg_dirname, info->moi_date_str);
+/*****************************************************************************
+ * order jobs by source device, then by where each MOD file physically
+ * starts on that device
+ ****************************************************************************/
+static int cmp_job_phys(const void *a, const void *b) {
+   const job_type *ja = (const job_type *) a, *jb = (const job_type *) b;
 
-   sprintf(dest_fname, "%s.mpeg", dest_fname_base);
-   while ( file_exists(dest_fname) ) {
-      funiq++;
-      sprintf(dest_fname, "%s_%02d.mpeg", dest_fname_base, funiq);
+   if ( ja->dev != jb->dev )
+      return ja->dev < jb->dev ? -1 : 1;
+   if ( ja->phys != jb->phys )
+      return ja->phys < jb->phys ? -1 : 1;
+   return 0;
+}
+
+/*****************************************************************************
+ * Decide what order to read the MOD files in, and which worker (lane) reads
+ * each one.
+ *
+ * readdir() order has nothing to do with where the clips are on the disk,
+ * and on the camcorder's internal HDD that means a lot of seeking. So we
+ * sort the jobs by the physical location of each file's first extent
+ * (FIEMAP), falling back to inode number, which roughly follows allocation
+ * order, when the file system cannot tell us.
+ *
+ * A spinning disk gets exactly one lane so it is read near-sequentially.
+ * Jobs on anything else (SSD, SD card, network) are dealt out over up to
+ * max_workers lanes.
+ ****************************************************************************/
+void plan_jobs() {
+   struct stat st;
+   image_file_type *f;
+   int i, j, k, fd, nlanes = 0, spread, rot;
+
+   for (i = 0; i < njobs; i++) {
+      jobs[i].dev = 0;
+      jobs[i].phys = 0;
+      jobs[i].mod_size = 0;
+      jobs[i].moi_size = 0;
+      if ( src_stat(jobs[i].moi_fname, &st) == 0 )
+         jobs[i].moi_size = st.st_size;
+      if ( (f = image_lookup(jobs[i].mod_fname)) != NULL ) {
+         /* in a card image: where it starts in the image */
+         jobs[i].dev = image->dev;
+         jobs[i].mod_size = f->size;
+         jobs[i].phys = f->next ? f->ext[0].phys : 0;
+         continue;
+      }
+      if ( (fd = open(jobs[i].mod_fname, O_RDONLY)) < 0 )
+         continue;  /* make_mpeg() will complain about it */
+      if ( fstat(fd, &st) == 0 ) {
+         jobs[i].dev = st.st_dev;
+         jobs[i].mod_size = st.st_size;
+         if ( (jobs[i].phys = first_extent(fd)) < 0 )
+            jobs[i].phys = st.st_ino;
+      }
+      close(fd);
    }
 
-   /* do the real work */
-   if ( verbose >= 1 )
-      printf("%s:    creating %s\n", this, dest_fname);
-   make_mpeg(mod_fname, dest_fname, info);
-   copy_moi(moi_fname, dest_fname, info);
+   qsort(jobs, njobs, sizeof(job_type), cmp_job_phys);
+
+   for (i = 0; i < njobs; i = j) {
+      /* jobs i .. j-1 are on the same device */
+      for (j = i; j < njobs && jobs[j].dev == jobs[i].dev; j++)
+         ;
+      rot = is_rotational(jobs[i].dev);
+      spread = rot ? 1 : max_workers;
+      LOG(3, "plan", "%s: %d MOD files on device %u:%u (%s), %d lane(s)\n", this, j - i,
+               major(jobs[i].dev), minor(jobs[i].dev), rot ? "rotational" : "non-rotational",
+               spread < j - i ? spread : j - i);
+      for (k = 0; i < j; i++, k++) {
+         jobs[i].lane = nlanes + (k % spread);
+         LOG(4, "plan", "%s:    lane %d @%lld %s\n", this, jobs[i].lane, jobs[i].phys, jobs[i].mod_fname);
+      }
+      nlanes += spread;
+   }
+}
+
+/*****************************************************************************
+ * Physical byte offset of the first extent of the file open on fd, or -1
+ * if the file system cannot tell us.
+ ****************************************************************************/
+long long first_extent(int fd) {
+#ifdef FS_IOC_FIEMAP
+   struct {
+      struct fiemap        fm;
+      struct fiemap_extent fe[1];
+   } map;
+
+   memset(&map, 0, sizeof map);
+   map.fm.fm_start = 0;
+   map.fm.fm_length = FIEMAP_MAX_OFFSET;
+   map.fm.fm_extent_count = 1;
+   if ( ioctl(fd, FS_IOC_FIEMAP, &map.fm) == 0 && map.fm.fm_mapped_extents > 0
+         && !(map.fe[0].fe_flags & FIEMAP_EXTENT_UNKNOWN) )
+      return (long long) map.fe[0].fe_physical;
+#endif
+   return -1;
+}
 
-   free(info);
+/*****************************************************************************
+ * Return true if dev is a spinning disk. If we can't tell (network file
+ * systems, tmpfs, non-Linux), assume it isn't.
+ ****************************************************************************/
+int is_rotational(dev_t dev) {
+   char path[MAX_PATH_LEN];
+   FILE *f;
+   int c = '0';
+
+   /* whole disk, or a partition, in which case the queue is on the parent */
+   sprintf(path, "/sys/dev/block/%u:%u/queue/rotational", major(dev), minor(dev));
+   if ( (f = fopen(path, "r")) == NULL ) {
+      sprintf(path, "/sys/dev/block/%u:%u/../queue/rotational", major(dev), minor(dev));
+      f = fopen(path, "r");
+   }
+   if ( f ) {
+      c = fgetc(f);
+      fclose(f);
+   }
+   return c == '1';
 }
 
 /*****************************************************************************
+ * Now that we know every MOD/MOI pair, create all of the date directories
+ * we will need in one batch, then convert each pair, running up to
+ * max_workers lanes at once (see plan_jobs()).
+ *
+ * Workers are forked processes. They share nothing but the file system:
+ * the O_EXCL create in claim_dest_name() sorts out name collisions between
+ * them.
  ****************************************************************************/
-void copy_moi(char *moi_fname, char *dest_fname, moi_info_type *info) {
-   FILE *src, *dest;
-   char *buf;
-   int br=0, bw=0, len=0;
+void run_jobs() {
+   int i, d, lane, nlanes = 0, running = 0, status, failed = 0, slot;
+   pid_t pid, *slot_pid;
 
+   if ( njobs == 0 )
+      return;
 
-   /* trim off .mpeg extension and add .moi */
-   len = strlen(dest_fname) - 5;
-   dest_fname[len] = '\0';
-   sprintf(dest_fname, "%s.moi", dest_fname);
+   plan_jobs();
+
+   /* one stream, written in order, by us */
+   if ( tar_fname ) {
+      if ( plan_only )
+         tar_names = new_name_index("");
+      else if ( progress_mode )
+         progress_start();
+      for (i = 0; i < njobs; i++) {
+         next_job = i + 1 < njobs ? &jobs[i + 1] : NULL;
+         tar_job(&jobs[i]);
+      }
+      progress_end();
+      if ( catalog_fname && !plan_only )
+         catalog_merge(1);
+      return;
+   }
 
-   if ( verbose >= 2 )
-      fprintf(stderr, "%s: copying moi file\n", this);
+   if ( plan_only ) {
+      print_plan();
+      exit(check_space() ? 0 : 1);
+   }
+   if ( !check_space() )
+      exit(1);
 
-   /* test to see if the file already exists */
-   if ( noclobber ) {
-      if (dest = fopen(dest_fname, "rb")) {
-         fclose(dest);
-         if ( verbose >= 2 ) {
-            fprintf(stderr, "   %s exists!\n", dest_fname);
-            fprintf(stderr, "   skipping... file exists and noclobber is on\n");
+   /* every date dir in one go, before the workers start */
+   for (i = 0; i < njobs; i++) {
+      for (d = 0; d < ndests; d++) {
+         if ( jobs[i].mpeg_reldir[0] && make_date_dir(&dests[d], jobs[i].mpeg_reldir) < 0 ) {
+            fprintf(stderr, "%s: unable to create directory %s/%s\n", this, dests[d].dir, jobs[i].mpeg_reldir);
+            perror(jobs[i].mpeg_reldir);
+            exit(1);
          }
-         return;
       }
    }
-
-   /* open copy from file */
-   if ( (src = fopen(moi_fname, "rb")) == NULL ) {
-      fprintf(stderr, "%s: WARNING: cannot open .MOI file to copy %s\n", this, moi_fname);
-      perror(moi_fname);
-      fprintf(stderr, "   skipping...\n");
-      return;
+   if ( progress_mode )
+      progress_start();
+   for (i = 0; i < njobs; i++) {
+      if ( jobs[i].lane >= nlanes )
+         nlanes = jobs[i].lane + 1;
    }
-   /* open copy to file */
-   if ( (dest = fopen(dest_fname, "wb")) == NULL ) {
-      fprintf(stderr, "%s: unable to open %s\n", this, dest_fname);
-      perror(dest_fname);
-      fclose(src);
+
+   if ( max_workers == 1 || nlanes == 1 ) {
+      for (i = 0; i < njobs; i++) {
+         next_job = i + 1 < njobs ? &jobs[i + 1] : NULL;
+         process_job(&jobs[i]);
+      }
+      progress_end();
+      if ( catalog_fname )
+         catalog_merge(1);
       return;
    }
 
-   /* copy data from mod file to the mpeg file */
-   buf = (char *) mymalloc(RW_BLOCK_SIZE);
-   while( (br = fread(buf, 1, RW_BLOCK_SIZE, src)) > 0 ) {
-      bw = fwrite(buf, 1, br, dest);
-      if ( bw < 0 || ferror(dest) ) {
-         perror("write failed");
-         exit(1);
+   /* each running worker has a slot of its own for --progress */
+   slot_pid = (pid_t *) mymalloc(max_workers * sizeof(pid_t));
+   memset(slot_pid, 0, max_workers * sizeof(pid_t));
+
+   fflush(stdout);
+   fflush(stderr);
+   for (lane = 0; lane < nlanes || running > 0; ) {
+      if ( lane < nlanes && running < max_workers ) {
+         for (slot = 0; slot_pid[slot]; slot++)
+            ;
+         if ( (pid = fork()) < 0 ) {
+            perror("fork");
+            exit(1);
+         }
+         if ( pid == 0 ) {
+            progress_slot = slot;
+            run_lane(lane);
+            exit(0);
+         }
+         slot_pid[slot] = pid;
+         running++;
+         lane++;
+         continue;
+      }
+      if ( (pid = wait(&status)) > 0 ) {
+         for (slot = 0; slot < max_workers; slot++) {
+            if ( slot_pid[slot] == pid )
+               slot_pid[slot] = 0;
+         }
+         running--;
+         if ( !WIFEXITED(status) || WEXITSTATUS(status) != 0 )
+            failed++;
       }
    }
+   free(slot_pid);
+   progress_end();
+   if ( catalog_fname )
+      catalog_merge(1);   /* what the workers did get made */
 
-   fclose(src);
-   fclose(dest);
-   free(buf);
-
-   return;
+   if ( failed ) {
+      fprintf(stderr, "%s: %d worker(s) failed\n", this, failed);
+      exit(1);
+   }
 }
 
 /*****************************************************************************
- * parse the MOI file
- * reference:
- * http://forum.camcorderinfo.com/bbs/t135224.html  (further down is English translation)
- * http://en.wikipedia.org/wiki/MOI_(file_format)
+ * --tar: convert one MOD/MOI pair straight into the tar stream as
+ * YYYY/MM/DD/mov-*.mpeg and .moi entries. The mpeg is the same size as the
+ * MOD, so each header can be written before the data, without seeking or
+ * temp files.
  ****************************************************************************/
-int get_moi_info(moi_info_type *info, char *moi_fname) {
-   FILE *infile;
-   char str[64] = "";
-   struct tm *tm_buf;
-   struct stat mtime_buf;
-   time_t now = time(0);
+void tar_job(job_type *job) {
+   moi_info_type *info = job->info;
+   char base[MAX_PATH_LEN];
+   char name[MAX_PATH_LEN];
+   output_type out;
+   int len;
+
+   if ( !plan_only ) {
+      LOG(2, "job", "-----------------------------------\n");
+      LOG(1, "job", "%s: processing %s\n", this, job->mod_fname);
+   }
 
+   if ( job->mpeg_reldir[0] ) {
+      if ( !plan_only )
+         tar_dirs(job->mpeg_reldir, info->mtime);
+      sprintf(base, "%s/mov-%s", job->mpeg_reldir, date_to_use == MTIME_DATE ? info->mtime_date_str : info->moi_date_str);
+   }
+   else {
+      sprintf(base, "mov-%s", date_to_use == MTIME_DATE ? info->mtime_date_str : info->moi_date_str);
+   }
+   next_dest_name(tar_names, base, name);
 
-   /* open input file */
-   infile = fopen(moi_fname, "rb");
-   if (infile == NULL) {
-      fprintf(stderr, "%s: WARNING: cannot open .MOI file %s\n", this, moi_fname);
-      fprintf(stderr, "   skipping...\n");
-      return 0;
+   if ( plan_only ) {
+      log_msg(0, "plan", "%s: plan: %s -> %s:%s (%lld bytes)\n", this, job->mod_fname, tar_fname, name, (long long) job->mod_size);
+      return;
    }
+   LOG(1, "tar", "%s:    adding %s to %s\n", this, name, tar_fname);
 
-   /* get file access time on the file */
-   fstat(fileno(infile), &mtime_buf); 
-   info->mtime = mtime_buf.st_mtime;
-   tm_buf = localtime(&mtime_buf.st_mtime);
-   info->mtime_year  = tm_buf->tm_year + 1900;
-   info->mtime_mon   = tm_buf->tm_mon + 1;
-   info->mtime_day   = tm_buf->tm_mday;
-   info->mtime_hour  = tm_buf->tm_hour;
-   info->mtime_min   = tm_buf->tm_min;
-   info->mtime_sec   = tm_buf->tm_sec;
-   sprintf(str, "%04d%02d%02d-%02d%02d%02d", 
-         info->mtime_year, info->mtime_mon, info->mtime_day, info->mtime_hour, info->mtime_min, info->mtime_sec);
-   strcpy(info->mtime_date_str, str);
+   memset(&out, 0, sizeof out);
+   out.stream = 1;
+   out.fp = tar;
+   out.fd = fileno(tar);
+   out.size = job->mod_size;
+   sprintf(out.fname, "%s:%s", tar_fname, name);
 
-   /* get current time seconds - cheesy hack to make unique file names */
-   tm_buf = localtime(&now);
-   sprintf(info->now_sec, "%02d", tm_buf->tm_sec);
+   tar_header(name, job->mod_size, info->mtime, '0');
+   if ( !make_mpeg(job->mod_fname, &out, 1, info) )
+      exit(1);  /* the stream is no good to anyone now */
+   tar_pad(job->mod_size);
 
-   /* get info out of the MOI fie */
+   /* trim off .mpeg extension and add .moi */
+   len = strlen(name) - 5;
+   sprintf(name + len, ".moi");
+   tar_file(name, job->moi_fname, job->moi_size, info->mtime);
+   if ( catalog_fname )
+      catalog_add(job, out.fname);
+   count_job(job, 1);
+}
 
-   /* Year offset: 0x0007 (byte 8) - not sure what's in 0x0006
-    * values: D0 - FF = 2000 - 2074 */
-   fseek(infile, 0x07, SEEK_SET);
-   info->moi_year = ((unsigned char) fgetc(infile)) - 0xD0 + 2000;
+/*****************************************************************************
+ * add directory entries for reldir and each of its parents, once each
+ ****************************************************************************/
+void tar_dirs(char *reldir, time_t mtime) {
+   char path[MAX_PATH_LEN];
+   char *sp = NULL;
+
+   strcpy(path, reldir);
+   do {
+      if ( (sp = strchr(sp ? sp + 1 : path, '/')) )
+         *sp = '\0';
+      if ( !name_index_has(tar_names, path) ) {
+         name_index_add(tar_names, path);
+         tar_header(path, 0, mtime, '5');
+      }
+      if ( sp )
+         *sp = '/';
+   } while ( sp );
+}
 
-   /* Month * offset: 0x0008 
-    * values: 01 - 0C = Month 1 - 12 */
-   fseek(infile, 0x08, SEEK_SET);
-   info->moi_mon = (unsigned char) fgetc(infile);
+/*****************************************************************************
+ * write a ustar header. Names longer than 100 are split into prefix/name,
+ * sizes too big for 11 octal digits use the GNU base-256 encoding.
+ ****************************************************************************/
+void tar_header(char *name, long long size, time_t mtime, char type) {
+   unsigned char h[TAR_BLOCK];
+   char *split = NULL;
+   unsigned int sum = 0;
+   int i, len = strlen(name);
+
+   memset(h, 0, TAR_BLOCK);
+   if ( len > 100 ) {
+      for (split = name + len - 101; *split && *split != '/'; split++)
+         ;
+      if ( !*split || split - name > 155 ) {
+         fprintf(stderr, "%s: name too long for tar: %s\n", this, name);
+         exit(1);
+      }
+      memcpy(h + 345, name, split - name);           /* prefix */
+      strncpy((char *) h, split + 1, 100);           /* name */
+   }
+   else {
+      memcpy(h, name, len);
+   }
+   if ( type == '5' && len < 100 && !split )
+      h[len] = '/';
+
+   sprintf((char *) h + 100, "%07o", type == '5' ? 0755 : 0644);   /* mode */
+   sprintf((char *) h + 108, "%07o", 0);                           /* uid */
+   sprintf((char *) h + 116, "%07o", 0);                           /* gid */
+   if ( size < 077777777777LL ) {
+      sprintf((char *) h + 124, "%011llo", size);
+   }
+   else {
+      h[124] = 0x80;
+      for (i = 0; i < 8; i++)
+         h[135 - i] = (size >> (8 * i)) & 0xFF;
+   }
+   sprintf((char *) h + 136, "%011llo", (long long) mtime);
+   h[156] = type;
+   memcpy(h + 257, "ustar", 6);                                    /* magic */
+   memcpy(h + 263, "00", 2);                                       /* version */
+
+   /* checksum is computed with the checksum field all spaces */
+   memset(h + 148, ' ', 8);
+   for (i = 0; i < TAR_BLOCK; i++)
+      sum += h[i];
+   sprintf((char *) h + 148, "%06o", sum);
+   h[155] = ' ';
+
+   if ( fwrite(h, 1, TAR_BLOCK, tar) != TAR_BLOCK ) {
+      perror(tar_fname);
+      exit(1);
+   }
+}
 
-   /* Day offset: 0x0009
-    * values: 01 - 1F = Day 1 - 31 */
-   fseek(infile, 0x09, SEEK_SET);
-   info->moi_day = (unsigned char) fgetc(infile);
+/*****************************************************************************
+ * pad an entry of size bytes out to a whole tar record
+ ****************************************************************************/
+void tar_pad(off_t size) {
+   static unsigned char zeros[TAR_BLOCK];
+   size_t pad = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
 
-   /* Hour offset: 0x000A
-    * values: 00 - 17 = Hour 0 - 23 */
-   fseek(infile, 0x0A, SEEK_SET);
-   info->moi_hour = (unsigned char) fgetc(infile);
-   //hour--;  /* hour seems to be +1 from the file time */
+   if ( pad && fwrite(zeros, 1, pad, tar) != pad ) {
+      perror(tar_fname);
+      exit(1);
+   }
+}
 
-   /* Minute offset: 0x000B
-    * values: 00 - 3B = Minute 0 - 59 */
-   fseek(infile, 0x0B, SEEK_SET);
+/*****************************************************************************
+ * add a plain copy of file fname (size bytes) to the tar as name
+ ****************************************************************************/
+void tar_file(char *name, char *fname, off_t size, time_t mtime) {
+   FILE *src;
+   char *buf;
+   off_t left = size;
+   size_t br;
+
+   if ( (src = src_fopen(fname)) == NULL ) {
+      fprintf(stderr, "%s: WARNING: cannot open %s to copy\n", this, fname);
+      perror(fname);
+      fprintf(stderr, "   skipping...\n");
+      return;
+   }
+   tar_header(name, size, mtime, '0');
+
+   buf = (char *) mymalloc(RW_BLOCK_SIZE);
+   while ( left > 0 && (br = fread(buf, 1, left < RW_BLOCK_SIZE ? (size_t) left : RW_BLOCK_SIZE, src)) > 0 ) {
+      throttle_io(THROTTLE_READ, br);
+      throttle_io(THROTTLE_WRITE, br);
+      progress_read(br);
+      if ( fwrite(buf, 1, br, tar) != br ) {
+         perror(tar_fname);
+         exit(1);
+      }
+      left -= br;
+   }
+   if ( left > 0 ) {
+      fprintf(stderr, "%s: %s changed size while it was being read\n", this, fname);
+      exit(1);
+   }
+   tar_pad(size);
+
+   fclose(src);
+   free(buf);
+}
+
+/*****************************************************************************
+ * end of archive is two empty records
+ ****************************************************************************/
+void tar_finish() {
+   static unsigned char zeros[2 * TAR_BLOCK];
+
+   if ( fwrite(zeros, 1, sizeof zeros, tar) != sizeof zeros || fclose(tar) != 0 ) {
+      perror(tar_fname);
+      exit(1);
+   }
+   tar = NULL;
+}
+
+/*****************************************************************************
+ * --plan: show where every job would go, including the collision suffix it
+ * would get, and how big it will be. Nothing is created.
+ ****************************************************************************/
+void print_plan() {
+   char mpeg_dirname[MAX_PATH_LEN];
+   char dest_fname_base[MAX_PATH_LEN];
+   char name[MAX_PATH_LEN];
+   char dest_fname[MAX_PATH_LEN];
+   char shard_reldir[MAX_PATH_LEN];
+   char key[SHARD_KEY_LEN + 1];
+   checkpoint_type ckpt;
+   int i, d;
+
+   for (i = 0; i < njobs; i++) {
+      if ( date_to_use == MTIME_DATE )
+         sprintf(dest_fname_base, "mov-%s", jobs[i].info->mtime_date_str);
+      else
+         sprintf(dest_fname_base, "mov-%s", jobs[i].info->moi_date_str);
+
+      /* --layout=sharded: the name is the key, which means reading a little */
+      if ( layout == LAYOUT_SHARDED ) {
+         if ( !shard_key(&jobs[i], key) )
+            continue;
+         sprintf(shard_reldir, "%s/%.2s/%.2s", SHARD_DIR, key, key + 2);
+         strcpy(dest_fname_base, key);
+      }
+
+      for (d = 0; d < ndests; d++) {
+         if ( layout == LAYOUT_SHARDED ) {
+            sprintf(mpeg_dirname, "%s/%s", dests[d].dir, shard_reldir);
+            if ( noclobber && shard_archived(&dests[d], shard_reldir, key, jobs[i].mod_size) ) {
+               log_msg(0, "plan", "%s: plan: %s -> %s/%s.mpeg (already archived)\n", this, jobs[i].mod_fname,
+                     mpeg_dirname, key);
+               continue;
+            }
+         }
+         else if ( jobs[i].mpeg_reldir[0] )
+            sprintf(mpeg_dirname, "%s/%s", dests[d].dir, jobs[i].mpeg_reldir);
+         else
+            sprintf(mpeg_dirname, "%s", dests[d].dir);
+
+         if ( resume && find_checkpoint(&ckpt, jobs[i].mod_fname, mpeg_dirname, dest_fname_base, dest_fname) ) {
+            log_msg(0, "plan", "%s: plan: %s -> %s (resume at %lld of %lld bytes)\n", this, jobs[i].mod_fname,
+                  dest_fname, ckpt.committed, (long long) jobs[i].mod_size);
+            continue;
+         }
+         if ( layout == LAYOUT_SHARDED )
+            sprintf(name, "%s.mpeg", key);
+         else
+            next_dest_name(get_name_index(mpeg_dirname), dest_fname_base, name);
+         log_msg(0, "plan", "%s: plan: %s -> %s/%s (%lld bytes)\n", this, jobs[i].mod_fname,
+               mpeg_dirname, name, (long long) jobs[i].mod_size);
+         LOG(1, "plan", "%s: plan: %s -> %s/%.*s.moi (%lld bytes)\n", this, jobs[i].moi_fname,
+                  mpeg_dirname, (int) strlen(name) - 5, name, (long long) jobs[i].moi_size);
+      }
+   }
+}
+
+/*****************************************************************************
+ * Return true if every destination has room for every output we are about
+ * to write. Each file is rounded up to whole file system blocks, and
+ * destinations that share a file system have to share its free space.
+ ****************************************************************************/
+int check_space() {
+   struct statvfs vfs;
+   unsigned long long need, avail, bsize;
+   int i, d, e, copies, ok = 1;
+
+   for (d = 0; d < ndests; d++) {
+      /* only check each file system once, for all of its copies */
+      for (e = 0, copies = 0; e < ndests; e++) {
+         if ( dests[e].dev == dests[d].dev ) {
+            if ( e < d )
+               break;
+            copies++;
+         }
+      }
+      if ( e < ndests && e < d )
+         continue;
+
+      if ( fstatvfs(dests[d].dirfd, &vfs) < 0 ) {
+         perror(dests[d].dir);
+         continue;  /* can't tell, so don't stand in the way */
+      }
+      bsize = vfs.f_frsize ? vfs.f_frsize : vfs.f_bsize;
+      avail = (unsigned long long) vfs.f_bavail * bsize;
+      for (i = 0, need = 0; i < njobs; i++) {
+         need += (jobs[i].mod_size + bsize - 1) / bsize * bsize;
+         need += (jobs[i].moi_size + bsize - 1) / bsize * bsize;
+      }
+      need *= copies;
+
+      if ( plan_only || verbose >= 2 )
+         log_msg(2, "space", "%s: %d file pairs, %llu bytes needed, %llu bytes available in %s\n",
+               this, njobs * copies, need, avail, dests[d].dir);
+      if ( need > avail ) {
+         fprintf(stderr, "%s: Error: not enough space in %s: need %llu bytes, have %llu\n",
+               this, dests[d].dir, need, avail);
+         ok = 0;
+      }
+   }
+   return ok;
+}
+
+/*****************************************************************************
+ * convert every job in one lane, in planned order
+ ****************************************************************************/
+void run_lane(int lane) {
+   int i, j;
+
+   LOG(3, "worker", "%s: worker %d starting lane %d\n", this, (int) getpid(), lane);
+   for (i = 0; i < njobs; i++) {
+      if ( jobs[i].lane != lane )
+         continue;
+      for (next_job = NULL, j = i + 1; j < njobs && !next_job; j++) {
+         if ( jobs[j].lane == lane )
+            next_job = &jobs[j];
+      }
+      process_job(&jobs[i]);
+   }
+}
+
+/*****************************************************************************
+ * Get the source device going on job's MOD while the one before it is
+ * still being finished off: make_mpeg() calls this when it is within
+ * PREFETCH_LEN of the end of a MOD. The kernel reads the first PREFETCH_LEN
+ * of the next MOD, and its MOI, into the page cache in the background
+ * (posix_fadvise WILLNEED starts the reads and returns), so by the time
+ * the tail of the mpeg is written and the MOI copied, the next make_mpeg()
+ * finds its first blocks waiting. No threads, and nothing if it is wrong:
+ * it is only a hint.
+ *
+ * Skipped with --read-limit, --iops or --throttle-file, since it would read
+ * behind the throttle's back.
+ ****************************************************************************/
+void prefetch_job(job_type *job) {
+   if ( !prefetch || read_limit > 0 || iops_limit > 0 || throttle_fname )
+      return;
+   LOG(3, "prefetch", "%s: prefetching %s\n", this, job->mod_fname);
+   prefetch_file(job->mod_fname, PREFETCH_LEN);
+   prefetch_file(job->moi_fname, PREFETCH_LEN);
+}
+
+/*
+ * the first len bytes of fname, on its own or in the card image
+ */
+static void prefetch_file(char *fname, long long len) {
+   image_file_type *f;
+   int e, fd;
+
+   if ( (f = image_lookup(fname)) != NULL ) {
+      for (e = 0; e < f->next && f->ext[e].off < len; e++)
+         posix_fadvise(image->fd, f->ext[e].phys, f->ext[e].len, POSIX_FADV_WILLNEED);
+      return;
+   }
+   if ( (fd = open(fname, O_RDONLY)) < 0 )
+      return;
+   posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+   close(fd);
+}
+
+/*****************************************************************************
+ * convert one MOD/MOI pair. Target dir has already been created.
+ ****************************************************************************/
+void process_job(job_type *job) {
+   moi_info_type *info = job->info;
+   char mpeg_dirname[MAX_PATH_LEN];
+   char dest_fname_base[MAX_PATH_LEN];
+   char ckpt_fname[MAX_PATH_LEN];
+   char shard_reldir[MAX_PATH_LEN];
+   char key[SHARD_KEY_LEN + 1];
+   output_type out[MAX_DESTS];
+   int lock_fd[MAX_DESTS];
+   int d, nout = 0, ok, archived = 0;
+
+   LOG(2, "job", "-----------------------------------\n");
+   LOG(1, "job", "%s: processing %s\n", this, job->mod_fname);
+   PROBE1(file__start, job->mod_fname);
+   if ( in_place ) {
+      ok = fix_in_place(job);
+      PROBE2(file__done, job->mod_fname, ok);
+      count_job(job, ok);
+      return;
+   }
+
+   /* build destination file name */
+   if ( date_to_use == MTIME_DATE )
+      sprintf(dest_fname_base, "mov-%s", info->mtime_date_str);
+   else 
+      sprintf(dest_fname_base, "mov-%s", info->moi_date_str);
+
+   /* --layout=sharded: the mpeg is filed under its key, and the date dir
+    * gets a link to it once it's made */
+   if ( layout == LAYOUT_SHARDED ) {
+      if ( !shard_key(job, key) ) {
+         PROBE2(file__done, job->mod_fname, 0);
+         count_job(job, 0);
+         return;
+      }
+      sprintf(shard_reldir, "%s/%.2s/%.2s", SHARD_DIR, key, key + 2);
+   }
+
+   /* one mpeg in each destination, all written from a single read of the MOD */
+   for (d = 0; d < ndests; d++) {
+      output_type *o = &out[nout];
+
+      o->dest = &dests[d];
+      o->fp = NULL;
+      o->failed = 0;
+      lock_fd[nout] = -1;
+      if ( layout == LAYOUT_SHARDED ) {
+         /* already archived is a couple of fstatat()s, unless -c */
+         if ( noclobber && shard_archived(&dests[d], shard_reldir, key, job->mod_size) ) {
+            LOG(1, "skip", "%s:    %s/%s/%s.mpeg is already archived\n", this, dests[d].dir, shard_reldir, key);
+            archived++;
+            continue;
+         }
+         if ( make_date_dir(&dests[d], shard_reldir) < 0 ) {
+            fprintf(stderr, "%s: WARNING: unable to create directory %s/%s\n", this, dests[d].dir, shard_reldir);
+            perror(shard_reldir);
+            fprintf(stderr, "   skipping...\n");
+            continue;
+         }
+         sprintf(mpeg_dirname, "%s/%s", dests[d].dir, shard_reldir);
+
+         /* there is only one name, so two workers given the same clip take
+          * turns: whoever has the lock makes it, and holds it until the
+          * checkpoint is gone */
+         switch ( shard_claim(&dests[d], shard_reldir, key, job->mod_size, &lock_fd[nout]) ) {
+            case SHARD_MAKE:
+               break;
+            case SHARD_DONE:
+               LOG(1, "skip", "%s:    %s/%s.mpeg is already archived\n", this, mpeg_dirname, key);
+               archived++;
+               continue;
+            case SHARD_BUSY:
+               LOG(1, "skip", "%s:    %s/%s.mpeg is being made by another worker\n", this, mpeg_dirname, key);
+               archived++;
+               continue;
+            default:
+               fprintf(stderr, "%s: WARNING: unable to create output file for %s in %s\n", this, job->mod_fname, dests[d].dir);
+               perror(key);
+               fprintf(stderr, "   skipping...\n");
+               continue;
+         }
+      }
+      else if ( job->mpeg_reldir[0] )
+         sprintf(mpeg_dirname, "%s/%s", dests[d].dir, job->mpeg_reldir);
+      else
+         sprintf(mpeg_dirname, "%s", dests[d].dir);
+
+      /* an earlier run may have been interrupted part way through this one */
+      if ( resume && find_checkpoint(&o->ckpt, job->mod_fname, mpeg_dirname, layout == LAYOUT_SHARDED ? key : dest_fname_base, o->fname) ) {
+         if ( (o->fd = open(o->fname, O_RDWR)) < 0 ) {
+            perror(o->fname);
+            if ( lock_fd[nout] >= 0 )
+               close(lock_fd[nout]);
+            continue;
+         }
+         LOG(1, "resume", "%s:    resuming %s at %lld bytes\n", this, o->fname, o->ckpt.committed);
+      }
+      else {
+         if ( layout == LAYOUT_SHARDED ) {
+            /* ours, so whatever is there goes */
+            sprintf(o->fname, "%s/%s.mpeg", mpeg_dirname, key);
+            if ( (o->fd = open(o->fname, O_WRONLY | O_TRUNC)) < 0 )
+               perror(o->fname);
+         }
+         else {
+            /* pick the first unused name and create it, so nobody else can take it */
+            o->fd = claim_dest_name(mpeg_dirname, dest_fname_base, o->fname);
+         }
+         if ( o->fd < 0 ) {
+            fprintf(stderr, "%s: WARNING: unable to create output file for %s in %s\n", this, job->mod_fname, dests[d].dir);
+            fprintf(stderr, "   skipping...\n");
+            if ( lock_fd[nout] >= 0 )
+               close(lock_fd[nout]);
+            continue;
+         }
+         LOG(1, "create", "%s:    creating %s\n", this, o->fname);
+
+         /* until the mpeg is done, there is always a checkpoint next to it,
+          * on disk before make_mpeg() allocates the whole file: a full size
+          * mpeg with no checkpoint is a finished one */
+         init_checkpoint(&o->ckpt, job->mod_fname);
+         if ( !write_checkpoint(&o->ckpt, o->fname, dests[d].fsync_mode != FSYNC_NONE) ) {
+            close(o->fd);
+            unlink(o->fname);
+            if ( lock_fd[nout] >= 0 )
+               close(lock_fd[nout]);
+            continue;
+         }
+      }
+      nout++;
+   }
+   if ( nout == 0 ) {
+      PROBE2(file__done, job->mod_fname, archived);
+      count_job(job, archived);
+      return;
+   }
+
+   /* do the real work */
+   if ( make_mpeg(job->mod_fname, out, nout, info) )
+      copy_moi(job->moi_fname, out, nout);
+
+   /* anything that failed keeps its checkpoint, so it can be resumed */
+   for (d = 0, ok = 0; d < nout; d++) {
+      if ( !out[d].failed ) {
+         checkpoint_fname(ckpt_fname, out[d].fname);
+         unlink(ckpt_fname);
+         if ( layout == LAYOUT_SHARDED && job->mpeg_reldir[0] )
+            shard_link(out[d].dest, job->mpeg_reldir, dest_fname_base, out[d].fname);
+         if ( catalog_fname )
+            catalog_add(job, out[d].fname);
+         ok++;
+      }
+      if ( lock_fd[d] >= 0 )
+         close(lock_fd[d]);   /* and the lock with it */
+   }
+   PROBE2(file__done, job->mod_fname, ok + archived);
+   count_job(job, ok + archived);
+}
+
+/*****************************************************************************
+ * copy the MOI file next to each mpeg that was written successfully, reading
+ * it only once
+ ****************************************************************************/
+void copy_moi(char *moi_fname, output_type *out, int nout) {
+   FILE *src, *dest[MAX_DESTS];
+   char dest_fname[MAX_DESTS][MAX_PATH_LEN];
+   char *buf;
+   int br=0, bw=0, len=0, d, ndest=0;
+
+
+   if ( verbose >= 2 )
+      fprintf(stderr, "%s: copying moi file\n", this);
+
+   for (d = 0; d < nout; d++) {
+      dest[d] = NULL;
+      dest_fname[d][0] = '\0';
+      if ( out[d].failed )
+         continue;
+
+      /* trim off .mpeg extension and add .moi */
+      len = strlen(out[d].fname) - 5;
+      sprintf(dest_fname[d], "%.*s.moi", len, out[d].fname);
+
+      /* test to see if the file already exists */
+      if ( noclobber && file_exists(dest_fname[d]) ) {
+         if ( verbose >= 2 ) {
+            fprintf(stderr, "   %s exists!\n", dest_fname[d]);
+            fprintf(stderr, "   skipping... file exists and noclobber is on\n");
+         }
+         dest_fname[d][0] = '\0';
+         continue;
+      }
+      ndest++;
+   }
+   if ( ndest == 0 )
+      return;
+
+   /* open copy from file */
+   if ( (src = src_fopen(moi_fname)) == NULL ) {
+      fprintf(stderr, "%s: WARNING: cannot open .MOI file to copy %s\n", this, moi_fname);
+      perror(moi_fname);
+      fprintf(stderr, "   skipping...\n");
+      return;
+   }
+   /* open copy to files */
+   for (d = 0; d < nout; d++) {
+      if ( !dest_fname[d][0] )
+         continue;
+      if ( (dest[d] = fopen(dest_fname[d], "wb")) == NULL ) {
+         fprintf(stderr, "%s: unable to open %s\n", this, dest_fname[d]);
+         perror(dest_fname[d]);
+      }
+   }
+
+   /* copy data from moi file to each destination */
+   buf = (char *) mymalloc(RW_BLOCK_SIZE);
+   while( (br = fread(buf, 1, RW_BLOCK_SIZE, src)) > 0 ) {
+      throttle_io(THROTTLE_READ, br);
+      progress_read(br);
+      for (d = 0; d < nout; d++) {
+         if ( !dest[d] )
+            continue;
+         throttle_io(THROTTLE_WRITE, br);
+         bw = fwrite(buf, 1, br, dest[d]);
+         if ( bw < 0 || ferror(dest[d]) ) {
+            fprintf(stderr, "%s: write failed: %s\n", this, dest_fname[d]);
+            perror(dest_fname[d]);
+            fclose(dest[d]);
+            dest[d] = NULL;
+         }
+      }
+   }
+
+   fclose(src);
+   for (d = 0; d < nout; d++) {
+      if ( !dest[d] )
+         continue;
+      if ( out[d].dest->fsync_mode == FSYNC_CLOSE && (fflush(dest[d]) != 0 || fsync(fileno(dest[d])) < 0) )
+         perror(dest_fname[d]);
+      fclose(dest[d]);
+   }
+   free(buf);
+
+   return;
+}
+
+/*****************************************************************************
+ * parse the MOI file
+ * reference:
+ * http://forum.camcorderinfo.com/bbs/t135224.html  (further down is English translation)
+ * http://en.wikipedia.org/wiki/MOI_(file_format)
+ ****************************************************************************/
+int get_moi_info(moi_info_type *info, char *moi_fname) {
+   FILE *infile;
+   char str[64] = "";
+   struct tm *tm_buf;
+   struct stat mtime_buf;
+   time_t now = time(0);
+
+
+   PROBE1(moi__start, moi_fname);
+
+   /* open input file */
+   infile = src_fopen(moi_fname);
+   if (infile == NULL) {
+      fprintf(stderr, "%s: WARNING: cannot open .MOI file %s\n", this, moi_fname);
+      fprintf(stderr, "   skipping...\n");
+      PROBE2(moi__done, moi_fname, 0);
+      return 0;
+   }
+
+   /* get file access time on the file */
+   src_stat(moi_fname, &mtime_buf); 
+   info->mtime = mtime_buf.st_mtime;
+   tm_buf = localtime(&mtime_buf.st_mtime);
+   info->mtime_year  = tm_buf->tm_year + 1900;
+   info->mtime_mon   = tm_buf->tm_mon + 1;
+   info->mtime_day   = tm_buf->tm_mday;
+   info->mtime_hour  = tm_buf->tm_hour;
+   info->mtime_min   = tm_buf->tm_min;
+   info->mtime_sec   = tm_buf->tm_sec;
+   sprintf(str, "%04d%02d%02d-%02d%02d%02d", 
+         info->mtime_year, info->mtime_mon, info->mtime_day, info->mtime_hour, info->mtime_min, info->mtime_sec);
+   strcpy(info->mtime_date_str, str);
+
+   /* get current time seconds - cheesy hack to make unique file names */
+   tm_buf = localtime(&now);
+   sprintf(info->now_sec, "%02d", tm_buf->tm_sec);
+
+   /* get info out of the MOI fie */
+
+   /* Year offset: 0x0007 (byte 8) - not sure what's in 0x0006
+    * values: D0 - FF = 2000 - 2074 */
+   fseek(infile, 0x07, SEEK_SET);
+   info->moi_year = ((unsigned char) fgetc(infile)) - 0xD0 + 2000;
+
+   /* Month * offset: 0x0008 
+    * values: 01 - 0C = Month 1 - 12 */
+   fseek(infile, 0x08, SEEK_SET);
+   info->moi_mon = (unsigned char) fgetc(infile);
+
+   /* Day offset: 0x0009
+    * values: 01 - 1F = Day 1 - 31 */
+   fseek(infile, 0x09, SEEK_SET);
+   info->moi_day = (unsigned char) fgetc(infile);
+
+   /* Hour offset: 0x000A
+    * values: 00 - 17 = Hour 0 - 23 */
+   fseek(infile, 0x0A, SEEK_SET);
+   info->moi_hour = (unsigned char) fgetc(infile);
+   //hour--;  /* hour seems to be +1 from the file time */
+
+   /* Minute offset: 0x000B
+    * values: 00 - 3B = Minute 0 - 59 */
+   fseek(infile, 0x0B, SEEK_SET);
    info->moi_min = (unsigned char) fgetc(infile);
 
    /* Aspect Ratio offset: 0x0080
@@ -680,12 +2362,11 @@ int get_moi_info(moi_info_type *info, char *moi_fname) {
     * wikipeida reference above (and others) say: values: 51 = 4:3, 55 = 16:9 */
    fseek(infile, 0x80, SEEK_SET);
    info->aspect_ratio = (unsigned char) fgetc(infile);
-   if ( info->aspect_ratio == 0x40 || info->aspect_ratio == 0x50 || info->aspect_ratio == 0x51 )
-      strcpy(info->aspect_ratio_str, "4:3");
-   else if ( info->aspect_ratio == 0x44 || info->aspect_ratio == 0x54 || info->aspect_ratio == 0x55 )
-      strcpy(info->aspect_ratio_str, "16:9");
+   if ( aspect_ratio_name(info->aspect_ratio) )
+      strcpy(info->aspect_ratio_str, aspect_ratio_name(info->aspect_ratio));
    else {
       fprintf(stderr, "ERROR: Unknown aspect ratio value in MOI file: %02X\n", info->aspect_ratio);
+      PROBE2(moi__done, moi_fname, 0);
       return 0;
    }
 
@@ -698,15 +2379,30 @@ int get_moi_info(moi_info_type *info, char *moi_fname) {
    strcpy(info->moi_date_str,str);
 
    if ( (verbose >= 2) || info_only ) {
-      printf("%s: MOI Info  (%s):\n", this, moi_fname);
-      printf("   moi_date_str   = %s\n", info->moi_date_str);
-      printf("   mtime_date_str = %s\n", info->mtime_date_str);
-      printf("   aspect_ratio   = 0x%X (%s)\n", info->aspect_ratio, info->aspect_ratio_str);
+      log_msg(2, "moi", "%s: MOI Info  (%s):\n"
+            "   moi_date_str   = %s\n"
+            "   mtime_date_str = %s\n"
+            "   aspect_ratio   = 0x%X (%s)\n",
+            this, moi_fname, info->moi_date_str, info->mtime_date_str,
+            info->aspect_ratio, info->aspect_ratio_str);
    }
 
+   PROBE2(moi__done, moi_fname, 1);
    return 1;
 }
 
+/*****************************************************************************
+ * "4:3" or "16:9" for the aspect ratio byte in an MOI file, NULL if we
+ * don't know it. See get_moi_info().
+ ****************************************************************************/
+char *aspect_ratio_name(unsigned char ar) {
+   if ( ar == 0x40 || ar == 0x50 || ar == 0x51 )
+      return "4:3";
+   if ( ar == 0x44 || ar == 0x54 || ar == 0x55 )
+      return "16:9";
+   return NULL;
+}
+
 
 /*****************************************************************************
  * Create the mpeg file from the mod/moi files.  Read MOD file, scanning for
@@ -742,329 +2438,4755 @@ int get_moi_info(moi_info_type *info, char *moi_fname) {
  * http://dvd.sourceforge.net/dvdinfo/mpeghdrs.html#seq
  *
  ****************************************************************************/
-void make_mpeg(char *mod_fname, char *mpeg_fname, moi_info_type *info) {
-   FILE *mpeg, *mod;
-   //char mpeg_fname[MAX_PATH_LEN];
-   unsigned char reference_seqh[] = { 0,0,0,0,0,0,0,0,0,0,0,0 };
-   unsigned char sig[] = { 0x00, 0x00, 0x01, 0xB3 };  /* mpeg sequence header signature */
+int make_mpeg(char *mod_fname, output_type *out, int nout, moi_info_type *info) {
+   FILE *mod;
    unsigned char *buf, *p, *stop, *end, *hold;        /* buffer pointers */
    int br=0, bw=0, blksize=RW_BLOCK_SIZE, chunksize=0;/* bytes read, bytes written, block size, tail end of block */
-   int blk=0, seqh=0, i;                              /* block count, sequence header count, general counter */
-   unsigned char arfr, ar, fr;                        /* seqh offset 7, aspect ratio, frame rate */
+   int blk=0, d;                                      /* block count, general counter */
+   rewrite_type rw;                                   /* what we do to the headers */
    long long int tbw=0;                               /* total bytes written */
+   struct stat st;
+   unsigned char *tail;                               /* resume: last committed block */
+   checkpoint_type *resume_from = NULL;               /* resume: checkpoint we restart from */
+   ts_type ts;                                        /* .TOD: transport stream state */
+   demux_type dm;                                     /* --poster, --demux, --mp4: the streams in the mpeg ... */
+   split_type sp;                                     /* ... where they go ... */
+   poster_type pf;                                    /* ... and the I-frame we want from the video */
+   mp4_type mp4;                                      /* ... and the mp4 they make */
+
+   rewrite_compile(&rw, info);
+
+   /* open mod file */
+   if ( (mod = src_fopen(mod_fname)) == NULL ) {
+      fprintf(stderr, "%s: unable to open %s\n", this, mod_fname);
+      perror(mod_fname);
+      exit(1);
+   }
+   if ( src_stat(mod_fname, &st) < 0 )
+      st.st_size = 0;
 
+   /* .TOD files are transport streams. We read those in whole packets. */
+   if ( ts_detect(mod, &ts) ) {
+      blksize -= blksize % ts.pkt;
+      LOG(3, "ts", "%s: %s is a transport stream, %d byte packets\n", this, mod_fname, ts.pkt);
+   }
+
+   for (d = 0; d < nout; d++) {
+      LOG(2, "create", "%s: creating mpeg file %s\n", this, out[d].fname);
+      if ( out[d].stream )
+         continue;
+
+      /* mpeg file was created (O_EXCL) by claim_dest_name(), or is one we
+       * are resuming, so there is no existing file to clobber here */
+      if ( (out[d].fp = fdopen(out[d].fd, "wb")) == NULL ) {
+         output_failed(&out[d], "unable to open");
+         continue;
+      }
+
+      /* the mpeg is exactly the size of the MOD file, so allocate all of it
+       * now. The file comes out contiguous, and if the disk is full we find
+       * out before copying anything rather than part way through. */
+#ifdef FALLOC_FL_KEEP_SIZE
+      if ( st.st_size > 0 && fallocate(out[d].fd, 0, 0, st.st_size) < 0 ) {
+         if ( errno == ENOSPC || errno == EFBIG ) {
+            fprintf(stderr, "%s: not enough space for %s (%lld bytes)\n", this, out[d].fname, (long long) st.st_size);
+            fprintf(stderr, "   skipping...\n");
+            output_failed(&out[d], NULL);
+            continue;
+         }
+         /* EOPNOTSUPP etc: file system can't do it, just write normally */
+      }
+#endif
+
+      /* an mpeg started with other rules (--frame-rate, --fix-display, a
+       * changed MOI) would come out half one way and half the other */
+      if ( out[d].ckpt.committed > 0 && (out[d].ckpt.ar != rw.ar || out[d].ckpt.fr != rw.fr
+            || out[d].ckpt.fix_display != !rw.seqh_only) ) {
+         fprintf(stderr, "%s: %s was started with aspect ratio %s, frame rate %s%s; not resuming it\n", this,
+               out[d].fname, out[d].ckpt.ar <= 4 ? mpeg_seqh_ar_codes[out[d].ckpt.ar] : "?",
+               out[d].ckpt.fr == 0 ? "as is" : out[d].ckpt.fr <= 8 ? mpeg_seqh_fr_codes[out[d].ckpt.fr] : "?",
+               out[d].ckpt.fix_display ? " and --fix-display" : "");
+         fprintf(stderr, "   run again with the same options, or --no-resume to start a new one\n");
+         fprintf(stderr, "   skipping...\n");
+         output_failed(&out[d], NULL);
+         continue;
+      }
 
+      /* Resuming an interrupted mpeg. Before trusting the checkpoint, make
+       * sure the last block it says was committed really is in the file
+       * (reading back one block is a lot cheaper than redoing the whole
+       * file). */
+      if ( out[d].ckpt.committed > 0 ) {
+         tail = (unsigned char *) mymalloc(out[d].ckpt.tail_len);
+         if ( pread(out[d].fd, tail, out[d].ckpt.tail_len, out[d].ckpt.committed - out[d].ckpt.tail_len) != out[d].ckpt.tail_len
+               || block_hash(tail, out[d].ckpt.tail_len) != out[d].ckpt.tail_hash ) {
+            fprintf(stderr, "%s: WARNING: %s does not match its checkpoint, starting over\n", this, out[d].fname);
+            init_checkpoint(&out[d].ckpt, mod_fname);
+         }
+         else {
+            LOG(2, "resume", "%s: verified %lld bytes already written to %s\n", this, out[d].ckpt.committed, out[d].fname);
+         }
+         free(tail);
+      }
+   }
+
+   /* With more than one destination, we can only skip what every one of
+    * them already has. Pick up reading the MOD and writing the mpegs at that
+    * offset, with the scan state we had at the time. Anything a destination
+    * had beyond that just gets written again. */
+   for (d = 0; d < nout; d++) {
+      if ( !out[d].failed && (!resume_from || out[d].ckpt.committed < resume_from->committed) )
+         resume_from = &out[d].ckpt;
+   }
+   if ( !resume_from ) {
+      fprintf(stderr, "%s: unable to write %s to any destination\n", this, mod_fname);
+      fclose(mod);
+      return 0;
+   }
+   if ( resume_from->committed > 0 ) {
+      if ( fseeko(mod, resume_from->committed, SEEK_SET) < 0 ) {
+         perror(mod_fname);
+         exit(1);
+      }
+      tbw = resume_from->committed;
+      blk = resume_from->blk;
+      rw.seqh = resume_from->seqh;
+      memcpy(rw.reference_seqh, resume_from->reference_seqh, 12);
+      rw.arfr = resume_from->arfr;
+      rw.ext = resume_from->ext;
+      ts.video_pid = resume_from->video_pid;
+      LOG(2, "resume", "%s: resuming at byte %lld, block %d\n", this, tbw, blk);
+   }
+   for (d = 0; d < nout; d++) {
+      if ( !out[d].failed && !out[d].stream && fseeko(out[d].fp, tbw, SEEK_SET) < 0 )
+         output_failed(&out[d], "seek failed");
+   }
+
+   /* the poster frame is near the start, so a resumed mpeg has one by
+    * now. The sidecars and mp4 need all of it, so a resumed mpeg goes
+    * without. */
+   if ( (demux_es || make_mp4) && tbw > 0 )
+      fprintf(stderr, "%s: WARNING: resuming %s part way, no elementary streams or mp4 for it\n", this, mod_fname);
+   poster_init(&pf, out, nout);
+   mp4_init(&mp4, out, nout);
+   split_init(&sp, out, nout, poster_nth && tbw == 0 ? &pf : NULL, demux_es && tbw == 0, make_mp4 && tbw == 0 ? &mp4 : NULL);
+   demux_init(&dm, &ts, split_es, &sp);
+   dm.audio = sp.demux || sp.mp4;
+   dm.done = !sp.pf && !sp.demux && !sp.mp4;
+
+   /* copy data from mod file to the mpeg file. A header found right at
+    * stop is read a few bytes past the end of the block, hence the slack. */
+   buf = (char *) mymalloc(RW_BLOCK_SIZE + 16);
+
+   /*
+   while( (br = fread(buf, 1, RW_BLOCK_SIZE, mod)) > 0 ) {
+      bw = fwrite(buf, 1, br, mpeg);
+      if ( bw < 0 || ferror(mpeg) ) {
+         perror("write failed");
+         exit(1);
+      }
+   }
+   */
+
+   LOG(3, "scan", "%s: processing MOD file in %d byte blocks\n", this, blksize );
+
+   hold = buf;
+   while ( (br = fread(buf+chunksize, 1, blksize, mod)) > 0 ) {
+     throttle_io(THROTTLE_READ, br);
+     progress_read(br);
+     blk++; 
+     PROBE2(block__read, blk, br);
+
+      /* nearly done with this one, get the next one coming */
+      if ( next_job && (st.st_size <= 0 || ftello(mod) >= st.st_size - PREFETCH_LEN) ) {
+         prefetch_job(next_job);
+         next_job = NULL;
+      }
+      /* 
+       * We want to stop scanning within a headers+signature from the end of
+       * the block.  Then move this remaining chunk to the beginning of the
+       * buffer, set buffer pointer at the end of this chunk and do our next
+       * fread.  Not sure what to do about the last block - but I doubt there
+       * is a sequence header at the very end of the file...  At least I hope
+       * not.
+       */
+      p = end = buf;
+      end = buf + br + chunksize;  /* this had better add up! */
+      stop = end - REWRITE_LEN;  /* last place a whole header can start */
+
+      LOG(4, "blk", "%s: blk(%d) br=%d, end-buf=%ld, stop-buf=%ld, end-stop=%ld, buf-hold=%ld\n",
+               this, blk, br, end-buf, stop-buf, end-stop, buf-hold);
+
+      /* transport stream: packet by packet, holding back whatever we aren't
+       * done with. The held back packets have already been scanned. */
+      if ( ts.pkt )
+         p = ts_scan(&ts, buf, buf + chunksize, end, &rw, blk);
+      
+      /* scan through the buffer */
+      while ( !ts.pkt && p <= stop ) {
+
+         /* skip ahead to the next header we have a rule for, starting at
+          * or before stop */
+         if ( (p = rewrite_find(&rw, p, end)) == NULL ) {
+            p = stop + 1;
+            break;
+         }
+
+         /* found signature, fix it up (or not) */
+         if ( !rw.on[p[3]](&rw, p, blk) ) {
+            p++;
+            continue;
+         }
+         p += 8;
+
+      }  /* end scan through block */
+
+      /* account for last increment block scan loop */
+      if ( !ts.pkt )
+         p--;  
+
+      /* write out the buffer, to every destination */
+      if ( !write_outputs(out, nout, buf, p - buf) ) {
+         fprintf(stderr, "%s: write failed on every destination\n", this);
+         exit(1);
+      }
+      PROBE2(block__write, blk, p - buf);
+      if ( !dm.done )
+         demux_feed(&dm, buf, p - buf);
+      bw = p - buf;
+      tbw += bw;
+      LOG(4, "blk", "%s: blk(%d) bw=%ld, tbw=%lld \n", this, blk, p - buf, tbw);
+
+      /* every so often, make sure what we've written so far is on disk and
+       * record that, so an interrupted run can be resumed from here */
+      if ( blk % CHECKPOINT_BLOCKS == 0 && p > buf ) {
+         for (d = 0; d < nout; d++) {
+            if ( out[d].failed || out[d].stream )
+               continue;
+            if ( fflush(out[d].fp) != 0
+                  || (out[d].dest->fsync_mode != FSYNC_NONE && fdatasync(out[d].fd) < 0) ) {
+               output_failed(&out[d], "write failed");
+               continue;
+            }
+            out[d].ckpt.committed = tbw;
+            out[d].ckpt.tail_len = p - buf;
+            out[d].ckpt.tail_hash = block_hash(buf, p - buf);
+            out[d].ckpt.blk = blk;
+            out[d].ckpt.seqh = rw.seqh;
+            memcpy(out[d].ckpt.reference_seqh, rw.reference_seqh, 12);
+            out[d].ckpt.arfr = rw.arfr;
+            out[d].ckpt.video_pid = ts.video_pid;
+            out[d].ckpt.ar = rw.ar;
+            out[d].ckpt.fr = rw.fr;
+            out[d].ckpt.fix_display = !rw.seqh_only;
+            out[d].ckpt.ext = rw.ext;
+            write_checkpoint(&out[d].ckpt, out[d].fname, 0);
+         }
+      }
+
+      /* since seqh may span blocks, move last bit of data from end of buffer
+       * to the beginning of next buffer */
+      chunksize = end - p;
+      blksize = RW_BLOCK_SIZE - chunksize;
+      if ( ts.pkt )
+         blksize -= blksize % ts.pkt;
+
+      LOG(5, "blk", "%s: blk(%d) Bytes to end of block: %d, RW_BLOCK_SIZE: %d, next blocksize: %d\n", 
+               this, blk, chunksize, RW_BLOCK_SIZE, blksize);
+
+      memmove(buf, p, chunksize);
+      if ( ts.pkt )
+         ts_rebase(&ts, p - buf);
+   }  /* end fread */
+
+
+   /* write out the last bit of buffer */
+   if ( !write_outputs(out, nout, buf, chunksize) ) {
+      fprintf(stderr, "%s: write failed on every destination\n", this);
+      exit(1);
+   }
+   PROBE2(block__write, blk, chunksize);
+   if ( !dm.done )
+      demux_feed(&dm, buf, chunksize);
+   split_finish(&sp);
+   tbw += chunksize;
+   LOG(4, "blk", "%s: blk(%d) bw=%ld, tbw=%lld \n", this, blk, p - buf, tbw);
+
+   /* wrap up */
+   for (d = 0; d < nout; d++) {
+      if ( out[d].failed )
+         continue;
+      /* a stream can't be fixed up afterwards, it had better be what we said */
+      if ( out[d].stream ) {
+         if ( out[d].size >= 0 && tbw != out[d].size ) {
+            fprintf(stderr, "%s: %s changed size while it was being read (%lld bytes, expected %lld)\n",
+                  this, mod_fname, tbw, out[d].size);
+            exit(1);
+         }
+         continue;
+      }
+      /* in case the MOD came up shorter than what we allocated */
+      if ( fflush(out[d].fp) != 0 || ftruncate(out[d].fd, tbw) < 0
+            || (out[d].dest->fsync_mode == FSYNC_CLOSE && fsync(out[d].fd) < 0) ) {
+         output_failed(&out[d], "write failed");
+         continue;
+      }
+      if ( (fclose(out[d].fp)) < 0 ) {
+         out[d].fp = NULL;
+         output_failed(&out[d], "unable to close");
+      }
+   }
+   if ( (fclose(mod)) < 0 ) {
+      fprintf(stderr, "%s: unable to close %s\n", this, mod_fname);
+      perror(mod_fname);
+      exit(1);
+   }
+
+   free(buf);
+   for (d = 0; d < nout; d++) {
+      if ( !out[d].failed )
+         return 1;
+   }
+   return 0;
+}
+
+/*****************************************************************************
+ * Header rewriting
+ *
+ * make_mpeg() makes one pass over the MOD and fixes up every header it has
+ * a rule for. rewrite_compile() turns the MOI info and the command line
+ * into a table of handlers indexed by start code (the byte after 00 00 01),
+ * so the scan does one table lookup per start code it finds, and picks the
+ * search to go with it: the seqh_find() kernel when sequence headers are
+ * all we want, otherwise a search for any start code in the table.
+ *
+ * The rules:
+ *    00 00 01 B3   sequence header: aspect ratio from the MOI, frame rate
+ *                  kept or set by --frame-rate (offset 7)
+ *    00 00 01 B5   sequence_display_extension (extension id 2), with
+ *                  --fix-display: display size set to the coded size, so
+ *                  players go by the aspect ratio in the sequence header
+ *                  rather than a pan&scan window
+ *
+ * sequence_display_extension format:
+ * | byte 4       | [bytes 5-7]        | 14 bits     |  1   | 14 bits     |
+ * |id=2|fmt|colr | [colour desc if c] | display h   |marker| display v   |
+ *
+ * reference: ISO/IEC 13818-2 6.2.2.4
+ ****************************************************************************/
+
+/*
+ * build rw for one MOD. State (the reference header and so on) starts out
+ * empty; a resume puts its checkpoint's back afterwards.
+ */
+void rewrite_compile(rewrite_type *rw, moi_info_type *info) {
+   int c;
+
+   memset(rw, 0, sizeof(rewrite_type));
+
+   /* aspect ratio code for the upper nibble of seqh offset 7 */
+   for (c = 1; c <= 4; c++) {
+      if ( strcmp(info->aspect_ratio_str, mpeg_seqh_ar_codes[c]) == 0 )
+         rw->ar = c;
+   }
+   if ( rw->ar == 0 ) {
+      fprintf(stderr, "ERROR: invalid aspect ratio in MOI info structure (%s)\n", info->aspect_ratio_str);
+      exit(1);
+   }
+   rw->fr = frame_rate;
+
+   rw->on[0xB3] = rewrite_seqh;
+   if ( fix_display )
+      rw->on[0xB5] = rewrite_display;
+   rw->seqh_only = !fix_display;
+
+   LOG(3, "rewrite", "%s: rewriting seqh aspect ratio %s, frame rate %s%s\n", this,
+         mpeg_seqh_ar_codes[rw->ar], rw->fr ? mpeg_seqh_fr_codes[rw->fr] : "as is",
+         fix_display ? ", display extension size" : "");
+}
+
+/*
+ * the first header in [p, lim) that rw has a rule for, all REWRITE_LEN
+ * bytes of it before lim, or NULL
+ */
+static unsigned char *rewrite_find(rewrite_type *rw, unsigned char *p, unsigned char *lim) {
+   unsigned char *q;
+
+   if ( rw->seqh_only )
+      return seqh_find(p, lim - (REWRITE_LEN - 4));
+
+   /* step from 01 to 01, the rarest of the three signature bytes */
+   lim -= REWRITE_LEN - 4;
+   for (q = p + 2; q + 2 <= lim && (q = memchr(q, 0x01, lim - 1 - q)) != NULL; q++) {
+      if ( q[-1] == 0x00 && q[-2] == 0x00 && rw->on[q[1]] )
+         return q - 2;
+   }
+   return NULL;
+}
+
+/*
+ * p points at a sequence header signature (12 bytes of header). Decide
+ * whether it is one we patch: the first one becomes the reference and sets
+ * rw->arfr, the aspect-ratio|frame-rate byte every header gets at offset 7.
+ * Returns 1 if we patched it, 0 to leave this one alone.
+ */
+static int rewrite_seqh(rewrite_type *rw, unsigned char *p, int blk) {
+   unsigned char ar, fr;                              /* aspect ratio, frame rate */
+   char hex[40];                                      /* seqh hex dump for the log */
+
+   rw->seqh++;
+
+   /* print out the entire sequence header */
+   LOG(5, "seqh", "%s: (blk:%d seqh:%d)%s\n", this, blk, rw->seqh, hex_str(hex, p, 12));
+   
+   /* use first sequence header we come to as our reference header
+    *
+    * If all other sequence headers do not match our reference
+    * sequence header, we skip them.  I do this because I've found
+    * some sequence header signatures followed by non-standard data in
+    * some MOD files.  I assume that it is a random occurrence of the
+    * signature in some other data section.  Needs more research, but
+    * this seems to works for now.
+    */
+   if ( rw->reference_seqh[3] == 0 ) {
+      memcpy(rw->reference_seqh, p, 12);
+
+      LOG(3, "seqh", "%s: found first sequence header, using as reference [%s ]\n",
+            this, hex_str(hex, p, 12));
+
+      /* 
+       * define arfr - the aspect-ratio|frame-rate byte (offset 7) that we will
+       * use in every other sequence header we find.
+       *
+       * grab seq header offset 7. This has aspect ratio in the upper nibble,
+       * and frame rate in the lower nibble. We keep whatever the frame rate
+       * is, unless told otherwise, and set the aspect ratio to whatever our
+       * MOI file said it should be
+       */
+      fr = rw->fr ? rw->fr : *(p + 7) & 0x0F;
+      rw->arfr = (rw->ar << 4) | fr;
+     
+      if ( verbose >= 3 ) {
+         ar = fr = *(p + 7);  
+         ar >>= 4;    /* shift upper bits to the lower nibble */
+         ar &= 0x0F;  /* blank out the upper nibble */
+         fr &= 0x0F;  /* ditto */
+         log_msg(3, "seqh", "%s: found MOD seqh offset 7 = 0x%02X, aspect ratio = 0x%02X (%s), frame rate = 0x%02X (%s)\n",
+               this, *(p + 7), ar, mpeg_seqh_ar_codes[ar], fr, mpeg_seqh_fr_codes[fr]);
+         log_msg(3, "seqh", "%s: using MPEG seqh offset 7 = 0x%02X\n", this, rw->arfr);
+      }
+   } /* ref seqh */
+
+   /* We've got a sequence header signature, check the rest of the
+    * header against our reference header. If it does not match, skip.
+    * See note above about this. With --in-place, offset 7 (what we set)
+    * only has to be a valid aspect ratio and frame rate: a file patched
+    * part way by an interrupted run has the new code in the headers before
+    * that point, and the reference may be one of them. */
+   if ( in_place ? memcmp(rw->reference_seqh, p, 7) != 0 || memcmp(rw->reference_seqh + 8, p + 8, 4) != 0
+            || (p[7] != rw->reference_seqh[7]
+               && ((p[7] >> 4) < 1 || (p[7] >> 4) > 4 || (p[7] & 0x0F) < 1 || (p[7] & 0x0F) > 8))
+         : memcmp(rw->reference_seqh, p, 12) != 0 ) {
+      LOG(3, "seqh", "%s: found sequence header signature followed by non standard data\n   [%s ] skipping...\n",
+            this, hex_str(hex, p, 12));
+      PROBE2(seqh__reject, blk, rw->seqh);
+      return 0;
+   }
+
+   /* set aspect ratio/frame rate */
+   LOG(4, "seqh", "%s: setting aspect ratio (sequence header %d)\n", this, rw->seqh);
+   p[7] = rw->arfr;
+   PROBE3(seqh__patch, blk, rw->seqh, rw->arfr);
+   return 1;
+}
+
+/*
+ * p points at an extension start code. Sequence display extensions get the
+ * coded size of the reference sequence header as their display size.
+ * Returns 1 if we patched it.
+ */
+static int rewrite_display(rewrite_type *rw, unsigned char *p, int blk) {
+   unsigned char *s = rw->reference_seqh, *d;
+   int width, height, dh, dv;
+   char hex[40];
+
+   if ( (p[4] >> 4) != 2 || s[3] == 0 )
+      return 0;   /* some other extension, or no sequence header yet */
+
+   d = p + 5 + (p[4] & 0x01 ? 3 : 0);    /* skip the colour description */
+   if ( !(d[1] & 0x02) ) {
+      LOG(3, "seqh", "%s: found display extension without its marker bit\n   [%s ] skipping...\n",
+            this, hex_str(hex, p, 12));
+      return 0;
+   }
+   dh = (d[0] << 6) | (d[1] >> 2);
+   dv = ((d[1] & 0x01) << 13) | (d[2] << 5) | (d[3] >> 3);
+   width = (s[4] << 4) | (s[5] >> 4);
+   height = ((s[5] & 0x0F) << 8) | s[6];
+   if ( dh == width && dv == height )
+      return 0;
+
+   if ( rw->ext++ == 0 )
+      LOG(3, "seqh", "%s: display extension says %dx%d, setting %dx%d\n", this, dh, dv, width, height);
+   LOG(4, "seqh", "%s: setting display size (blk:%d display extension %d)\n", this, blk, rw->ext);
+   d[0] = width >> 6;
+   d[1] = ((width & 0x3F) << 2) | 0x02 | (height >> 13);
+   d[2] = (height >> 5) & 0xFF;
+   d[3] = ((height & 0x1F) << 3) | (d[3] & 0x07);
+   return 1;
+}
+
+/*
+ * frame rate code for --frame-rate: 23.976, 24, 25, 29.97, 30, 50, 59.94
+ * or 60, 0 if it isn't one of those
+ */
+int parse_frame_rate(char *s) {
+   static const double rates[] = { 0, 24000.0 / 1001, 24, 25, 30000.0 / 1001, 30, 50, 60000.0 / 1001, 60 };
+   double r;
+   char *e;
+   int c;
+
+   r = strtod(s, &e);
+   if ( e == s || *e != '\0' )
+      return 0;
+   for (c = 1; c <= 8; c++) {
+      if ( r > rates[c] - 0.01 && r < rates[c] + 0.01 )
+         return c;
+   }
+   return 0;
+}
+
+/*****************************************************************************
+ * MPEG transport streams (.TOD)
+ *
+ * The sequence headers are in the payload of the video PID's packets, and a
+ * header can straddle two (or more) packets with other PIDs in between. We
+ * find the video PID from the PAT/PMT, skip every other packet by its
+ * header alone, and look for headers in the video payload as one
+ * continuous stream: ts->tail keeps pointers to the last few payload bytes
+ * a header could still be starting in, so it can be patched in place once
+ * the rest of it turns up.
+ ****************************************************************************/
+
+/*
+ * Work out if the file is a transport stream, and which kind: 188 byte
+ * packets, or 192 with a 4 byte timecode in front (M2TS style, which is
+ * what the cameras write). Returns 0 for anything else.
+ */
+int ts_detect(FILE *f, ts_type *ts) {
+   unsigned char b[TS_PROBE_PACKETS * 192];
+   int n, i, pkt, sync;
+
+   memset(ts, 0, sizeof(ts_type));
+   ts->pmt_pid = ts->video_pid = -1;
+   n = fread(b, 1, sizeof(b), f);
+   rewind(f);
+   if ( n < (int) sizeof(b) )
+      return 0;
+   for (pkt = 188; pkt <= 192; pkt += 4) {
+      sync = pkt - 188;
+      for (i = 0; i < TS_PROBE_PACKETS && b[i * pkt + sync] == 0x47; i++)
+         ;
+      if ( i == TS_PROBE_PACKETS ) {
+         ts->pkt = pkt;
+         ts->sync = sync;
+         return pkt;
+      }
+   }
+   return 0;
+}
+
+/*
+ * Scan the whole packets in [from, end) of buf. buf starts on a packet
+ * boundary and everything before from has been scanned already. Returns
+ * where the caller should stop writing: the packet the oldest byte in
+ * ts->tail is in, so a header that is still incomplete can be patched when
+ * the next block comes in, or else the first byte that isn't a whole packet.
+ */
+unsigned char *ts_scan(ts_type *ts, unsigned char *buf, unsigned char *from, unsigned char *end,
+      rewrite_type *rw, int blk) {
+   unsigned char *pk, *h, *pl;
+   int pid, afc;
+
+   for (pk = from; pk + ts->pkt <= end; pk += ts->pkt) {
+      h = pk + ts->sync;
+      if ( h[0] != 0x47 ) {
+         /* pass it through untouched; should the packets be off by a few
+          * bytes from here on, so are all the blocks we read */
+         if ( ts->lost_sync++ == 0 )
+            fprintf(stderr, "%s: WARNING: transport stream lost sync at packet %lld\n",
+                  this, (long long) ((pk - buf) / ts->pkt));
+         continue;
+      }
+      pid = ((h[1] & 0x1F) << 8) | h[2];
+      if ( pid != ts->video_pid && pid != 0 && pid != ts->pmt_pid )
+         continue;
+
+      afc = (h[3] >> 4) & 0x03;            /* adaptation field control */
+      if ( !(afc & 0x01) )
+         continue;                         /* no payload */
+      pl = h + 4;
+      if ( afc & 0x02 )
+         pl += 1 + h[4];                   /* skip the adaptation field */
+      if ( pl >= h + 188 )
+         continue;
+
+      if ( pid == ts->video_pid )
+         ts_video(ts, pl, h + 188, rw, blk);
+      else if ( h[1] & 0x40 )              /* a table starts in this packet */
+         ts_psi(ts, pid, pl, h + 188);
+   }
+
+   /* a header can't really be split over that much of everything else */
+   if ( ts->ntail && pk - ts->tail[0] > TS_MAX_HOLD )
+      ts->ntail = 0;
+
+   if ( ts->ntail )
+      return buf + (ts->tail[0] - buf) / ts->pkt * ts->pkt;
+   return pk;
+}
+
+/*
+ * the caller moved what ts_scan() held back down to the start of the
+ * buffer, by off bytes
+ */
+void ts_rebase(ts_type *ts, long off) {
+   int i;
+
+   for (i = 0; i < ts->ntail; i++)
+      ts->tail[i] -= off;
+}
+
+/*
+ * look for sequence headers in one packet's worth of video payload [pl, pe)
+ */
+static void ts_video(ts_type *ts, unsigned char *pl, unsigned char *pe, rewrite_type *rw, int blk) {
+   unsigned char *w[2 * TS_TAIL], *p, hdr[REWRITE_LEN];
+   int len = pe - pl, n, i, k, keep;
+
+   /* headers that started in an earlier packet */
+   if ( ts->ntail ) {
+      memcpy(w, ts->tail, ts->ntail * sizeof(*w));
+      for (n = ts->ntail, i = 0; i < TS_TAIL && i < len; i++)
+         w[n++] = pl + i;
+      for (i = 0; i < ts->ntail && i + REWRITE_LEN <= n; i++) {
+         if ( *w[i] == 0x00 && *w[i + 1] == 0x00 && *w[i + 2] == 0x01 && rw->on[*w[i + 3]] ) {
+            for (k = 0; k < REWRITE_LEN; k++)
+               hdr[k] = *w[i + k];
+            if ( rw->on[hdr[3]](rw, hdr, blk) ) {
+               for (k = 0; k < REWRITE_LEN; k++)
+                  *w[i + k] = hdr[k];
+            }
+         }
+      }
+   }
+
+   /* headers wholly inside this packet */
+   for (p = pl; (p = rewrite_find(rw, p, pe)) != NULL; p++)
+      rw->on[p[3]](rw, p, blk);
+
+   /* the last TS_TAIL bytes of the stream so far could still start one */
+   if ( len >= TS_TAIL ) {
+      for (i = 0; i < TS_TAIL; i++)
+         ts->tail[i] = pe - TS_TAIL + i;
+      ts->ntail = TS_TAIL;
+   }
+   else {
+      keep = ts->ntail < TS_TAIL - len ? ts->ntail : TS_TAIL - len;
+      memmove(ts->tail, ts->tail + ts->ntail - keep, keep * sizeof(*w));
+      for (i = 0; i < len; i++)
+         ts->tail[keep + i] = pl + i;
+      ts->ntail = keep + len;
+   }
+}
+
+/*
+ * pick the PMT PID out of the PAT, and the video and audio PIDs out of the
+ * PMT. Tables that don't fit in one packet are ignored; they are repeated
+ * often, and the cameras' are tiny. Audio PIDs are numbered as demux_feed()
+ * numbers program stream audio: MPEG audio from C0, AC-3 from 0x180.
+ */
+static void ts_psi(ts_type *ts, int pid, unsigned char *pl, unsigned char *pe) {
+   unsigned char *s, *se, *q;
+   int vpid, found = 0, nmpa = 0, nac3 = 0;
+
+   s = pl + 1 + pl[0];                     /* skip pointer_field */
+   if ( s + 12 > pe )
+      return;
+   se = s + 3 + (((s[1] & 0x0F) << 8) | s[2]) - 4;   /* up to the CRC */
+   if ( se > pe )
+      return;
+
+   if ( pid == 0 && s[0] == 0x00 ) {
+      for (q = s + 8; q + 4 <= se; q += 4) {
+         if ( ((q[0] << 8) | q[1]) != 0 ) {   /* program 0 is the network PID */
+            ts->pmt_pid = ((q[2] & 0x1F) << 8) | q[3];
+            break;
+         }
+      }
+   }
+   else if ( pid == ts->pmt_pid && s[0] == 0x02 ) {
+      ts->naudio = 0;
+      for (q = s + 12 + (((s[10] & 0x0F) << 8) | s[11]); q + 5 <= se; q += 5 + (((q[3] & 0x0F) << 8) | q[4])) {
+         if ( (q[0] == 0x03 || q[0] == 0x04 || q[0] == 0x81) && ts->naudio < TS_MAX_AUDIO ) {
+            ts->audio_pid[ts->naudio] = ((q[1] & 0x1F) << 8) | q[2];
+            ts->audio_stream[ts->naudio++] = q[0] == 0x81 ? 0x180 + nac3++ : 0xC0 + nmpa++;
+         }
+         if ( (q[0] != 0x01 && q[0] != 0x02) || found++ )   /* MPEG-1 or MPEG-2 video */
+            continue;
+         vpid = ((q[1] & 0x1F) << 8) | q[2];
+         if ( vpid != ts->video_pid ) {
+            LOG(3, "ts", "%s: video is on PID 0x%04X\n", this, vpid);
+            ts->video_pid = vpid;
+            ts->ntail = 0;
+         }
+      }
+   }
+}
+
+/*****************************************************************************
+ * write len bytes of buf to every output that is still going. An output
+ * that fails is dropped (see output_failed()) without affecting the others.
+ * Returns the number still going.
+ ****************************************************************************/
+int write_outputs(output_type *out, int nout, unsigned char *buf, size_t len) {
+   int d, alive = 0;
+
+   for (d = 0; d < nout; d++) {
+      if ( out[d].failed )
+         continue;
+      throttle_io(THROTTLE_WRITE, len);
+      if ( fwrite(buf, 1, len, out[d].fp) != len || ferror(out[d].fp) ) {
+         output_failed(&out[d], "write failed");
+         continue;
+      }
+      alive++;
+   }
+   return alive;
+}
+
+/*****************************************************************************
+ * Stop writing to one output. The partial mpeg and its checkpoint are left
+ * where they are, so the next run can pick it up again. If what is given,
+ * report it along with errno.
+ ****************************************************************************/
+void output_failed(output_type *out, char *what) {
+   if ( what ) {
+      fprintf(stderr, "%s: %s: %s: %s\n", this, what, out->fname, strerror(errno));
+      fprintf(stderr, "   giving up on this destination for now...\n");
+   }
+   if ( out->stream )
+      ;  /* not ours to close */
+   else if ( out->fp )
+      fclose(out->fp);
+   else
+      close(out->fd);
+   out->fp = NULL;
+   out->failed = 1;
+}
+
+/*****************************************************************************
+ * Set up a checkpoint for converting mod_fname from scratch
+ ****************************************************************************/
+void init_checkpoint(checkpoint_type *ckpt, char *mod_fname) {
+   struct stat st;
+
+   memset(ckpt, 0, sizeof(checkpoint_type));
+   memcpy(ckpt->magic, CHECKPOINT_MAGIC, 8);
+   if ( !realpath(mod_fname, ckpt->mod_fname) )
+      strcpy(ckpt->mod_fname, mod_fname);
+   if ( src_stat(mod_fname, &st) == 0 ) {
+      ckpt->mod_size = st.st_size;
+      ckpt->mod_mtime = st.st_mtime;
+   }
+}
+
+/*****************************************************************************
+ * checkpoint for dir/mov-X.mpeg is dir/.mov-X.mpeg.ckpt
+ ****************************************************************************/
+void checkpoint_fname(char *ckpt_fname, char *mpeg_fname) {
+   char *slash = strrchr(mpeg_fname, '/');
+
+   if ( slash )
+      sprintf(ckpt_fname, "%.*s/.%s.ckpt", (int) (slash - mpeg_fname), mpeg_fname, slash + 1);
+   else
+      sprintf(ckpt_fname, ".%s.ckpt", mpeg_fname);
+}
+
+/*****************************************************************************
+ * Save the checkpoint for mpeg_fname. Written to a temp file and renamed
+ * into place so there is always one complete checkpoint on disk. With sync,
+ * it and its name are on disk before we return.
+ ****************************************************************************/
+int write_checkpoint(checkpoint_type *ckpt, char *mpeg_fname, int sync) {
+   char ckpt_fname[MAX_PATH_LEN];
+   char tmp_fname[MAX_PATH_LEN];
+   char dir[MAX_PATH_LEN];
+   int fd, dfd = -1;
+
+   checkpoint_fname(ckpt_fname, mpeg_fname);
+   sprintf(tmp_fname, "%s.tmp", ckpt_fname);
+   if ( (fd = open(tmp_fname, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0
+         || write(fd, ckpt, sizeof(checkpoint_type)) != sizeof(checkpoint_type)
+         || (sync && fdatasync(fd) < 0)
+         || close(fd) < 0
+         || rename(tmp_fname, ckpt_fname) < 0
+         || (sync && ((dfd = open(dirname(strcpy(dir, ckpt_fname)), O_RDONLY | O_DIRECTORY)) < 0 || fsync(dfd) < 0)) ) {
+      fprintf(stderr, "%s: unable to write checkpoint %s\n", this, ckpt_fname);
+      perror(ckpt_fname);
+      if ( dfd >= 0 )
+         close(dfd);
+      return 0;
+   }
+   if ( dfd >= 0 )
+      close(dfd);
+   LOG(4, "checkpoint", "%s: checkpoint %s committed=%lld\n", this, ckpt_fname, ckpt->committed);
+   return 1;
+}
+
+/*****************************************************************************
+ * Look for an interrupted conversion of mod_fname among base.mpeg,
+ * base_01.mpeg... in dir. The name index tells us which of those have a
+ * checkpoint, so we only open the ones that do. If one was converting the
+ * same MOD file (same path, size and mtime), load it into ckpt, set
+ * dest_fname and return true.
+ ****************************************************************************/
+int find_checkpoint(checkpoint_type *ckpt, char *mod_fname, char *dir, char *base, char *dest_fname) {
+   name_index_type *idx;
+   checkpoint_type want;
+   char name[MAX_PATH_LEN];
+   char ckpt_name[MAX_PATH_LEN];
+   int fd, funiq, found;
+
+   idx = get_name_index(dir);
+   init_checkpoint(&want, mod_fname);
+   for (funiq = 0; ; funiq++) {
+      if ( funiq == 0 )
+         sprintf(name, "%s.mpeg", base);
+      else
+         sprintf(name, "%s_%02d.mpeg", base, funiq);
+      if ( !name_index_has(idx, name) )
+         return 0;
+      sprintf(ckpt_name, ".%s.ckpt", name);
+      if ( !name_index_has(idx, ckpt_name) )
+         continue;
+
+      sprintf(ckpt_name, "%s/.%s.ckpt", dir, name);
+      if ( (fd = open(ckpt_name, O_RDONLY)) < 0 )
+         continue;
+      found = read(fd, ckpt, sizeof(checkpoint_type)) == sizeof(checkpoint_type)
+         && memcmp(ckpt->magic, CHECKPOINT_MAGIC, 8) == 0
+         && strcmp(ckpt->mod_fname, want.mod_fname) == 0
+         && ckpt->mod_size == want.mod_size
+         && ckpt->mod_mtime == want.mod_mtime
+         && ckpt->committed >= 0 && ckpt->committed <= ckpt->mod_size
+         && ckpt->tail_len >= 0 && ckpt->tail_len <= RW_BLOCK_SIZE && ckpt->tail_len <= ckpt->committed;
+      close(fd);
+      if ( found ) {
+         sprintf(dest_fname, "%s/%s", dir, name);
+         return 1;
+      }
+   }
+}
+
+/*****************************************************************************
+ * FNV-1a over a block of data, used to check a checkpoint against the file
+ ****************************************************************************/
+static unsigned long long block_hash(unsigned char *p, size_t len) {
+   return hash_more(HASH_SEED, p, len);
+}
+
+/* ... and carried on over more data */
+static unsigned long long hash_more(unsigned long long h, unsigned char *p, size_t len) {
+   while ( len-- ) {
+      h ^= *p++;
+      h *= 1099511628211ULL;
+   }
+   return h;
+}
+
+/*****************************************************************************
+ * " 00 00 01 B3 ..." for n bytes at p, so a header dump is a single message
+ ****************************************************************************/
+static char *hex_str(char *str, unsigned char *p, int n) {
+   int i;
+
+   for (i=0; i<n; i++)
+      sprintf(str + 3 * i, " %02X", p[i]);
+   str[3 * n] = '\0';
+   return str;
+}
+
+/*****************************************************************************
+ * Return true if fname is one of the file types we are looking for
+ * suffixes is an array of file suffixes to look for.
+ * last entry must be null
+ * case of suffix strings is unimportant (.txt or .TXT will both match)
+ * for example, call with
+ *   char mytypes[] = { ".txt", ".dat", NULL };
+ *   is_file_type(fname, mytypes);
+ ****************************************************************************/
+int is_file_type(char *fname, char **suffixes) {
+   char **p;
+   int nlen, slen;
+
+   nlen = strlen(fname);
+   for (p = suffixes; *p; p++) {
+      slen = strlen(*p);
+      if ( nlen >= slen && strncasecmp(fname + nlen - slen, *p, slen) == 0 )
+         return 1;
+   }
+   return 0;
+}
+
+/*****************************************************************************
+ * remove newline and/or carriage return from end of a string 
+ * return length of new modified string 
+ ****************************************************************************/
+static int chomp(char *s) {
+   char *p;
+
+   p = s + strlen(s) - 1; 
+
+   while (p >= s && (*p == '\n' || *p == '\r'))
+      *(p--) = 0;
+
+   return (p - s + 1);
+}
+
+/*****************************************************************************
+ * Return true if file NAME is a directory.
+ ****************************************************************************/
+static int isdir(char *fname) {
+   struct stat st;
+ 
+   if (stat(fname, &st)) {
+      perror(fname);
+      return 0;
+   }
+   return(S_ISDIR(st.st_mode));
+}
+
+/*****************************************************************************
+ * Given the MOD fname, if an MOI file with the same dir/name exists, set
+ * moi_fname and return true, else false.
+ ****************************************************************************/
+int locate_moi(char *moi_fname, char *mod_fname) {
+   FILE *moi;
+   size_t len;
+
+   /* srip .MOD, and replace with .MOI. An mpeg of ours has copy_moi()'s
+    * .moi next to it. */
+   if ( is_file_type(mod_fname, mpeg_suffix) ) {
+      len = strlen(mod_fname) - 5;
+      memcpy(moi_fname, mod_fname, len);
+      memcpy(moi_fname + len, ".moi\0", 5);
+   }
+   else {
+      len = strlen(mod_fname) - 4;
+      memcpy(moi_fname, mod_fname, len);
+      memcpy(moi_fname + len, ".MOI\0", 5);
+   }
+
+   //printf("   Looking for %s...", moi_fname);
+   if (moi = src_fopen(moi_fname)) {
+      fclose(moi);
+      return 1;
+   }
+
+   moi_fname[0] = '\0';
+   return 0;
+}
+
+/*****************************************************************************
+ * Return true if NAME should not be recursed into
+ ****************************************************************************/
+int ignore_ent(char *fname) {
+   static char *ignored_entries[] = { ".", "..", NULL };
+   char **p;
+
+   for (p = ignored_entries; *p; p++) {
+      if (strcmp (fname, *p) == 0)
+         return 1;
+   }
+   return 0;
+}
+
+/*************************************************************************
+ * return true if the file exists
+ ************************************************************************/
+int file_exists(char *fname) {
+   FILE *f = NULL;
+
+   if (f = fopen(fname, "r")) {
+      fclose(f);
+      return 1;
+   }
+   return 0;
+}
+
+/*****************************************************************************
+ * Create an empty name index for dir. Not added to the name_indexes list.
+ ****************************************************************************/
+name_index_type *new_name_index(char *dir) {
+   name_index_type *idx;
+
+   idx = (name_index_type *) mymalloc(sizeof(name_index_type));
+   idx->dir = strdup(dir);
+   idx->size = NAME_INDEX_INIT_SIZE;
+   idx->count = 0;
+   idx->slots = (char **) calloc(idx->size, sizeof(char *));
+   if ( !idx->slots ) {
+      fprintf(stderr, "cannot allocate memory");
+      exit(1);
+   }
+   idx->next = NULL;
+   return idx;
+}
+
+/*****************************************************************************
+ * Return the name index for directory dir, loading it with a single listing
+ * of the directory the first time it is asked for. A directory that does
+ * not exist yet simply has an empty index.
+ ****************************************************************************/
+name_index_type *get_name_index(char *dir) {
+   name_index_type *idx;
+   DIR *d;
+   struct dirent *ent;
+
+   for (idx = name_indexes; idx; idx = idx->next) {
+      if ( strcmp(idx->dir, dir) == 0 )
+         return idx;
+   }
+
+   idx = new_name_index(dir);
+   idx->next = name_indexes;
+   name_indexes = idx;
+
+   if ( (d = opendir(dir)) ) {
+      while ( (ent = readdir(d)) ) {
+         if ( !ignore_ent(ent->d_name) )
+            name_index_add(idx, ent->d_name);
+      }
+      closedir(d);
+   }
+
+   LOG(3, "index", "%s: indexed %lu names in %s\n", this, (unsigned long) idx->count, dir);
+
+   return idx;
+}
+
+/*****************************************************************************
+ * FNV-1a string hash, used by the name index
+ ****************************************************************************/
+static size_t name_hash(char *name) {
+   size_t h = 2166136261u;
+
+   while ( *name ) {
+      h ^= (unsigned char) *name++;
+      h *= 16777619u;
+   }
+   return h;
+}
+
+/*****************************************************************************
+ * Return true if name is in the index
+ ****************************************************************************/
+int name_index_has(name_index_type *idx, char *name) {
+   size_t i;
+
+   for (i = name_hash(name) & (idx->size - 1); idx->slots[i]; i = (i + 1) & (idx->size - 1)) {
+      if ( strcmp(idx->slots[i], name) == 0 )
+         return 1;
+   }
+   return 0;
+}
+
+/*****************************************************************************
+ * Add name to the index, growing the table when it gets half full
+ ****************************************************************************/
+void name_index_add(name_index_type *idx, char *name) {
+   char **old;
+   size_t oldsize, i, j;
+
+   if ( name_index_has(idx, name) )
+      return;
+
+   if ( (idx->count + 1) * 2 > idx->size ) {
+      old = idx->slots;
+      oldsize = idx->size;
+      idx->size *= 2;
+      idx->slots = (char **) calloc(idx->size, sizeof(char *));
+      if ( !idx->slots ) {
+         fprintf(stderr, "cannot allocate memory");
+         exit(1);
+      }
+      for (i = 0; i < oldsize; i++) {
+         if ( !old[i] )
+            continue;
+         for (j = name_hash(old[i]) & (idx->size - 1); idx->slots[j]; j = (j + 1) & (idx->size - 1))
+            ;
+         idx->slots[j] = old[i];
+      }
+      free(old);
+   }
+
+   for (i = name_hash(name) & (idx->size - 1); idx->slots[i]; i = (i + 1) & (idx->size - 1))
+      ;
+   idx->slots[i] = strdup(name);
+   idx->count++;
+}
+
+/*****************************************************************************
+ * Set name to the first of base.mpeg, base_01.mpeg, base_02.mpeg... that is
+ * not in the index, and add it so it won't be handed out again.
+ ****************************************************************************/
+void next_dest_name(name_index_type *idx, char *base, char *name) {
+   int funiq = 0;
+
+   while ( 1 ) {
+      if ( funiq == 0 )
+         sprintf(name, "%s.mpeg", base);
+      else
+         sprintf(name, "%s_%02d.mpeg", base, funiq);
+      funiq++;
+
+      if ( !name_index_has(idx, name) ) {
+         name_index_add(idx, name);
+         return;
+      }
+   }
+}
+
+/*****************************************************************************
+ * Find the first unused name base.mpeg, base_01.mpeg, base_02.mpeg... in
+ * dir and create it. The name index answers most of the question without
+ * touching the file system, and O_EXCL is the final guard against anyone
+ * else (another moi, for instance) creating the same file under us.
+ *
+ * Sets dest_fname to the full path and returns the open file descriptor,
+ * or -1 on error.
+ ****************************************************************************/
+int claim_dest_name(char *dir, char *base, char *dest_fname) {
+   name_index_type *idx;
+   char name[MAX_PATH_LEN];
+   int fd;
+
+   idx = get_name_index(dir);
+   while ( 1 ) {
+      next_dest_name(idx, base, name);
+      sprintf(dest_fname, "%s/%s", dir, name);
+      if ( (fd = open(dest_fname, O_WRONLY | O_CREAT | O_EXCL, 0666)) >= 0 )
+         return fd;
+      if ( errno != EEXIST ) {
+         perror(dest_fname);
+         return -1;
+      }
+      LOG(3, "index", "%s: %s appeared since %s was indexed\n", this, name, dir);
+   }
+}
+
+/*****************************************************************************
+ * Catalog
+ *
+ * Every mpeg we make gets a record in the catalog (by default .moi-catalog
+ * in the first -d dir): recording time and aspect ratio from the MOI,
+ * sizes, and where the MOD, MOI and mpeg are. The file is a header, the
+ * records sorted by recording time, then the names they point into, so
+ * --query can mmap it and binary search without reading any MOI files.
+ *
+ * Each conversion appends its record to a journal next to it (.tail), a
+ * write of its own under a shared lock on the directory, as -j workers
+ * finish jobs at the same time. catalog_merge() sorts the journal into the
+ * catalog once, at the end of the run; it rewrites the file (to a temp
+ * file, then rename, so a query never sees half of one) with the lock held
+ * exclusively. --query does the same if it can write there and the lock
+ * is free, and otherwise sorts the journal in for itself, in memory.
+ ****************************************************************************/
+void catalog_add(job_type *job, char *mpeg_fname) {
+   moi_info_type *info = job->info;
+   catalog_rec_type rec;
+   char dir[MAX_PATH_LEN], tail_fname[MAX_PATH_LEN];
+   char mod_real[MAX_PATH_LEN], moi_real[MAX_PATH_LEN];
+   char *buf, *p;
+   size_t len;
+   int dfd, fd, ok;
+
+   if ( !realpath(job->mod_fname, mod_real) )
+      strcpy(mod_real, job->mod_fname);
+   if ( !realpath(job->moi_fname, moi_real) )
+      strcpy(moi_real, job->moi_fname);
+   memset(&rec, 0, sizeof(rec));
+   rec.when = catalog_when(info);
+   rec.mtime = info->mtime;
+   rec.mod_size = job->mod_size;
+   rec.moi_size = job->moi_size;
+   rec.aspect_ratio = info->aspect_ratio;
+
+   /* in the journal the names follow the record, which has their lengths */
+   rec.mod_name = strlen(mod_real) + 1;
+   rec.moi_name = strlen(moi_real) + 1;
+   rec.mpeg_name = strlen(mpeg_fname) + 1;
+   len = sizeof(rec) + rec.mod_name + rec.moi_name + rec.mpeg_name;
+   p = buf = (char *) mymalloc(len);
+   memcpy(p, &rec, sizeof(rec));
+   memcpy(p += sizeof(rec), mod_real, rec.mod_name);
+   memcpy(p += rec.mod_name, moi_real, rec.moi_name);
+   memcpy(p += rec.moi_name, mpeg_fname, rec.mpeg_name);
+
+   /* appends go side by side, a merge waits for them */
+   strcpy(dir, catalog_fname);
+   if ( (dfd = open(dirname(dir), O_RDONLY | O_DIRECTORY)) < 0 || flock(dfd, LOCK_SH) < 0 ) {
+      fprintf(stderr, "%s: WARNING: unable to lock catalog %s, not updated\n", this, catalog_fname);
+      perror(dir);
+      if ( dfd >= 0 )
+         close(dfd);
+      free(buf);
+      return;
+   }
+   sprintf(tail_fname, "%s.tail", catalog_fname);
+   ok = (fd = open(tail_fname, O_WRONLY | O_CREAT | O_APPEND, 0666)) >= 0
+      && write(fd, buf, len) == (ssize_t) len;
+   if ( fd >= 0 && close(fd) < 0 )
+      ok = 0;
+   if ( !ok ) {
+      fprintf(stderr, "%s: WARNING: unable to update catalog %s\n", this, catalog_fname);
+      perror(tail_fname);
+   }
+   else
+      LOG(3, "catalog", "%s: %s added to %s\n", this, mpeg_fname, tail_fname);
+
+   free(buf);
+   close(dfd);   /* and the lock with it */
+}
+
+/* a journal record, with its names where we read them */
+typedef struct catalog_tail {
+   catalog_rec_type rec;           /* names are offsets into tab */
+   char             *tab;
+   unsigned int     seq;           /* place in the journal, the last one wins */
+} catalog_tail_type;
+
+static int catalog_tail_mpeg(const void *a, const void *b) {
+   const catalog_tail_type *ta = a, *tb = b;
+
+   return strcmp(ta->tab + ta->rec.mpeg_name, tb->tab + tb->rec.mpeg_name);
+}
+
+static int catalog_tail_seq(const void *a, const void *b) {
+   const catalog_tail_type *ta = a, *tb = b;
+   int c = catalog_tail_mpeg(a, b);
+
+   return c ? c : (ta->seq < tb->seq ? -1 : 1);
+}
+
+static int catalog_tail_when(const void *a, const void *b) {
+   const catalog_tail_type *ta = a, *tb = b;
+
+   return catalog_cmp(ta->rec.when, ta->tab + ta->rec.mpeg_name, tb->rec.when, tb->tab + tb->rec.mpeg_name);
+}
+
+/*
+ * the catalog with the journal sorted in, as a malloc()ed image laid out
+ * like the file: the old records and the new in order, where a new record
+ * for an mpeg we made before (--clobber) replaces the old one, and of
+ * several for one mpeg in the journal the last wins. NULL if the journal
+ * is empty (or there is none). The caller holds the lock on the catalog
+ * dir.
+ */
+static catalog_hdr_type *catalog_fold(char *tail_fname, size_t *image_len, unsigned int *added) {
+   catalog_hdr_type *h = NULL, *nh;
+   catalog_rec_type *old = NULL, *recs, rec;
+   catalog_tail_type *tail, key;
+   char *ostr = NULL, *strtab = NULL, *jbuf, *dropped;
+   struct stat st;
+   size_t len = 0, strtab_len = 0, strtab_size = 0, off, names;
+   unsigned int i, j, n = 0, ntail = 0, count = 0;
+   int tfd;
+
+   if ( (tfd = open(tail_fname, O_RDONLY)) < 0 || fstat(tfd, &st) < 0 || st.st_size == 0 ) {
+      if ( tfd >= 0 )
+         close(tfd);
+      return NULL;   /* nothing new */
+   }
+   jbuf = (char *) mymalloc(st.st_size);
+   if ( pread(tfd, jbuf, st.st_size, 0) != st.st_size ) {
+      fprintf(stderr, "%s: WARNING: unable to read %s, catalog not updated\n", this, tail_fname);
+      free(jbuf);
+      close(tfd);
+      return NULL;
+   }
+   close(tfd);
+
+   /* each record is followed by its names, the record has their lengths */
+   tail = (catalog_tail_type *) mymalloc((st.st_size / sizeof(catalog_rec_type) + 1) * sizeof(catalog_tail_type));
+   for (off = 0; off + sizeof(catalog_rec_type) <= (size_t) st.st_size; off += sizeof(catalog_rec_type) + names) {
+      memcpy(&rec, jbuf + off, sizeof(catalog_rec_type));
+      names = (size_t) rec.mod_name + rec.moi_name + rec.mpeg_name;
+      if ( rec.mod_name == 0 || rec.moi_name == 0 || rec.mpeg_name == 0
+            || names > st.st_size - off - sizeof(catalog_rec_type) )
+         break;
+      tail[ntail].rec = rec;
+      tail[ntail].rec.mod_name = off + sizeof(catalog_rec_type);
+      tail[ntail].rec.moi_name = tail[ntail].rec.mod_name + rec.mod_name;
+      tail[ntail].rec.mpeg_name = tail[ntail].rec.moi_name + rec.moi_name;
+      if ( jbuf[tail[ntail].rec.moi_name - 1] || jbuf[tail[ntail].rec.mpeg_name - 1]
+            || jbuf[tail[ntail].rec.mpeg_name + rec.mpeg_name - 1] )
+         break;
+      tail[ntail].tab = jbuf;
+      tail[ntail].seq = ntail;
+      ntail++;
+   }
+   if ( off != (size_t) st.st_size )
+      fprintf(stderr, "%s: WARNING: %s ends in a broken record, ignoring it\n", this, tail_fname);
+
+   /* the last record for each mpeg */
+   qsort(tail, ntail, sizeof(catalog_tail_type), catalog_tail_seq);
+   for (i = 0, j = 0; i < ntail; i++) {
+      if ( i + 1 < ntail && catalog_tail_mpeg(&tail[i], &tail[i + 1]) == 0 )
+         continue;
+      tail[j++] = tail[i];
+   }
+   ntail = j;
+
+   /* and the old ones they replace */
+   if ( (h = catalog_map(catalog_fname, &len)) != NULL ) {
+      n = h->count;
+      old = (catalog_rec_type *) (h + 1);
+      ostr = (char *) (old + n);
+   }
+   dropped = (char *) mymalloc(n + 1);
+   key.tab = ostr;
+   for (i = 0; i < n; i++) {
+      key.rec.mpeg_name = old[i].mpeg_name;
+      dropped[i] = bsearch(&key, tail, ntail, sizeof(catalog_tail_type), catalog_tail_mpeg) != NULL;
+   }
+
+   /* both in catalog order, merge them */
+   qsort(tail, ntail, sizeof(catalog_tail_type), catalog_tail_when);
+   recs = (catalog_rec_type *) mymalloc((n + ntail) * sizeof(catalog_rec_type));
+   for (i = 0, j = 0; i < n || j < ntail; ) {
+      if ( i < n && dropped[i] ) {
+         i++;
+         continue;
+      }
+      if ( j == ntail || (i < n && catalog_cmp(old[i].when, ostr + old[i].mpeg_name,
+            tail[j].rec.when, jbuf + tail[j].rec.mpeg_name) <= 0) ) {
+         recs[count] = old[i++];
+         key.tab = ostr;
+      }
+      else {
+         recs[count] = tail[j++].rec;
+         key.tab = jbuf;
+      }
+      recs[count].mod_name = catalog_str(&strtab, &strtab_len, &strtab_size, key.tab + recs[count].mod_name);
+      recs[count].moi_name = catalog_str(&strtab, &strtab_len, &strtab_size, key.tab + recs[count].moi_name);
+      recs[count].mpeg_name = catalog_str(&strtab, &strtab_len, &strtab_size, key.tab + recs[count].mpeg_name);
+      count++;
+   }
+   if ( h )
+      munmap(h, len);
+
+   *image_len = sizeof(catalog_hdr_type) + count * sizeof(catalog_rec_type) + strtab_len;
+   nh = (catalog_hdr_type *) mymalloc(*image_len);
+   memcpy(nh->magic, CATALOG_MAGIC, 8);
+   nh->count = count;
+   nh->strtab_len = strtab_len;
+   memcpy(nh + 1, recs, count * sizeof(catalog_rec_type));
+   memcpy((char *) (nh + 1) + count * sizeof(catalog_rec_type), strtab, strtab_len);
+   *added = ntail;
+
+   free(recs);
+   free(strtab);
+   free(dropped);
+   free(tail);
+   free(jbuf);
+   return nh;
+}
+
+/*
+ * sort the journal into the catalog file. The journal is removed once the
+ * new catalog is in place; if we die in between, the next merge does it
+ * again, to the same effect. Without wait, we give up rather than wait for
+ * the lock. Returns 0 if we couldn't, having said why unless it was only
+ * the lock.
+ */
+int catalog_merge(int wait) {
+   catalog_hdr_type *h;
+   char dir[MAX_PATH_LEN], tmp_fname[MAX_PATH_LEN], tail_fname[MAX_PATH_LEN];
+   size_t len;
+   unsigned int added;
+   int dfd, fd, ok;
+
+   /* no appends while we do this */
+   strcpy(dir, catalog_fname);
+   if ( (dfd = open(dirname(dir), O_RDONLY | O_DIRECTORY)) < 0 || flock(dfd, wait ? LOCK_EX : LOCK_EX | LOCK_NB) < 0 ) {
+      if ( wait || errno != EWOULDBLOCK ) {
+         fprintf(stderr, "%s: WARNING: unable to lock catalog %s, not updated\n", this, catalog_fname);
+         perror(dir);
+      }
+      if ( dfd >= 0 )
+         close(dfd);
+      return 0;
+   }
+
+   sprintf(tail_fname, "%s.tail", catalog_fname);
+   if ( (h = catalog_fold(tail_fname, &len, &added)) == NULL ) {
+      close(dfd);
+      return 1;
+   }
+   sprintf(tmp_fname, "%s.tmp", catalog_fname);
+   ok = (fd = open(tmp_fname, O_WRONLY | O_CREAT | O_TRUNC, 0666)) >= 0
+      && write(fd, h, len) == (ssize_t) len;
+   if ( fd >= 0 && close(fd) < 0 )
+      ok = 0;
+   if ( !ok || rename(tmp_fname, catalog_fname) < 0 ) {
+      fprintf(stderr, "%s: WARNING: unable to update catalog %s\n", this, catalog_fname);
+      perror(tmp_fname);
+      unlink(tmp_fname);
+      ok = 0;
+   }
+   else {
+      if ( unlink(tail_fname) < 0 )
+         perror(tail_fname);   /* harmless, the next merge does it again */
+      LOG(3, "catalog", "%s: %u added to %s (%u entries)\n", this, added, catalog_fname, h->count);
+   }
+
+   free(h);
+   close(dfd);   /* and the lock with it */
+   return ok;
+}
+
+/*
+ * map the catalog read only. NULL if there isn't one, or it isn't
+ * one we can use (in which case we say so, and a conversion will start a
+ * new one).
+ */
+catalog_hdr_type *catalog_map(char *fname, size_t *len) {
+   catalog_hdr_type *h;
+   struct stat st;
+   int fd;
+
+   if ( (fd = open(fname, O_RDONLY)) < 0 )
+      return NULL;
+   if ( fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(catalog_hdr_type)
+         || (h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED ) {
+      close(fd);
+      fprintf(stderr, "%s: WARNING: %s is not a catalog, ignoring it\n", this, fname);
+      return NULL;
+   }
+   close(fd);
+   if ( memcmp(h->magic, CATALOG_MAGIC, 8) != 0
+         || sizeof(catalog_hdr_type) + (off_t) h->count * sizeof(catalog_rec_type) + h->strtab_len != (size_t) st.st_size ) {
+      munmap(h, st.st_size);
+      fprintf(stderr, "%s: WARNING: %s is not a catalog, ignoring it\n", this, fname);
+      return NULL;
+   }
+   *len = st.st_size;
+   return h;
+}
+
+/* records go in order of recording time, then mpeg name */
+static int catalog_cmp(long long when_a, char *mpeg_a, long long when_b, char *mpeg_b) {
+   if ( when_a != when_b )
+      return when_a < when_b ? -1 : 1;
+   return strcmp(mpeg_a, mpeg_b);
+}
+
+/* add s to the string table, return its offset */
+static unsigned int catalog_str(char **tab, size_t *len, size_t *size, char *s) {
+   size_t n = strlen(s) + 1, off = *len;
+
+   if ( *len + n > *size ) {
+      *size = (*len + n) * 2;
+      if ( (*tab = (char *) realloc(*tab, *size)) == NULL ) {
+         fprintf(stderr, "cannot allocate memory");
+         exit(1);
+      }
+   }
+   memcpy(*tab + off, s, n);
+   *len += n;
+   return off;
+}
+
+/* recording time as a sortable number, YYYYMMDDHHMM */
+static long long catalog_when(moi_info_type *info) {
+   return info->moi_year * 100000000LL + info->moi_mon * 1000000LL + info->moi_day * 10000LL
+      + info->moi_hour * 100LL + info->moi_min;
+}
+
+/*
+ * --from/--to dates: 2012, 2012-06, 20120615, 2012-06-15 10:30 ... Only the
+ * digits count; what's left out is filled with 0s for --from and 9s for
+ * --to, so --from=2012-06 --to=2012-06 is all of June.
+ */
+static long long catalog_date(char *s, char fill) {
+   char digits[13];
+   int n = 0;
+
+   for ( ; *s; s++) {
+      if ( *s < '0' || *s > '9' )
+         continue;
+      if ( n == 12 )
+         return -1;
+      digits[n++] = *s;
+   }
+   if ( n < 4 )
+      return -1;
+   while ( n < 12 )
+      digits[n++] = fill;
+   digits[n] = '\0';
+   return atoll(digits);
+}
+
+/*
+ * --query: print every catalog entry recorded between --from and --to
+ * (inclusive) with the --aspect ratio, one per line:
+ *    YYYYMMDD-HHMM  aspect  mpeg  bytes  MOD
+ */
+void catalog_query() {
+   catalog_hdr_type *h = NULL;
+   catalog_rec_type *recs;
+   char dir[MAX_PATH_LEN], tail_fname[MAX_PATH_LEN];
+   char *str, *ar;
+   size_t len;
+   long long from = 0, to = 999999999999LL;
+   unsigned int lo, hi, mid, i, found = 0, added;
+   int dfd, folded = 0;
+
+   if ( (query_from && (from = catalog_date(query_from, '0')) < 0)
+         || (query_to && (to = catalog_date(query_to, '9')) < 0) ) {
+      fprintf(stderr, "%s: Error: dates look like 2012, 2012-06 or 2012-06-15 10:30\n", this);
+      exit(1);
+   }
+
+   /* sort in what the journal has, if we may and nobody else is at it;
+    * if not, just for ourselves, leaving the files alone */
+   strcpy(dir, catalog_fname);
+   dirname(dir);
+   if ( access(dir, W_OK) < 0 || !catalog_merge(0) ) {
+      sprintf(tail_fname, "%s.tail", catalog_fname);
+      if ( (dfd = open(dir, O_RDONLY | O_DIRECTORY)) >= 0 && flock(dfd, LOCK_SH) == 0 )
+         folded = (h = catalog_fold(tail_fname, &len, &added)) != NULL;
+      if ( dfd >= 0 )
+         close(dfd);
+   }
+   if ( !h && (h = catalog_map(catalog_fname, &len)) == NULL ) {
+      fprintf(stderr, "%s: no catalog in %s\n", this, catalog_fname);
+      exit(1);
+   }
+   recs = (catalog_rec_type *) (h + 1);
+   str = (char *) (recs + h->count);
+
+   /* first record at or after from */
+   for (lo = 0, hi = h->count; lo < hi; ) {
+      mid = lo + (hi - lo) / 2;
+      if ( recs[mid].when < from )
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   for (i = lo; i < h->count && recs[i].when <= to; i++) {
+      ar = aspect_ratio_name(recs[i].aspect_ratio);
+      if ( query_aspect && (ar == NULL || strcmp(ar, query_aspect) != 0) )
+         continue;
+      printf("%08lld-%04lld\t%s\t%s\t%lld\t%s\n", recs[i].when / 10000, recs[i].when % 10000,
+            ar ? ar : "?", str + recs[i].mpeg_name, recs[i].mod_size, str + recs[i].mod_name);
+      found++;
+   }
+   fflush(stdout);   /* before the log writer's line */
+   LOG(1, "query", "%s: %u of %u catalog entries\n", this, found, h->count);
+   if ( folded )
+      free(h);
+   else
+      munmap(h, len);
+}
+
+/*****************************************************************************
+ * Card images
+ *
+ * With --image, the MOD/MOI pairs are read straight out of a dd image of
+ * the card (FAT32 or exFAT, bare or as the first partition), with no need
+ * to loop mount it. image_open() reads the FAT and walks every directory
+ * once, noting where each file's clusters are in the image as a list of
+ * extents. The files then go by names like card.img::/SD_VIDEO/PRG001/
+ * MOV001.MOD, which src_fopen() and src_stat() understand, so everything
+ * from process_file() on works the same as for files on a mounted card.
+ * plan_jobs() orders the MODs by where they start in the image, and each
+ * one is read extent by extent with pread(), so a card image on a hard disk
+ * is read close to front to back.
+ *
+ * FAT32 boot sector                   exFAT boot sector
+ *   11  bytes per sector (2)            3   "EXFAT   "
+ *   13  sectors per cluster             80  FAT offset, sectors (4)
+ *   14  reserved sectors (2)            88  cluster heap offset, sectors (4)
+ *   16  number of FATs                  92  cluster count (4)
+ *   36  sectors per FAT (4)             96  root directory cluster (4)
+ *   44  root directory cluster (4)      108 log2 bytes per sector
+ *   82  "FAT32   "                      109 log2 sectors per cluster
+ *
+ * reference: Microsoft FAT32 File System Specification (fatgen103), and the
+ * exFAT File System Specification
+ ****************************************************************************/
+
+static unsigned int le16(unsigned char *p) {
+   return p[0] | (p[1] << 8);
+}
+
+static unsigned int le32(unsigned char *p) {
+   return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
+/*
+ * open the image, read its FAT and every directory. Returns 0, having
+ * said why, if it isn't a FAT32 or exFAT image.
+ */
+int image_open(char *fname) {
+   unsigned char bs[512], *p;
+   struct stat st;
+   long long fat_off, fat_len;
+   unsigned int root, i;
+   int fd, part;
+
+   if ( (fd = open(fname, O_RDONLY)) < 0 || fstat(fd, &st) < 0 ) {
+      perror(fname);
+      return 0;
+   }
+   image = (image_type *) mymalloc(sizeof(image_type));
+   memset(image, 0, sizeof(image_type));
+   image->fname = fname;
+   image->fd = fd;
+   image->dev = st.st_dev;
+
+   /* a whole card has a partition table; use the first partition */
+   for (part = 0; ; part++) {
+      if ( pread(fd, bs, 512, image->base) != 512 ) {
+         fprintf(stderr, "%s: %s is too short to be a card image\n", this, fname);
+         return 0;
+      }
+      if ( memcmp(bs + 3, "EXFAT   ", 8) == 0 || memcmp(bs + 82, "FAT32   ", 8) == 0 )
+         break;
+      if ( part > 0 || bs[510] != 0x55 || bs[511] != 0xAA || bs[446 + 4] == 0 || le32(bs + 446 + 8) == 0 ) {
+         fprintf(stderr, "%s: %s is not a FAT32 or exFAT image\n", this, fname);
+         return 0;
+      }
+      image->base = (long long) le32(bs + 446 + 8) * 512;
+   }
+
+   if ( (image->exfat = bs[3] == 'E') ) {
+      image->cluster_size = 1LL << (bs[108] + bs[109]);
+      fat_off = (long long) le32(bs + 80) << bs[108];
+      image->heap = image->base + ((long long) le32(bs + 88) << bs[108]);
+      image->nclusters = le32(bs + 92) + 2;
+      root = le32(bs + 96);
+   }
+   else {
+      image->cluster_size = (long long) le16(bs + 11) * bs[13];
+      fat_off = (long long) le16(bs + 14) * le16(bs + 11);
+      image->heap = image->base + fat_off + (long long) bs[16] * le32(bs + 36) * le16(bs + 11);
+      image->nclusters = le32(bs + 36) * le16(bs + 11) / 4;
+      if ( image->cluster_size > 0 && le32(bs + 32) > 0 ) {
+         i = (image->base + (long long) le32(bs + 32) * le16(bs + 11) - image->heap) / image->cluster_size + 2;
+         if ( i < image->nclusters )
+            image->nclusters = i;
+      }
+      root = le32(bs + 44);
+   }
+   if ( image->cluster_size == 0 || image->nclusters < 3 ) {
+      fprintf(stderr, "%s: %s has a damaged boot sector\n", this, fname);
+      return 0;
+   }
+
+   /* the whole FAT, it is only a few MB even for a big card */
+   fat_len = (long long) image->nclusters * 4;
+   p = (unsigned char *) mymalloc(fat_len);
+   if ( pread(fd, p, fat_len, image->base + fat_off) != fat_len ) {
+      fprintf(stderr, "%s: unable to read the FAT in %s\n", this, fname);
+      return 0;
+   }
+   image->fat = (unsigned int *) mymalloc(fat_len);
+   for (i = 0; i < image->nclusters; i++)
+      image->fat[i] = le32(p + i * 4) & (image->exfat ? 0xFFFFFFFF : 0x0FFFFFFF);
+   free(p);
+   image->dir_seen = (unsigned char *) mymalloc(image->nclusters / 8 + 1);
+   memset(image->dir_seen, 0, image->nclusters / 8 + 1);
+
+   LOG(3, "image", "%s: %s: %s, %lld byte clusters, %u clusters\n", this, fname,
+         image->exfat ? "exFAT" : "FAT32", image->cluster_size, image->nclusters - 2);
+
+   image_add("", 1, -1, 0, root, 0);
+   qsort(image->files, image->nfiles, sizeof(image_file_type), cmp_image_file);
+   LOG(3, "image", "%s: %s: %d files and directories\n", this, fname, image->nfiles);
+   return 1;
+}
+
+/*
+ * add one file or directory, with its extents, and for a directory
+ * everything in it. size < 0 for one whose size is however long its
+ * cluster chain is.
+ */
+static void image_add(char *path, int is_dir, long long size, time_t mtime, unsigned int cluster, int contiguous) {
+   image_file_type *f;
+   long long off = 0, left, n;
+   unsigned int c, steps = 0;
+   unsigned char *buf;
+
+   if ( image->nfiles == image->size ) {
+      image->size = image->size ? image->size * 2 : 256;
+      if ( (image->files = (image_file_type *) realloc(image->files, image->size * sizeof(image_file_type))) == NULL ) {
+         fprintf(stderr, "cannot allocate memory");
+         exit(1);
+      }
+   }
+   f = &image->files[image->nfiles++];
+   f->path = strdup(path);
+   f->is_dir = is_dir;
+   f->mtime = mtime;
+   f->ext = NULL;
+   f->next = 0;
+
+   /* follow the cluster chain, one extent per run of adjacent clusters */
+   left = size < 0 ? (long long) image->nclusters * image->cluster_size : size;
+   for (c = cluster; left > 0 && c >= 2 && c < image->nclusters && steps++ < image->nclusters; ) {
+      if ( f->next && f->ext[f->next - 1].phys + f->ext[f->next - 1].len == image->heap + (c - 2) * image->cluster_size )
+         f->ext[f->next - 1].len += image->cluster_size;
+      else {
+         if ( (f->ext = (extent_type *) realloc(f->ext, (f->next + 1) * sizeof(extent_type))) == NULL ) {
+            fprintf(stderr, "cannot allocate memory");
+            exit(1);
+         }
+         f->ext[f->next].off = off;
+         f->ext[f->next].phys = image->heap + (c - 2) * image->cluster_size;
+         f->ext[f->next++].len = image->cluster_size;
+      }
+      off += image->cluster_size;
+      left -= image->cluster_size;
+      c = contiguous ? c + 1 : image->fat[c];
+   }
+   if ( size < 0 )
+      size = off;
+   else if ( off < size ) {
+      fprintf(stderr, "%s: WARNING: %s:%s is cut short (%lld of %lld bytes), the FAT is damaged\n",
+            this, image->fname, path, off, size);
+      size = off;
+   }
+   if ( f->next && f->ext[f->next - 1].off + f->ext[f->next - 1].len > size )
+      f->ext[f->next - 1].len = size - f->ext[f->next - 1].off;
+   f->size = size;
+
+   LOG(4, "image", "%s: %s%s %lld bytes, %d extent(s)\n", this, path[0] ? path : "/", is_dir ? "/" : "", size, f->next);
+   if ( !is_dir )
+      return;
+
+   /* each directory once: a damaged FAT can point one back at a parent */
+   if ( cluster >= 2 && cluster < image->nclusters ) {
+      if ( image->dir_seen[cluster / 8] & (1 << (cluster % 8)) ) {
+         fprintf(stderr, "%s: WARNING: %s:%s is a loop in the directory tree, the FAT is damaged\n",
+               this, image->fname, path);
+         return;
+      }
+      image->dir_seen[cluster / 8] |= 1 << (cluster % 8);
+   }
+
+   /* read the directory and add what's in it (which moves f) */
+   buf = (unsigned char *) mymalloc(size + 1);
+   for (n = 0; n < f->next; n++) {
+      if ( pread(image->fd, buf + f->ext[n].off, f->ext[n].len, f->ext[n].phys) != f->ext[n].len ) {
+         fprintf(stderr, "%s: unable to read directory %s:%s\n", this, image->fname, path);
+         exit(1);
+      }
+   }
+   if ( image->exfat )
+      image_exfat_dir(path, buf, size);
+   else
+      image_fat_dir(path, buf, size);
+   free(buf);
+}
+
+/*
+ * FAT32 directory entries: 8.3 names, with long names in the entries
+ * before them
+ */
+static void image_fat_dir(char *dir, unsigned char *buf, long long size) {
+   unsigned char *e;
+   char name[256], path[MAX_PATH_LEN];
+   static const int lfn_at[] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+   int i, k, ord, have_lfn = 0;
+   unsigned int ch;
+
+   for (e = buf; e + 32 <= buf + size && e[0] != 0x00; e += 32) {
+      if ( e[0] == 0xE5 ) {
+         have_lfn = 0;
+         continue;
+      }
+      if ( e[11] == 0x0F ) {
+         /* long name, 13 UTF-16 characters a piece, last piece first */
+         ord = (e[0] & 0x1F) - 1;
+         if ( e[0] & 0x40 ) {
+            memset(name, 0, sizeof(name));
+            have_lfn = 1;
+         }
+         for (k = 0; k < 13 && ord >= 0 && ord * 13 + k < 255; k++) {
+            ch = le16(e + lfn_at[k]);
+            if ( ch == 0x0000 || ch == 0xFFFF )
+               break;
+            name[ord * 13 + k] = ch < 0x80 ? ch : '_';
+         }
+         continue;
+      }
+      if ( e[11] & 0x08 ) {                /* volume label */
+         have_lfn = 0;
+         continue;
+      }
+      if ( !have_lfn ) {
+         /* 8.3, with the lower case flags NT uses */
+         for (i = 0, k = 0; k < 8 && e[k] != ' '; k++)
+            name[i++] = (e[12] & 0x08) ? tolower(e[k]) : e[k];
+         if ( name[0] == 0x05 )
+            name[0] = (char) 0xE5;
+         if ( e[8] != ' ' ) {
+            name[i++] = '.';
+            for (k = 8; k < 11 && e[k] != ' '; k++)
+               name[i++] = (e[12] & 0x10) ? tolower(e[k]) : e[k];
+         }
+         name[i] = '\0';
+      }
+      have_lfn = 0;
+      if ( strcmp(name, ".") == 0 || strcmp(name, "..") == 0 )
+         continue;
+      if ( snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int) sizeof(path) )
+         continue;
+      image_add(path, (e[11] & 0x10) != 0, (e[11] & 0x10) ? -1LL : (long long) le32(e + 28),
+            dos_time(le16(e + 24), le16(e + 22)), (le16(e + 20) << 16) | le16(e + 26), 0);
+   }
+}
+
+/*
+ * exFAT directory entries: a File entry, a Stream Extension entry with the
+ * size and first cluster, then File Name entries of 15 UTF-16 characters
+ */
+static void image_exfat_dir(char *dir, unsigned char *buf, long long size) {
+   unsigned char *e, *s, *n, *last;
+   char name[256], path[MAX_PATH_LEN];
+   int len, i, k;
+   unsigned int ch;
+
+   for (e = buf; e + 32 <= buf + size && e[0] != 0x00; e += 32) {
+      if ( e[0] != 0x85 )
+         continue;                         /* deleted, bitmap, up-case table, label ... */
+      s = e + 32;
+      last = e + e[1] * 32;
+      if ( e[1] < 2 || last + 32 > buf + size || s[0] != 0xC0 )
+         continue;
+      len = s[3];
+      for (i = 0, n = s + 32; i < len && i < 255 && n <= last; n += 32) {
+         for (k = 0; k < 15 && i < len; k++) {
+            ch = le16(n + 2 + k * 2);
+            name[i++] = ch < 0x80 ? ch : '_';
+         }
+      }
+      name[i] = '\0';
+      if ( snprintf(path, sizeof(path), "%s/%s", dir, name) < (int) sizeof(path) )
+         image_add(path, (le16(e + 4) & 0x10) != 0, (long long) le32(s + 24) | ((long long) le32(s + 28) << 32),
+               dos_time(le32(e + 12) >> 16, le32(e + 12) & 0xFFFF), le32(s + 20), (s[1] & 0x02) != 0);
+      e = last;
+   }
+}
+
+static time_t dos_time(unsigned int date, unsigned int time) {
+   struct tm tm;
+
+   memset(&tm, 0, sizeof(tm));
+   tm.tm_year = (date >> 9) + 80;
+   tm.tm_mon = ((date >> 5) & 0x0F) - 1;
+   tm.tm_mday = date & 0x1F;
+   tm.tm_hour = time >> 11;
+   tm.tm_min = (time >> 5) & 0x3F;
+   tm.tm_sec = (time & 0x1F) * 2;
+   tm.tm_isdst = -1;
+   return mktime(&tm);
+}
+
+static int cmp_image_file(const void *a, const void *b) {
+   return strcasecmp(((const image_file_type *) a)->path, ((const image_file_type *) b)->path);
+}
+
+/*
+ * the file in the image that fname (image::/path) names, NULL if fname is
+ * not in the image or there is no such file. Names are case insensitive,
+ * as on a mounted card.
+ */
+image_file_type *image_lookup(char *fname) {
+   image_file_type key;
+
+   if ( (key.path = image_path(fname)) == NULL )
+      return NULL;
+   return (image_file_type *) bsearch(&key, image->files, image->nfiles, sizeof(image_file_type), cmp_image_file);
+}
+
+/*
+ * the /path part of image::/path, NULL if fname isn't in the image
+ */
+static char *image_path(char *fname) {
+   size_t len;
+
+   if ( !image )
+      return NULL;
+   len = strlen(image->fname);
+   if ( strncmp(fname, image->fname, len) != 0 || strncmp(fname + len, "::", 2) != 0 )
+      return NULL;
+   return fname + len + 2;
+}
+
+/*
+ * process_dir() for a directory in the image
+ */
+void image_process_dir(char *path) {
+   image_file_type *f, *d;
+   char dir[MAX_PATH_LEN];
+   size_t len, dl;
+
+   /* image::/a/b, or image:: for the root */
+   snprintf(dir, sizeof(dir), "%s::%s%s", image->fname, path[0] == '/' ? "" : "/", path);
+   for (len = strlen(dir); dir[len - 1] == '/'; )
+      dir[--len] = '\0';
+   if ( (d = image_lookup(dir)) == NULL || !d->is_dir ) {
+      fprintf(stderr, "%s: no directory %s in %s\n", this, path, image->fname);
+      exit(1);
+   }
+   LOG(2, "dir", "%s: processing %s\n", this, dir);
+
+   dl = strlen(d->path);
+   for (f = image->files; f < image->files + image->nfiles; f++) {
+      /* just what is directly in d */
+      if ( strncasecmp(f->path, d->path, dl) != 0 || f->path[dl] != '/' || strchr(f->path + dl + 1, '/') )
+         continue;
+      if ( !f->is_dir )
+         process_file(dir, f->path + dl + 1);
+      else if ( recursive )
+         image_process_dir(f->path);
+   }
+}
+
+/*
+ * fopen() and stat() for a source file, in the image or not
+ */
+FILE *src_fopen(char *fname) {
+   image_file_type *f;
+   image_stream_type *s;
+   cookie_io_functions_t io = { image_read, NULL, image_seek, image_close };
+
+   if ( !image_path(fname) )
+      return fopen(fname, "rb");
+   if ( (f = image_lookup(fname)) == NULL || f->is_dir ) {
+      errno = ENOENT;
+      return NULL;
+   }
+   s = (image_stream_type *) mymalloc(sizeof(image_stream_type));
+   s->file = f;
+   s->pos = 0;
+   s->ext = 0;
+   return fopencookie(s, "rb", io);
+}
+
+int src_stat(char *fname, struct stat *st) {
+   image_file_type *f;
+
+   if ( !image_path(fname) )
+      return stat(fname, st);
+   if ( (f = image_lookup(fname)) == NULL ) {
+      errno = ENOENT;
+      return -1;
+   }
+   memset(st, 0, sizeof(struct stat));
+   st->st_mode = f->is_dir ? S_IFDIR | 0755 : S_IFREG | 0644;
+   st->st_size = f->size;
+   st->st_mtime = f->mtime;
+   st->st_dev = image->dev;
+   st->st_ino = f->next ? f->ext[0].phys / image->cluster_size : 0;
+   return 0;
+}
+
+/*
+ * read from a file in the image: straight out of its extents
+ */
+static ssize_t image_read(void *cookie, char *buf, size_t size) {
+   image_stream_type *s = (image_stream_type *) cookie;
+   image_file_type *f = s->file;
+   extent_type *e;
+   size_t done = 0;
+   ssize_t n;
+   long long want;
+
+   while ( done < size && s->pos < f->size ) {
+      /* usually the same extent as last time, or the next one */
+      if ( s->ext >= f->next || s->pos < f->ext[s->ext].off )
+         s->ext = 0;
+      while ( s->ext < f->next && s->pos >= f->ext[s->ext].off + f->ext[s->ext].len )
+         s->ext++;
+      if ( s->ext == f->next )
+         break;
+      e = &f->ext[s->ext];
+      want = e->off + e->len - s->pos;
+      if ( want > (long long) (size - done) )
+         want = size - done;
+      if ( (n = pread(image->fd, buf + done, want, e->phys + s->pos - e->off)) <= 0 )
+         return done ? (ssize_t) done : n;
+      done += n;
+      s->pos += n;
+   }
+   return done;
+}
+
+static int image_seek(void *cookie, off64_t *offset, int whence) {
+   image_stream_type *s = (image_stream_type *) cookie;
+   long long pos;
+
+   pos = whence == SEEK_SET ? *offset : whence == SEEK_CUR ? s->pos + *offset : s->file->size + *offset;
+   if ( pos < 0 ) {
+      errno = EINVAL;
+      return -1;
+   }
+   s->pos = *offset = pos;
+   return 0;
+}
+
+static int image_close(void *cookie) {
+   free(cookie);
+   return 0;
+}
+
+/*****************************************************************************
+ * Elementary streams
+ *
+ * demux_feed() is handed the mpeg as it is written, after the headers are
+ * fixed, and passes the elementary streams inside it on to dm->es: the
+ * (first) video stream, and with dm->audio the audio streams as well.
+ * Program streams are followed pack by pack and PES packet by PES packet
+ * (every other packet is skipped by its length), transport streams packet
+ * by packet on the video and audio PIDs. Feeding can start anywhere: we
+ * look for the next pack or PES start code first.
+ *
+ * Streams are numbered by their PES stream id: E0-EF video, C0-DF MPEG
+ * audio. Private stream 1 (BD) carries a sub stream id and a few bytes of
+ * its own header before the data, which we strip; those are numbered
+ * 0x100 + sub stream id: 80-87 AC-3, 88-8F DTS, A0-AF LPCM.
+ *
+ * PES header (program stream, MPEG-2):
+ * | 00 00 01 | stream id | length (2) | flags (2) | hdr len | hdr len bytes | payload
+ *
+ * private stream 1 payload:
+ * | sub id | frames | first access unit (2) | LPCM only: 3 bytes of format | data
+ *
+ * reference: ISO/IEC 13818-1 2.4.3.6, 2.5.3.3
+ * http://dvd.sourceforge.net/dvdinfo/pes-hdr.html
+ ****************************************************************************/
+
+void demux_init(demux_type *dm, ts_type *ts, void (*es)(demux_type *dm, int stream, unsigned char *p, size_t n), void *arg) {
+   memset(dm, 0, sizeof(demux_type));
+   dm->ts = ts;
+   dm->es = es;
+   dm->arg = arg;
+   dm->sc = 0xFFFFFFFF;
+   dm->video = -1;
+   dm->pts = -1;
+}
+
+void demux_feed(demux_type *dm, unsigned char *p, size_t len) {
+   unsigned char *end = p + len, *h, *pl;
+   size_t n;
+   int afc, pid, stream, i;
+
+   /* transport stream: the video (and audio) PIDs' payload, less the PES
+    * headers */
+   if ( dm->ts && dm->ts->pkt ) {
+      for ( ; p + dm->ts->pkt <= end && !dm->done; p += dm->ts->pkt) {
+         h = p + dm->ts->sync;
+         if ( h[0] != 0x47 )
+            continue;
+         pid = ((h[1] & 0x1F) << 8) | h[2];
+         stream = pid == dm->ts->video_pid ? 0xE0 : -1;
+         for (i = 0; i < dm->ts->naudio && dm->audio && stream < 0; i++) {
+            if ( pid == dm->ts->audio_pid[i] )
+               stream = dm->ts->audio_stream[i];
+         }
+         if ( stream < 0 )
+            continue;
+         afc = (h[3] >> 4) & 0x03;
+         if ( !(afc & 0x01) )
+            continue;
+         pl = h + 4;
+         if ( afc & 0x02 )
+            pl += 1 + h[4];
+         if ( (h[1] & 0x40) && pl + 9 <= h + 188 && pl[0] == 0x00 && pl[1] == 0x00 && pl[2] == 0x01 ) {
+            if ( (pl[7] & 0x80) && pl[8] >= 5 && pl + 14 <= h + 188 )
+               dm->pts = demux_pts(pl + 9);
+            pl += 9 + pl[8];              /* a PES packet starts here */
+         }
+         if ( pl < h + 188 )
+            dm->es(dm, stream, pl, h + 188 - pl);
+         dm->pts = -1;
+      }
+      return;
+   }
+
+   /* program stream */
+   while ( p < end && !dm->done ) {
+      switch ( dm->state ) {
+         case DEMUX_SYNC:
+            dm->sc = (dm->sc << 8) | *p++;
+            if ( (dm->sc & 0xFFFFFF00) == 0x00000100 && (dm->sc & 0xFF) >= 0xBA ) {
+               dm->code = dm->sc & 0xFF;
+               dm->nhdr = dm->pes = 0;
+               dm->need = dm->code == 0xBA ? 1 : 2;
+               dm->state = DEMUX_HEADER;
+            }
+            break;
+         case DEMUX_HEADER:
+            n = dm->need - dm->nhdr < end - p ? (size_t) (dm->need - dm->nhdr) : (size_t) (end - p);
+            memcpy(dm->hdr + dm->nhdr, p, n);
+            dm->nhdr += n;
+            p += n;
+            if ( dm->nhdr == dm->need )
+               demux_header(dm);
+            break;
+         case DEMUX_SKIP:
+         case DEMUX_PAYLOAD:
+            n = dm->left < end - p ? (size_t) dm->left : (size_t) (end - p);
+            if ( dm->state == DEMUX_PAYLOAD )
+               dm->es(dm, dm->stream, p, n);
+            dm->pts = -1;
+            p += n;
+            if ( (dm->left -= n) == 0 ) {
+               dm->state = DEMUX_SYNC;
+               dm->sc = 0xFFFFFFFF;
+            }
+            break;
+      }
+   }
+}
+
+/*
+ * the dm->need bytes after a pack or PES start code are in dm->hdr. Work
+ * out what comes next: more header, a packet body to skip, or a stream.
+ */
+static void demux_header(demux_type *dm) {
+   unsigned char *h = dm->hdr;
+   long len;
+   int sub;
+
+   dm->state = DEMUX_HEADER;
+   if ( dm->code == 0xBA ) {
+      /* pack header: 10 bytes and some stuffing for MPEG-2, 8 for MPEG-1 */
+      if ( dm->need == 1 ) {
+         dm->need = (h[0] & 0xC0) == 0x40 ? 10 : 8;
+         return;
+      }
+      dm->left = dm->need == 10 ? h[9] & 0x07 : 0;
+      dm->state = DEMUX_SKIP;
+   }
+   else {
+      len = (h[0] << 8) | h[1];
+      if ( dm->need == 2 && (((dm->code & 0xF0) == 0xE0 && (dm->video < 0 || dm->code == dm->video))
+               || (dm->audio && ((dm->code & 0xE0) == 0xC0 || dm->code == 0xBD))) ) {
+         dm->need = 5;                    /* one we want: on to the flags */
+         return;
+      }
+      if ( dm->need == 5 && !dm->pes && (h[2] & 0xC0) == 0x80 ) {
+         dm->pes = 5 + h[4];              /* and the rest of the PES header */
+         if ( h[4] > 0 ) {
+            dm->need = dm->pes;
+            return;
+         }
+      }
+      if ( dm->pes && dm->code == 0xBD ) {
+         if ( dm->need == dm->pes ) {
+            dm->need++;                   /* private stream 1: the sub stream id ... */
+            return;
+         }
+         sub = h[dm->pes];
+         if ( dm->need == dm->pes + 1 && ((sub & 0xF0) == 0x80 || (sub & 0xF0) == 0xA0) ) {
+            dm->need += (sub & 0xF0) == 0x80 ? 3 : 6;   /* ... and its header */
+            return;
+         }
+      }
+      dm->left = len - (dm->need - 2);
+      dm->state = DEMUX_SKIP;             /* anything else, or MPEG-1 PES */
+      if ( dm->pes && dm->left >= 0 && (dm->code != 0xBD || dm->need > dm->pes + 1) ) {
+         if ( (dm->code & 0xF0) == 0xE0 && dm->video < 0 )
+            dm->video = dm->code;         /* first video stream is the one */
+         dm->stream = dm->code == 0xBD ? 0x100 + h[dm->pes] : dm->code;
+         dm->pts = (h[3] & 0x80) && h[4] >= 5 ? demux_pts(h + 5) : -1;
+         dm->state = DEMUX_PAYLOAD;
+      }
+   }
+   if ( dm->left <= 0 ) {
+      dm->state = DEMUX_SYNC;
+      dm->sc = 0xFFFFFFFF;
+   }
+}
+
+/*
+ * the 33 bit time stamp in the 5 bytes at p
+ * | 001x ts[32..30] 1 | ts[29..22] | ts[21..15] 1 | ts[14..7] | ts[6..0] 1 |
+ */
+static long long demux_pts(unsigned char *p) {
+   return ((long long) (p[0] & 0x0E) << 29) | (p[1] << 22) | ((p[2] & 0xFE) << 14) | (p[3] << 7) | (p[4] >> 1);
+}
+
+/*****************************************************************************
+ * Poster frames
+ *
+ * With --poster[=N] the Nth I-frame of each mpeg, with the sequence header
+ * (and its extensions) that came before it, is saved next to the mpeg as a
+ * little .m2v elementary stream, enough for a thumbnail. It comes off the
+ * video stream as make_mpeg() writes it, so the aspect ratio is already
+ * fixed and nothing is read twice. The picture runs up to the next picture,
+ * GOP or sequence header.
+ *
+ * picture header:
+ * | 00 00 01 00 | temporal reference (10) | coding type (3) | ...
+ ****************************************************************************/
+
+void poster_init(poster_type *pf, output_type *out, int nout) {
+   memset(pf, 0, sizeof(poster_type));
+   pf->out = out;
+   pf->nout = nout;
+   pf->seq_at = pf->pic_at = -1;
+}
+
+/*
+ * one more piece of video elementary stream
+ */
+static void poster_es(poster_type *pf, unsigned char *p, size_t n) {
+   unsigned char *b, *q;
+   size_t i, keep;
+
+   if ( pf->len + n > POSTER_MAX_LEN ) {
+      fprintf(stderr, "%s: WARNING: no I-frame %d in the first %d bytes of video, no poster frame\n",
+            this, poster_nth, POSTER_MAX_LEN);
+      pf->done = 1;
+      return;
+   }
+   if ( pf->len + n > pf->size ) {
+      pf->size = (pf->len + n) * 2;
+      if ( (pf->buf = (unsigned char *) realloc(pf->buf, pf->size)) == NULL ) {
+         fprintf(stderr, "cannot allocate memory");
+         exit(1);
+      }
+   }
+   memcpy(pf->buf + pf->len, p, n);
+   pf->len += n;
+
+   /* step through the start codes, 01 to 01 */
+   b = pf->buf;
+   for (q = b + pf->scan + 2; q + 4 <= b + pf->len && (q = memchr(q, 0x01, b + pf->len - 3 - q)) != NULL; q++) {
+      if ( q[-1] != 0x00 || q[-2] != 0x00 )
+         continue;
+      i = q - 2 - b;
+
+      /* the sequence header ends with its extensions and user data */
+      if ( pf->seq_at >= 0 && q[1] != 0xB5 && q[1] != 0xB2 ) {
+         pf->nseq = i - pf->seq_at;
+         if ( (pf->seq = (unsigned char *) realloc(pf->seq, pf->nseq)) == NULL ) {
+            fprintf(stderr, "cannot allocate memory");
+            exit(1);
+         }
+         memcpy(pf->seq, b + pf->seq_at, pf->nseq);
+         pf->seq_at = -1;
+      }
+
+      /* and our picture with the next picture, GOP or sequence */
+      if ( pf->pic_at >= 0 && (q[1] == 0x00 || q[1] == 0xB3 || q[1] == 0xB8 || q[1] == 0xB7) ) {
+         poster_write(pf, b + pf->pic_at, i - pf->pic_at);
+         pf->done = 1;
+         return;
+      }
+
+      if ( q[1] == 0xB3 )
+         pf->seq_at = i;
+      else if ( q[1] == 0x00 && pf->pic_at < 0 && pf->nseq > 0 && ((q[3] >> 3) & 0x07) == 1
+            && ++pf->seen == poster_nth )
+         pf->pic_at = i;
+   }
+
+   /* let go of everything we are sure we won't need */
+   pf->scan = pf->len > 5 ? pf->len - 5 : 0;
+   keep = pf->scan;
+   if ( pf->seq_at >= 0 && (size_t) pf->seq_at < keep )
+      keep = pf->seq_at;
+   if ( pf->pic_at >= 0 && (size_t) pf->pic_at < keep )
+      keep = pf->pic_at;
+   if ( keep > 0 ) {
+      memmove(b, b + keep, pf->len - keep);
+      pf->len -= keep;
+      pf->scan -= keep;
+      if ( pf->seq_at >= 0 )
+         pf->seq_at -= keep;
+      if ( pf->pic_at >= 0 )
+         pf->pic_at -= keep;
+   }
+}
+
+/*
+ * the mpeg is all written; a picture that ran to the end of it is still
+ * good
+ */
+void poster_finish(poster_type *pf) {
+   if ( !pf->done ) {
+      if ( pf->pic_at >= 0 )
+         poster_write(pf, pf->buf + pf->pic_at, pf->len - pf->pic_at);
+      else
+         fprintf(stderr, "%s: WARNING: no I-frame %d found, no poster frame\n", this, poster_nth);
+   }
+   free(pf->buf);
+   free(pf->seq);
+}
+
+/*
+ * write the sequence header, pic and a sequence end code next to each mpeg
+ * as .m2v
+ */
+static void poster_write(poster_type *pf, unsigned char *pic, size_t n) {
+   static const unsigned char seq_end[] = { 0x00, 0x00, 0x01, 0xB7 };
+   char fname[MAX_PATH_LEN];
+   FILE *f;
+   int d, len;
+
+   for (d = 0; d < pf->nout; d++) {
+      if ( pf->out[d].failed || pf->out[d].stream )
+         continue;
+
+      /* trim off .mpeg extension and add .m2v */
+      len = strlen(pf->out[d].fname) - 5;
+      sprintf(fname, "%.*s.m2v", len, pf->out[d].fname);
+      if ( noclobber && file_exists(fname) ) {
+         LOG(2, "poster", "%s: %s exists, skipping\n", this, fname);
+         continue;
+      }
+
+      LOG(2, "poster", "%s: writing poster frame %s (%ld bytes)\n", this, fname, (long) (pf->nseq + n + 4));
+      if ( (f = fopen(fname, "wb")) == NULL ) {
+         fprintf(stderr, "%s: WARNING: unable to open poster frame %s\n", this, fname);
+         perror(fname);
+         continue;
+      }
+      fwrite(pf->seq, 1, pf->nseq, f);
+      fwrite(pic, 1, n, f);
+      fwrite(seq_end, 1, 4, f);
+      if ( ferror(f) | fclose(f) ) {
+         fprintf(stderr, "%s: WARNING: unable to write poster frame %s\n", this, fname);
+         perror(fname);
+         continue;
+      }
+      throttle_io(THROTTLE_WRITE, pf->nseq + n + 4);
+   }
+}
+
+/*****************************************************************************
+ * Elementary stream sidecars
+ *
+ * With --demux every stream demux_feed() finds in the mpeg is also written
+ * out on its own, next to the mpeg, in the same pass that writes the mpeg:
+ * the video with its headers already fixed, and each audio stream as it
+ * was. The files are named for the stream:
+ *
+ *    mov-20120614-103000.e0.m2v    video
+ *    mov-20120614-103000.c0.mpa    MPEG audio
+ *    mov-20120614-103000.80.ac3    AC-3 (also 88.dts, a0.lpcm)
+ *
+ * Each stream is gathered in a SIDECAR_BUF_SIZE buffer and written when it
+ * fills, so memory stays bounded however long the mpeg is. split_es() is
+ * what demux_feed() calls; it also hands the video to the poster frame.
+ ****************************************************************************/
+
+void split_init(split_type *sp, output_type *out, int nout, poster_type *pf, int demux, mp4_type *mp4) {
+   memset(sp, 0, sizeof(split_type));
+   sp->out = out;
+   sp->nout = nout;
+   sp->pf = pf;
+   sp->demux = demux;
+   sp->mp4 = mp4;
+}
+
+static void split_es(demux_type *dm, int stream, unsigned char *p, size_t n) {
+   split_type *sp = (split_type *) dm->arg;
+   sidecar_type *sc;
+   unsigned char *q;
+   size_t k, left;
+
+   if ( sp->pf && !sp->pf->done && stream < 0x100 && (stream & 0xF0) == 0xE0 )
+      poster_es(sp->pf, p, n);
+
+   if ( sp->demux && (sc = sidecar_open(sp, stream)) != NULL ) {
+      for (q = p, left = n; left > 0; q += k, left -= k) {
+         k = left < SIDECAR_BUF_SIZE - sc->len ? left : SIDECAR_BUF_SIZE - sc->len;
+         memcpy(sc->buf + sc->len, q, k);
+         sc->len += k;
+         if ( sc->len == SIDECAR_BUF_SIZE )
+            sidecar_flush(sp, sc);
+      }
+   }
+
+   if ( sp->mp4 )
+      mp4_es(sp->mp4, stream, dm->pts, p, n);
+
+   dm->done = (!sp->pf || sp->pf->done) && !sp->demux && !sp->mp4;
+}
+
+/*
+ * the mpeg is all written: finish the poster frame, and write out and
+ * close the sidecars
+ */
+void split_finish(split_type *sp) {
+   sidecar_type *sc;
+   int d;
+
+   if ( sp->pf )
+      poster_finish(sp->pf);
+   if ( sp->mp4 )
+      mp4_finish(sp->mp4);
+
+   for (sc = sp->side; sc < sp->side + sp->nside; sc++) {
+      sidecar_flush(sp, sc);
+      for (d = 0; d < sp->nout; d++) {
+         if ( sc->fd[d] < 0 )
+            continue;
+         if ( close(sc->fd[d]) < 0 )
+            fprintf(stderr, "%s: WARNING: unable to write %s stream %02x next to %s: %s\n",
+                  this, sidecar_ext(sc->stream), sc->stream & 0xFF, sp->out[d].fname, strerror(errno));
+      }
+      LOG(2, "demux", "%s: %s stream %02x: %lld bytes\n", this, sidecar_ext(sc->stream), sc->stream & 0xFF, sc->size);
+      free(sc->buf);
+   }
+   sp->nside = 0;
+}
+
+/*
+ * the sidecar for stream, opened next to each mpeg the first time we see
+ * it. NULL if we can't take another stream.
+ */
+static sidecar_type * sidecar_open(split_type *sp, int stream) {
+   char fname[MAX_PATH_LEN];
+   sidecar_type *sc;
+   int d, len;
+
+   for (sc = sp->side; sc < sp->side + sp->nside; sc++) {
+      if ( sc->stream == stream )
+         return sc;
+   }
+   if ( sidecar_ext(stream) == NULL )
+      return NULL;
+   if ( sp->nside == SIDECAR_MAX ) {
+      if ( !sp->full++ )
+         fprintf(stderr, "%s: WARNING: more than %d streams, only the first are demuxed\n", this, SIDECAR_MAX);
+      return NULL;
+   }
+
+   sc = &sp->side[sp->nside++];
+   sc->stream = stream;
+   sc->buf = (unsigned char *) mymalloc(SIDECAR_BUF_SIZE);
+   sc->len = 0;
+   sc->size = 0;
+   for (d = 0; d < sp->nout; d++) {
+      sc->fd[d] = -1;
+      if ( sp->out[d].failed || sp->out[d].stream )
+         continue;
+
+      /* trim off .mpeg extension and add the stream's */
+      len = strlen(sp->out[d].fname) - 5;
+      sprintf(fname, "%.*s.%02x.%s", len, sp->out[d].fname, stream & 0xFF, sidecar_ext(stream));
+      if ( noclobber && file_exists(fname) ) {
+         LOG(2, "demux", "%s: %s exists, skipping\n", this, fname);
+         continue;
+      }
+      LOG(2, "demux", "%s: writing elementary stream %s\n", this, fname);
+      if ( (sc->fd[d] = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0 ) {
+         fprintf(stderr, "%s: WARNING: unable to open elementary stream %s\n", this, fname);
+         perror(fname);
+      }
+   }
+   return sc;
+}
+
+/*
+ * write out what we have of a stream. A sidecar that fails is dropped,
+ * the mpeg and the other sidecars carry on.
+ */
+static void sidecar_flush(split_type *sp, sidecar_type *sc) {
+   int d;
+
+   for (d = 0; d < sp->nout && sc->len > 0; d++) {
+      if ( sc->fd[d] < 0 )
+         continue;
+      throttle_io(THROTTLE_WRITE, sc->len);
+      if ( write(sc->fd[d], sc->buf, sc->len) != (ssize_t) sc->len ) {
+         fprintf(stderr, "%s: WARNING: unable to write %s stream %02x next to %s: %s\n",
+               this, sidecar_ext(sc->stream), sc->stream & 0xFF, sp->out[d].fname, strerror(errno));
+         close(sc->fd[d]);
+         sc->fd[d] = -1;
+      }
+   }
+   sc->size += sc->len;
+   sc->len = 0;
+}
+
+/*
+ * file extension for a demux_feed() stream, NULL for one we don't know
+ */
+static const char * sidecar_ext(int stream) {
+   if ( stream < 0x100 && (stream & 0xF0) == 0xE0 )
+      return "m2v";
+   if ( stream < 0x100 && (stream & 0xE0) == 0xC0 )
+      return "mpa";
+   if ( (stream & 0xFF8) == 0x180 )
+      return "ac3";
+   if ( (stream & 0xFF8) == 0x188 )
+      return "dts";
+   if ( (stream & 0xFF0) == 0x1A0 )
+      return "lpcm";
+   return NULL;
+}
+
+/*****************************************************************************
+ * Patching in place
+ *
+ * With --in-place a MOD (or an mpeg we made before, with its .moi) is fixed
+ * where it is. make_mpeg() runs as usual, but into a patch_sink: instead of
+ * writing anything it compares what it would write with what is in the
+ * file already, and keeps just the bytes that differ. That is a read of
+ * the file (the comparison reads come out of the page cache) and a handful
+ * of bytes per sequence header to write back.
+ *
+ * Before touching the file the patches go in a journal, dir/.file.fix,
+ * with the old and new value of every byte, written to a temp file and
+ * renamed into place. Only then are they written with pwrite(), and the
+ * journal removed once they are on disk. A journal found later means we
+ * were interrupted part way: it is rolled forward (or back, with
+ * --in-place=rollback) before anything else is done with the file.
+ *
+ * journal:
+ * | journal_type | patch_type * npatch |
+ ****************************************************************************/
+
+int fix_in_place(job_type *job) {
+   cookie_io_functions_t io = { NULL, patch_sink_write, NULL, NULL };
+   char jfname[MAX_PATH_LEN], tmp_fname[MAX_PATH_LEN], dir[MAX_PATH_LEN];
+   patch_sink_type sink;
+   output_type out;
+   journal_type jh;
+   struct stat st, st2;
+   size_t len;
+   int fd, dfd = -1, ok;
+
+   /* finish (or undo) what an earlier run started */
+   journal_fname(jfname, job->mod_fname);
+   if ( (ok = journal_replay(job->mod_fname, jfname, in_place == IN_PLACE_ROLLBACK)) != 0 )
+      return ok > 0;
+   if ( in_place == IN_PLACE_ROLLBACK ) {
+      LOG(2, "in-place", "%s: %s: no journal, nothing to roll back\n", this, job->mod_fname);
+      return 1;
+   }
+
+   /* see what needs changing, without changing it */
+   memset(&sink, 0, sizeof(patch_sink_type));
+   if ( (sink.fd = open(job->mod_fname, O_RDONLY)) < 0 || fstat(sink.fd, &st) < 0 ) {
+      perror(job->mod_fname);
+      if ( sink.fd >= 0 )
+         close(sink.fd);
+      return 0;
+   }
+   sink.orig = (unsigned char *) mymalloc(RW_BLOCK_SIZE);
+
+   memset(&out, 0, sizeof(output_type));
+   strcpy(out.fname, job->mod_fname);
+   out.fd = -1;
+   out.stream = 1;
+   out.size = -1;   /* a file that changes size fails this job, not the run */
+   if ( (out.fp = fopencookie(&sink, "w", io)) == NULL ) {
+      perror(job->mod_fname);
+      exit(1);
+   }
+   setvbuf(out.fp, NULL, _IONBF, 0);
+   ok = make_mpeg(job->mod_fname, &out, 1, job->info) && !out.failed;
+   fclose(out.fp);
+   close(sink.fd);
+   free(sink.orig);
+
+   if ( ok && (sink.lost || sink.off != st.st_size
+         || stat(job->mod_fname, &st2) < 0 || st2.st_size != st.st_size || st2.st_mtime != st.st_mtime) ) {
+      fprintf(stderr, "%s: WARNING: %s changed while it was being read, not patching it\n", this, job->mod_fname);
+      ok = 0;
+   }
+   if ( !ok || sink.npatch == 0 ) {
+      if ( ok )
+         LOG(1, "in-place", "%s: %s is fine as it is\n", this, job->mod_fname);
+      free(sink.patch);
+      return ok;
+   }
+
+   /* journal first, and its name on disk too, or a crash could leave the
+    * file part patched with nothing to say how ... */
+   memset(&jh, 0, sizeof(journal_type));
+   memcpy(jh.magic, JOURNAL_MAGIC, 8);
+   jh.size = st.st_size;
+   jh.npatch = sink.npatch;
+   len = sink.npatch * sizeof(patch_type);
+   jh.hash = block_hash((unsigned char *) sink.patch, len);
+   sprintf(tmp_fname, "%s.tmp", jfname);
+   if ( (fd = open(tmp_fname, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0
+         || write(fd, &jh, sizeof(journal_type)) != sizeof(journal_type)
+         || write(fd, sink.patch, len) != (ssize_t) len
+         || fdatasync(fd) < 0
+         || close(fd) < 0
+         || rename(tmp_fname, jfname) < 0
+         || (dfd = open(dirname(strcpy(dir, jfname)), O_RDONLY | O_DIRECTORY)) < 0
+         || fsync(dfd) < 0 ) {
+      fprintf(stderr, "%s: unable to write journal %s, not patching %s\n", this, jfname, job->mod_fname);
+      perror(jfname);
+      unlink(tmp_fname);
+      unlink(jfname);
+      if ( dfd >= 0 )
+         close(dfd);
+      free(sink.patch);
+      return 0;
+   }
+   close(dfd);
+
+   /* ... then the file, and the journal goes once it is on disk */
+   ok = (fd = open(job->mod_fname, O_WRONLY)) >= 0
+      && apply_patches(fd, sink.patch, sink.npatch, 0)
+      && fdatasync(fd) == 0;
+   if ( fd >= 0 && close(fd) < 0 )
+      ok = 0;
+   if ( !ok ) {
+      fprintf(stderr, "%s: unable to patch %s, its journal %s is kept for next time\n", this, job->mod_fname, jfname);
+      perror(job->mod_fname);
+   }
+   else {
+      unlink(jfname);
+      LOG(1, "in-place", "%s: patched %d bytes of %s\n", this, sink.npatch, job->mod_fname);
+   }
+   free(sink.patch);
+   return ok;
+}
+
+/*
+ * make_mpeg() writes n bytes: note every one that isn't already there. If
+ * the file has shrunk from under us there is nothing to compare with; say
+ * so in sink->lost and take the bytes anyway, so make_mpeg() carries on to
+ * the end and fix_in_place() drops the job.
+ */
+static ssize_t patch_sink_write(void *cookie, const char *buf, size_t n) {
+   patch_sink_type *sink = (patch_sink_type *) cookie;
+   const unsigned char *b = (const unsigned char *) buf;
+   patch_type *pt;
+   size_t done, k, i;
+
+   for (done = 0; done < n; done += k, sink->off += k) {
+      k = n - done < RW_BLOCK_SIZE ? n - done : RW_BLOCK_SIZE;
+      if ( sink->lost || pread(sink->fd, sink->orig, k, sink->off) != (ssize_t) k ) {
+         sink->lost = 1;
+         continue;
+      }
+      if ( memcmp(sink->orig, b + done, k) == 0 )
+         continue;
+      for (i = 0; i < k; i++) {
+         if ( sink->orig[i] == b[done + i] )
+            continue;
+         if ( sink->npatch == sink->size ) {
+            sink->size = sink->size ? sink->size * 2 : 256;
+            if ( (sink->patch = (patch_type *) realloc(sink->patch, sink->size * sizeof(patch_type))) == NULL ) {
+               fprintf(stderr, "cannot allocate memory");
+               exit(1);
+            }
+         }
+         pt = &sink->patch[sink->npatch++];
+         memset(pt, 0, sizeof(patch_type));   /* padding too, it is hashed */
+         pt->off = sink->off + i;
+         pt->was = sink->orig[i];
+         pt->now = b[done + i];
+      }
+   }
+   return n;
+}
+
+/*
+ * If fname has a journal, put in its new bytes (or its old ones, to undo)
+ * and remove it. Returns 1 if we did, 0 if there was no journal (or only
+ * one we never finished writing, so the file was never touched), -1 if
+ * there is one we can't use.
+ */
+static int journal_replay(char *fname, char *jfname, int undo) {
+   journal_type jh;
+   patch_type *patch = NULL;
+   struct stat st;
+   size_t len = 0;
+   int fd, ok;
+
+   if ( (fd = open(jfname, O_RDONLY)) < 0 )
+      return 0;
+   ok = read(fd, &jh, sizeof(journal_type)) == sizeof(journal_type)
+      && memcmp(jh.magic, JOURNAL_MAGIC, 8) == 0
+      && jh.npatch > 0 && jh.npatch <= jh.size;
+   if ( ok ) {
+      len = jh.npatch * sizeof(patch_type);
+      patch = (patch_type *) mymalloc(len);
+      ok = read(fd, patch, len) == (ssize_t) len && block_hash((unsigned char *) patch, len) == jh.hash;
+   }
+   close(fd);
+   if ( !ok ) {
+      LOG(1, "in-place", "%s: %s: discarding incomplete journal %s\n", this, fname, jfname);
+      unlink(jfname);
+      free(patch);
+      return 0;
+   }
+   if ( stat(fname, &st) < 0 || st.st_size != jh.size ) {
+      fprintf(stderr, "%s: WARNING: %s is not the size its journal %s says, leaving both alone\n", this, fname, jfname);
+      free(patch);
+      return -1;
+   }
+
+   ok = (fd = open(fname, O_WRONLY)) >= 0
+      && apply_patches(fd, patch, jh.npatch, undo)
+      && fdatasync(fd) == 0;
+   if ( fd >= 0 && close(fd) < 0 )
+      ok = 0;
+   free(patch);
+   if ( !ok ) {
+      fprintf(stderr, "%s: unable to replay journal %s\n", this, jfname);
+      perror(fname);
+      return -1;
+   }
+   unlink(jfname);
+   LOG(1, "in-place", "%s: %s %d bytes of %s from its journal\n",
+         this, undo ? "rolled back" : "rolled forward", jh.npatch, fname);
+   return 1;
+}
+
+/*
+ * write the patches (their old bytes, to undo), a run of adjacent ones at
+ * a time
+ */
+static int apply_patches(int fd, patch_type *patch, int n, int undo) {
+   unsigned char run[256];
+   int i, j;
+
+   for (i = 0; i < n; i = j) {
+      for (j = i; j < n && j - i < (int) sizeof(run) && patch[j].off == patch[i].off + (j - i); j++)
+         run[j - i] = undo ? patch[j].was : patch[j].now;
+      throttle_io(THROTTLE_WRITE, j - i);
+      if ( pwrite(fd, run, j - i, patch[i].off) != j - i )
+         return 0;
+   }
+   return 1;
+}
+
+/*
+ * journal for dir/file is dir/.file.fix
+ */
+void journal_fname(char *jfname, char *fname) {
+   char *slash = strrchr(fname, '/');
+
+   if ( slash )
+      sprintf(jfname, "%.*s/.%s.fix", (int) (slash - fname), fname, slash + 1);
+   else
+      sprintf(jfname, ".%s.fix", fname);
+}
+
+/*****************************************************************************
+ * Fragmented MP4
+ *
+ * With --mp4 each mpeg also gets a .mp4 next to it, repackaged from the
+ * streams demux_feed() pulls out while the mpeg is written: the MPEG-2
+ * video (headers already fixed) and MPEG audio or AC-3, nothing decoded or
+ * re-encoded. It is a fragmented MP4, written as we go, so it can be
+ * played before the conversion is done:
+ *
+ * | ftyp | moov (the tracks, no samples) | moof | mdat | moof | mdat | ...
+ *
+ * The moov goes out with the first fragment, at the end of the first GOP,
+ * by which time we know what each stream is; a stream that turns up after
+ * that is left out. Each fragment is a GOP of video (cut at every GOP or
+ * sequence header, or sooner if it gets past MP4_FRAG_MAX) and the audio
+ * that came with it. A video sample is an access unit: a picture and any
+ * headers before it. Its composition offset comes from the picture's
+ * temporal reference, and the tracks are lined up by the PTS of the first
+ * PES packet of each.
+ *
+ * references: ISO/IEC 14496-12 (boxes), 14496-14 (esds), ETSI TS 102 366
+ * annex F (dac3)
+ ****************************************************************************/
+
+void mp4_init(mp4_type *mp4, output_type *out, int nout) {
+   memset(mp4, 0, sizeof(mp4_type));
+   mp4->out = out;
+   mp4->nout = nout;
+}
+
+/*
+ * n more bytes of stream. pts is that of the PES packet they start, or -1.
+ */
+void mp4_es(mp4_type *mp4, int stream, long long pts, unsigned char *p, size_t n) {
+   mp4_track_type *t;
+
+   if ( mp4->started < 0 || (t = mp4_track(mp4, stream)) == NULL )
+      return;
+   if ( t->first_pts < 0 && pts >= 0 )
+      t->first_pts = pts;
+
+   /* nothing we can make samples of, let it go */
+   if ( t->es.len + n > MP4_FRAG_MAX ) {
+      LOG(2, "mp4", "%s: stream %02x: no samples in %d bytes, dropping them\n", this, stream & 0xFF, MP4_FRAG_MAX);
+      t->es.len = t->scan = t->au_at = 0;
+      t->cfg_at = -1;
+      t->au_pic = 0;
+   }
+   mp4_put(&t->es, p, n);
+
+   if ( t->kind == MP4_VIDEO )
+      mp4_video(mp4, t, 0);
+   else
+      mp4_audio(mp4, t);
+}
+
+/*
+ * the mpeg is all written: the last samples, and close up
+ */
+void mp4_finish(mp4_type *mp4) {
+   mp4_track_type *t;
+   int d;
+
+   for (t = mp4->trk; t < mp4->trk + mp4->ntrk; t++) {
+      if ( t->kind == MP4_VIDEO && mp4->started >= 0 )
+         mp4_video(mp4, t, 1);
+   }
+   if ( mp4->started >= 0 )
+      mp4_flush(mp4);
+
+   for (d = 0; d < mp4->nout; d++) {
+      if ( mp4->fp[d] && fclose(mp4->fp[d]) != 0 )
+         fprintf(stderr, "%s: WARNING: unable to write mp4 next to %s: %s\n", this, mp4->out[d].fname, strerror(errno));
+      mp4->fp[d] = NULL;
+   }
+   if ( mp4->started > 0 )
+      LOG(2, "mp4", "%s: mp4: %d track(s), %u fragments\n", this, mp4->ntrk, mp4->seq);
+   for (t = mp4->trk; t < mp4->trk + mp4->ntrk; t++) {
+      free(t->es.p);
+      free(t->data.p);
+      free(t->smp);
+      free(t->config.p);
+   }
+}
+
+/*
+ * the track for stream, NULL if it can't have one
+ */
+static mp4_track_type * mp4_track(mp4_type *mp4, int stream) {
+   mp4_track_type *t;
+   int kind;
+
+   for (t = mp4->trk; t < mp4->trk + mp4->ntrk; t++) {
+      if ( t->stream == stream )
+         return t;
+   }
+   if ( stream < 0x100 && (stream & 0xF0) == 0xE0 )
+      kind = MP4_VIDEO;
+   else if ( stream < 0x100 && (stream & 0xE0) == 0xC0 )
+      kind = MP4_MPA;
+   else if ( (stream & 0xFF8) == 0x180 )
+      kind = MP4_AC3;
+   else
+      return NULL;   /* DTS, LPCM */
+   if ( mp4->started || mp4->ntrk == MP4_MAX_TRACKS )
+      return NULL;
+
+   t = &mp4->trk[mp4->ntrk++];
+   memset(t, 0, sizeof(mp4_track_type));
+   t->stream = stream;
+   t->kind = kind;
+   t->first_pts = -1;
+   t->cfg_at = -1;
+   return t;
+}
+
+/*
+ * cut the video we have into access units, 01 to 01 like poster_es(). With
+ * last, whatever is left is the last one.
+ */
+static void mp4_video(mp4_type *mp4, mp4_track_type *t, int last) {
+   /* timescale and frame duration for each frame rate code */
+   static const unsigned int rates[9][2] = {
+      { 0, 0 }, { 24000, 1001 }, { 90000, 3750 }, { 90000, 3600 }, { 30000, 1001 },
+      { 90000, 3000 }, { 90000, 1800 }, { 60000, 1001 }, { 90000, 1500 }
+   };
+   unsigned char *b = t->es.p, *q, *c;
+   size_t i, keep;
+   int cts;
+
+   for (q = b + t->scan + 2; q + 4 <= b + t->es.len && (q = memchr(q, 0x01, b + t->es.len - 3 - q)) != NULL; q++) {
+      if ( q[-1] != 0x00 || q[-2] != 0x00 )
+         continue;
+      i = q - 2 - b;
+
+      /* the first sequence header, with its extensions, describes the track */
+      if ( t->cfg_at >= 0 && q[1] != 0xB5 && q[1] != 0xB2 ) {
+         mp4_put(&t->config, b + t->cfg_at, i - t->cfg_at);
+         c = t->config.p;
+         if ( t->config.len >= 12 && (c[7] & 0x0F) < 9 && rates[c[7] & 0x0F][0] ) {
+            t->timescale = rates[c[7] & 0x0F][0];
+            t->dur = rates[c[7] & 0x0F][1];
+            t->ok = 1;
+         }
+         t->cfg_at = -1;
+      }
+      if ( q[1] == 0xB3 && t->config.len == 0 && t->cfg_at < 0 )
+         t->cfg_at = i;
+
+      /* an access unit runs up to the next picture, or the headers before it */
+      if ( (q[1] == 0x00 || q[1] == 0xB3 || q[1] == 0xB8) && t->au_pic ) {
+         if ( t->ok && (t->synced || t->au_type == 1) ) {
+            t->synced = 1;
+            cts = (int) (t->gop_base + t->au_tref - t->decoded) * (int) t->dur;
+            mp4_sample(mp4, t, b + t->au_at, i - t->au_at, t->au_type == 1 ? 0x02000000 : 0x01010000, cts);
+            t->decoded++;
+         }
+         t->au_at = i;
+         t->au_pic = 0;
+
+         /* and a new GOP starts a new fragment */
+         if ( q[1] != 0x00 && t->nsmp > 0 )
+            mp4_flush(mp4);
+      }
+
+      if ( q[1] == 0xB8 )
+         t->gop_base = t->decoded;
+      else if ( q[1] == 0x00 ) {
+         t->au_pic = 1;
+         t->au_tref = (q[2] << 2) | (q[3] >> 6);
+         t->au_type = (q[3] >> 3) & 0x07;
+      }
+   }
+
+   if ( last && t->au_pic && t->ok && t->synced ) {
+      cts = (int) (t->gop_base + t->au_tref - t->decoded) * (int) t->dur;
+      mp4_sample(mp4, t, b + t->au_at, t->es.len - t->au_at, t->au_type == 1 ? 0x02000000 : 0x01010000, cts);
+      t->decoded++;
+      t->au_pic = 0;
+   }
+
+   /* let go of everything we are sure we won't need */
+   t->scan = t->es.len > 5 ? t->es.len - 5 : 0;
+   keep = t->scan;
+   if ( (size_t) t->au_at < keep )
+      keep = t->au_at;
+   if ( t->cfg_at >= 0 && (size_t) t->cfg_at < keep )
+      keep = t->cfg_at;
+   if ( keep > 0 ) {
+      memmove(b, b + keep, t->es.len - keep);
+      t->es.len -= keep;
+      t->scan -= keep;
+      t->au_at -= keep;
+      if ( t->cfg_at >= 0 )
+         t->cfg_at -= keep;
+   }
+}
+
+/*
+ * cut the audio we have into frames
+ */
+static void mp4_audio(mp4_type *mp4, mp4_track_type *t) {
+   unsigned char *b = t->es.p;
+   size_t i = 0;
+   int n;
+
+   while ( i + 8 <= t->es.len ) {
+      n = t->kind == MP4_AC3 ? ac3_frame(t, b + i) : mpa_frame(t, b + i);
+      if ( n <= 0 ) {
+         i++;   /* not a frame header, look for the next */
+         continue;
+      }
+      if ( i + n > t->es.len )
+         break;
+      mp4_sample(mp4, t, b + i, n, 0x02000000, 0);
+      i += n;
+   }
+   memmove(b, b + i, t->es.len - i);
+   t->es.len -= i;
+}
+
+/*
+ * Length of the MPEG-1 audio frame with the header at h, 0 if it isn't
+ * one. The first one describes the track.
+ *
+ * | sync (12) | id | layer (2) | prot | bitrate (4) | rate (2) | pad | priv | mode (2) | ...
+ */
+static int mpa_frame(mp4_track_type *t, unsigned char *h) {
+   static const int kbps[3][15] = {
+      { 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
+      { 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384 },
+      { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 }
+   };
+   static const int rates[3] = { 44100, 48000, 32000 };
+   int layer, br, sr, pad;
+
+   if ( h[0] != 0xFF || (h[1] & 0xF8) != 0xF8 || (h[1] & 0x06) == 0 )
+      return 0;
+   layer = 4 - ((h[1] >> 1) & 0x03);
+   br = h[2] >> 4;
+   sr = (h[2] >> 2) & 0x03;
+   pad = (h[2] >> 1) & 0x01;
+   if ( br == 0 || br == 15 || sr == 3 )
+      return 0;
+
+   if ( !t->ok ) {
+      t->rate = t->timescale = rates[sr];
+      t->channels = (h[3] >> 6) == 3 ? 1 : 2;
+      t->dur = layer == 1 ? 384 : 1152;
+      t->ok = 1;
+   }
+   if ( layer == 1 )
+      return (12 * kbps[0][br] * 1000 / rates[sr] + pad) * 4;
+   return 144 * kbps[layer - 1][br] * 1000 / rates[sr] + pad;
+}
+
+/*
+ * Length of the AC-3 frame with the header at h, 0 if it isn't one. The
+ * first one describes the track, and gives us its dac3.
+ *
+ * | 0B 77 | crc (2) | fscod (2) frmsizecod (6) | bsid (5) bsmod (3) | acmod (3) ... lfeon
+ */
+static int ac3_frame(mp4_track_type *t, unsigned char *h) {
+   static const int kbps[19] = { 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512, 576, 640 };
+   static const int rates[3] = { 48000, 44100, 32000 };
+   static const int nchan[8] = { 2, 1, 2, 3, 3, 4, 4, 5 };
+   int fscod, code, acmod, bits, lfeon, words;
+   unsigned int v;
+
+   if ( h[0] != 0x0B || h[1] != 0x77 )
+      return 0;
+   fscod = h[4] >> 6;
+   code = h[4] & 0x3F;
+   if ( fscod == 3 || code >= 38 )
+      return 0;
+   words = kbps[code / 2] * 96000 / rates[fscod] + (fscod == 1 ? code & 1 : 0);
+
+   if ( !t->ok ) {
+      acmod = h[6] >> 5;
+      bits = 3;   /* acmod, then the mix levels it has, then lfeon */
+      if ( (acmod & 1) && acmod != 1 )
+         bits += 2;
+      if ( acmod & 4 )
+         bits += 2;
+      if ( acmod == 2 )
+         bits += 2;
+      lfeon = (((h[6] << 8) | h[7]) >> (15 - bits)) & 1;
+      v = (fscod << 22) | ((h[5] >> 3) << 17) | ((h[5] & 0x07) << 14) | (acmod << 11) | (lfeon << 10) | ((code / 2) << 5);
+      mp4_u8(&t->config, v >> 16);
+      mp4_u8(&t->config, v >> 8);
+      mp4_u8(&t->config, v);
+      t->rate = t->timescale = rates[fscod];
+      t->channels = nchan[acmod] + lfeon;
+      t->dur = 1536;
+      t->ok = 1;
+   }
+   return words * 2;
+}
+
+/*
+ * one more sample for the fragment in hand
+ */
+static void mp4_sample(mp4_type *mp4, mp4_track_type *t, unsigned char *p, size_t n, unsigned int flags, int cts) {
+   mp4_sample_type *s;
+
+   if ( mp4->started && !t->id )
+      return;   /* came along after the moov */
+   if ( t->nsmp == t->smp_size ) {
+      t->smp_size = t->smp_size ? t->smp_size * 2 : 64;
+      t->smp = (mp4_sample_type *) myrealloc(t->smp, t->smp_size * sizeof(mp4_sample_type));
+   }
+   if ( !mp4->started && t->nsmp == 0 )
+      t->first_cts = cts;
+   s = &t->smp[t->nsmp++];
+   s->size = n;
+   s->duration = t->dur;
+   s->flags = flags;
+   s->cts = cts;
+   mp4_put(&t->data, p, n);
+   if ( (mp4->held += n) > MP4_FRAG_MAX )
+      mp4_flush(mp4);
+}
+
+/*
+ * write out a moof and mdat with every track's samples so far
+ */
+static void mp4_flush(mp4_type *mp4) {
+   mp4_buf_type b = { NULL, 0, 0 };
+   mp4_track_type *t;
+   size_t moof, traf, at, off[MP4_MAX_TRACKS];
+   unsigned long long data = 0;
+   unsigned char mdat[8];
+   int k, i;
+
+   if ( mp4->started < 0 || (!mp4->started && !mp4_start(mp4)) )
+      return;
+
+   moof = mp4_box(&b, "moof");
+   at = mp4_full(&b, "mfhd", 0, 0);
+   mp4_u32(&b, mp4->seq + 1);
+   mp4_end(&b, at);
+   for (k = 0; k < mp4->ntrk; k++) {
+      t = &mp4->trk[k];
+      off[k] = 0;
+      if ( !t->id || !t->nsmp )
+         continue;
+      traf = mp4_box(&b, "traf");
+      at = mp4_full(&b, "tfhd", 0, 0x020000);     /* default-base-is-moof */
+      mp4_u32(&b, t->id);
+      mp4_end(&b, at);
+      at = mp4_full(&b, "tfdt", 1, 0);
+      mp4_u64(&b, t->dts);
+      mp4_end(&b, at);
+      at = mp4_full(&b, "trun", 1, 0x000F01);     /* data offset, and all four per sample */
+      mp4_u32(&b, t->nsmp);
+      off[k] = b.len;
+      mp4_u32(&b, 0);
+      for (i = 0; i < t->nsmp; i++) {
+         mp4_u32(&b, t->smp[i].duration);
+         mp4_u32(&b, t->smp[i].size);
+         mp4_u32(&b, t->smp[i].flags);
+         mp4_u32(&b, (unsigned int) t->smp[i].cts);
+         t->dts += t->smp[i].duration;
+      }
+      mp4_end(&b, at);
+      mp4_end(&b, traf);
+   }
+   mp4_end(&b, moof);
+
+   /* now we know where each track's samples will be */
+   for (k = 0; k < mp4->ntrk; k++) {
+      if ( !off[k] )
+         continue;
+      at = b.len;
+      b.len = off[k];
+      mp4_u32(&b, at + 8 + data);
+      b.len = at;
+      data += mp4->trk[k].data.len;
+   }
+
+   if ( data > 0 ) {
+      mp4->seq++;
+      mdat[0] = (8 + data) >> 24;
+      mdat[1] = (8 + data) >> 16;
+      mdat[2] = (8 + data) >> 8;
+      mdat[3] = 8 + data;
+      memcpy(mdat + 4, "mdat", 4);
+      mp4_write(mp4, b.p, b.len);
+      mp4_write(mp4, mdat, 8);
+      for (k = 0; k < mp4->ntrk; k++) {
+         if ( off[k] )
+            mp4_write(mp4, mp4->trk[k].data.p, mp4->trk[k].data.len);
+      }
+   }
+   for (k = 0; k < mp4->ntrk; k++) {
+      mp4->trk[k].nsmp = 0;
+      mp4->trk[k].data.len = 0;
+   }
+   mp4->held = 0;
+   free(b.p);
+
+   /* so what is there so far can be played */
+   for (k = 0; k < mp4->nout; k++) {
+      if ( mp4->fp[k] && fflush(mp4->fp[k]) != 0 ) {
+         fprintf(stderr, "%s: WARNING: unable to write mp4 next to %s: %s\n", this, mp4->out[k].fname, strerror(errno));
+         fclose(mp4->fp[k]);
+         mp4->fp[k] = NULL;
+      }
+   }
+}
+
+/*
+ * Open the mp4s and write the ftyp and moov, with a track for every stream
+ * we know enough about, and have samples of, by now. Returns 0 (and gives
+ * up on the mp4) if there are none.
+ */
+static int mp4_start(mp4_type *mp4) {
+   static const unsigned int matrix[9] = { 0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000 };
+   mp4_buf_type b = { NULL, 0, 0 };
+   mp4_track_type *t;
+   char fname[MAX_PATH_LEN];
+   long long zero = -1, z;
+   size_t moov, mvex, at;
+   int d, len, ntrk = 0, i;
+
+   for (t = mp4->trk; t < mp4->trk + mp4->ntrk; t++) {
+      if ( t->ok && t->nsmp > 0 )
+         t->id = ++ntrk;
+   }
+   if ( ntrk == 0 ) {
+      fprintf(stderr, "%s: WARNING: no video or audio we can put in an mp4\n", this);
+      mp4->started = -1;
+      return 0;
+   }
+
+   /* line the tracks up by their first PTS, if they all have one */
+   for (t = mp4->trk; t < mp4->trk + mp4->ntrk; t++) {
+      if ( !t->id )
+         continue;
+      if ( t->first_pts < 0 ) {
+         zero = -1;
+         break;
+      }
+      z = t->first_pts - (long long) t->first_cts * 90000 / t->timescale;
+      if ( zero < 0 || z < zero )
+         zero = z;
+   }
+   for (t = mp4->trk; t < mp4->trk + mp4->ntrk && zero >= 0; t++) {
+      if ( t->id )
+         t->dts = (t->first_pts - (long long) t->first_cts * 90000 / t->timescale - zero) * t->timescale / 90000;
+   }
+
+   /* one next to each mpeg */
+   for (d = 0; d < mp4->nout; d++) {
+      mp4->fp[d] = NULL;
+      if ( mp4->out[d].failed || mp4->out[d].stream )
+         continue;
+      len = strlen(mp4->out[d].fname) - 5;
+      sprintf(fname, "%.*s.mp4", len, mp4->out[d].fname);
+      if ( noclobber && file_exists(fname) ) {
+         LOG(2, "mp4", "%s: %s exists, skipping\n", this, fname);
+         continue;
+      }
+      LOG(2, "mp4", "%s: writing %s\n", this, fname);
+      if ( (mp4->fp[d] = fopen(fname, "wb")) == NULL ) {
+         fprintf(stderr, "%s: WARNING: unable to open mp4 %s\n", this, fname);
+         perror(fname);
+      }
+   }
+
+   at = mp4_box(&b, "ftyp");
+   mp4_put(&b, "isom", 4);
+   mp4_u32(&b, 0x200);
+   mp4_put(&b, "isomiso6mp41", 12);
+   mp4_end(&b, at);
+
+   moov = mp4_box(&b, "moov");
+   at = mp4_full(&b, "mvhd", 0, 0);
+   mp4_u32(&b, 0);                  /* creation, modification time */
+   mp4_u32(&b, 0);
+   mp4_u32(&b, 1000);               /* timescale */
+   mp4_u32(&b, 0);                  /* duration: it's all in the fragments */
+   mp4_u32(&b, 0x00010000);         /* rate 1.0 */
+   mp4_u16(&b, 0x0100);             /* volume 1.0 */
+   mp4_u16(&b, 0);
+   mp4_u64(&b, 0);
+   for (i = 0; i < 9; i++)
+      mp4_u32(&b, matrix[i]);
+   for (i = 0; i < 6; i++)
+      mp4_u32(&b, 0);
+   mp4_u32(&b, ntrk + 1);           /* next track_ID */
+   mp4_end(&b, at);
+
+   for (t = mp4->trk; t < mp4->trk + mp4->ntrk; t++) {
+      if ( t->id )
+         mp4_trak(&b, t);
+   }
+
+   mvex = mp4_box(&b, "mvex");
+   for (t = mp4->trk; t < mp4->trk + mp4->ntrk; t++) {
+      if ( !t->id )
+         continue;
+      at = mp4_full(&b, "trex", 0, 0);
+      mp4_u32(&b, t->id);
+      mp4_u32(&b, 1);               /* sample description */
+      mp4_u32(&b, 0);               /* default duration, size, flags: trun has them */
+      mp4_u32(&b, 0);
+      mp4_u32(&b, 0);
+      mp4_end(&b, at);
+   }
+   mp4_end(&b, mvex);
+   mp4_end(&b, moov);
+
+   mp4->started = 1;
+   mp4_write(mp4, b.p, b.len);
+   free(b.p);
+   return 1;
+}
+
+/*
+ * the trak box for t, with its sample description and empty sample tables
+ */
+static void mp4_trak(mp4_buf_type *b, mp4_track_type *t) {
+   static const unsigned int matrix[9] = { 0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000 };
+   static const int dar[5][2] = { { 1, 1 }, { 1, 1 }, { 4, 3 }, { 16, 9 }, { 221, 100 } };
+   static const unsigned char zero[32] = { 0 };
+   unsigned char *c = t->config.p, *e;
+   size_t trak, mdia, minf, stbl, stsd, entry, at, sub, esd, dcd;
+   int video = t->kind == MP4_VIDEO, width = 0, height = 0, ph = 1, pv = 1, oti = 0x6B, pl, x, y, i;
+
+   if ( video ) {
+      width = (c[4] << 4) | (c[5] >> 4);
+      height = ((c[5] & 0x0F) << 8) | c[6];
+
+      /* MPEG-2 has a sequence extension: profile, and aspect ratio is of the display */
+      oti = 0x6A;
+      for (e = c + 12; e + 6 <= c + t->config.len; e++) {
+         if ( e[0] == 0x00 && e[1] == 0x00 && e[2] == 0x01 && e[3] == 0xB5 && (e[4] >> 4) == 1 ) {
+            pl = ((e[4] & 0x0F) << 4) | (e[5] >> 4);
+            oti = (pl & 0x80) ? 0x65 : ((pl >> 4) & 0x07) >= 1 && ((pl >> 4) & 0x07) <= 5 ? 0x65 - ((pl >> 4) & 0x07) : 0x61;
+            if ( (c[7] >> 4) >= 2 && (c[7] >> 4) <= 4 && width && height ) {
+               ph = dar[c[7] >> 4][0] * height;
+               pv = dar[c[7] >> 4][1] * width;
+               for (x = ph, y = pv; y; i = x % y, x = y, y = i)
+                  ;
+               ph /= x;
+               pv /= x;
+            }
+            break;
+         }
+      }
+   }
+
+   trak = mp4_box(b, "trak");
+   at = mp4_full(b, "tkhd", 0, 0x000007);       /* enabled, in movie, in preview */
+   mp4_u32(b, 0);
+   mp4_u32(b, 0);
+   mp4_u32(b, t->id);
+   mp4_u32(b, 0);
+   mp4_u32(b, 0);                               /* duration */
+   mp4_u64(b, 0);
+   mp4_u16(b, 0);                               /* layer */
+   mp4_u16(b, 0);                               /* alternate group */
+   mp4_u16(b, video ? 0 : 0x0100);              /* volume */
+   mp4_u16(b, 0);
+   for (i = 0; i < 9; i++)
+      mp4_u32(b, matrix[i]);
+   mp4_u32(b, video ? (unsigned int) ((long long) width * ph / pv) << 16 : 0);
+   mp4_u32(b, video ? (unsigned int) height << 16 : 0);
+   mp4_end(b, at);
+
+   mdia = mp4_box(b, "mdia");
+   at = mp4_full(b, "mdhd", 0, 0);
+   mp4_u32(b, 0);
+   mp4_u32(b, 0);
+   mp4_u32(b, t->timescale);
+   mp4_u32(b, 0);
+   mp4_u16(b, 0x55C4);                          /* "und" */
+   mp4_u16(b, 0);
+   mp4_end(b, at);
+   at = mp4_full(b, "hdlr", 0, 0);
+   mp4_u32(b, 0);
+   mp4_put(b, video ? "vide" : "soun", 4);
+   mp4_put(b, zero, 12);
+   mp4_put(b, video ? "VideoHandler" : "SoundHandler", 13);
+   mp4_end(b, at);
+
+   minf = mp4_box(b, "minf");
+   if ( video ) {
+      at = mp4_full(b, "vmhd", 0, 1);
+      mp4_put(b, zero, 8);
+   }
+   else {
+      at = mp4_full(b, "smhd", 0, 0);
+      mp4_put(b, zero, 4);
+   }
+   mp4_end(b, at);
+   at = mp4_box(b, "dinf");
+   sub = mp4_full(b, "dref", 0, 0);
+   mp4_u32(b, 1);
+   mp4_end(b, mp4_full(b, "url ", 0, 1));       /* samples are in this file */
+   mp4_end(b, sub);
+   mp4_end(b, at);
+
+   stbl = mp4_box(b, "stbl");
+   stsd = mp4_full(b, "stsd", 0, 0);
+   mp4_u32(b, 1);
+   entry = mp4_box(b, video ? "mp4v" : t->kind == MP4_AC3 ? "ac-3" : "mp4a");
+   mp4_put(b, zero, 6);
+   mp4_u16(b, 1);                               /* data reference */
+   if ( video ) {
+      mp4_put(b, zero, 16);
+      mp4_u16(b, width);
+      mp4_u16(b, height);
+      mp4_u32(b, 0x00480000);                   /* 72 dpi */
+      mp4_u32(b, 0x00480000);
+      mp4_u32(b, 0);
+      mp4_u16(b, 1);                            /* frames per sample */
+      mp4_put(b, zero, 32);                     /* compressor name */
+      mp4_u16(b, 0x0018);                       /* depth */
+      mp4_u16(b, 0xFFFF);
+   }
+   else {
+      mp4_put(b, zero, 8);
+      mp4_u16(b, t->kind == MP4_AC3 ? 2 : t->channels);
+      mp4_u16(b, 16);                           /* sample size */
+      mp4_put(b, zero, 4);
+      mp4_u32(b, (unsigned int) t->rate << 16);
+   }
+   if ( t->kind == MP4_AC3 ) {
+      at = mp4_box(b, "dac3");
+      mp4_put(b, t->config.p, t->config.len);
+      mp4_end(b, at);
+   }
+   else {
+      /* ES descriptor: decoder config (video: with the sequence header), SL config */
+      at = mp4_full(b, "esds", 0, 0);
+      esd = mp4_desc(b, 0x03);
+      mp4_u16(b, t->id);
+      mp4_u8(b, 0);
+      dcd = mp4_desc(b, 0x04);
+      mp4_u8(b, oti);
+      mp4_u8(b, ((video ? 0x04 : 0x05) << 2) | 1);
+      mp4_put(b, zero, 11);                     /* buffer size, max and average bitrate */
+      if ( video ) {
+         sub = mp4_desc(b, 0x05);
+         mp4_put(b, t->config.p, t->config.len);
+         mp4_desc_end(b, sub);
+      }
+      mp4_desc_end(b, dcd);
+      sub = mp4_desc(b, 0x06);
+      mp4_u8(b, 0x02);
+      mp4_desc_end(b, sub);
+      mp4_desc_end(b, esd);
+      mp4_end(b, at);
+   }
+   if ( video && ph != pv ) {
+      at = mp4_box(b, "pasp");
+      mp4_u32(b, ph);
+      mp4_u32(b, pv);
+      mp4_end(b, at);
+   }
+   mp4_end(b, entry);
+   mp4_end(b, stsd);
+
+   /* no samples here, they are all in the fragments */
+   at = mp4_full(b, "stts", 0, 0);
+   mp4_u32(b, 0);
+   mp4_end(b, at);
+   at = mp4_full(b, "stsc", 0, 0);
+   mp4_u32(b, 0);
+   mp4_end(b, at);
+   at = mp4_full(b, "stsz", 0, 0);
+   mp4_u64(b, 0);
+   mp4_end(b, at);
+   at = mp4_full(b, "stco", 0, 0);
+   mp4_u32(b, 0);
+   mp4_end(b, at);
+   mp4_end(b, stbl);
+   mp4_end(b, minf);
+   mp4_end(b, mdia);
+   mp4_end(b, trak);
+}
+
+/*
+ * to every mp4 we have open; one we can't write to we stop writing to
+ */
+static void mp4_write(mp4_type *mp4, void *p, size_t n) {
+   int d;
+
+   for (d = 0; d < mp4->nout; d++) {
+      if ( !mp4->fp[d] )
+         continue;
+      throttle_io(THROTTLE_WRITE, n);
+      if ( fwrite(p, 1, n, mp4->fp[d]) != n ) {
+         fprintf(stderr, "%s: WARNING: unable to write mp4 next to %s: %s\n", this, mp4->out[d].fname, strerror(errno));
+         fclose(mp4->fp[d]);
+         mp4->fp[d] = NULL;
+      }
+   }
+}
+
+/*
+ * building boxes: big endian, sizes filled in by mp4_end() once we know them
+ */
+static void mp4_put(mp4_buf_type *b, const void *p, size_t n) {
+   if ( b->len + n > b->size ) {
+      b->size = (b->len + n) * 2;
+      b->p = (unsigned char *) myrealloc(b->p, b->size);
+   }
+   memcpy(b->p + b->len, p, n);
+   b->len += n;
+}
+
+static void mp4_u8(mp4_buf_type *b, unsigned int v) {
+   unsigned char c = v;
+
+   mp4_put(b, &c, 1);
+}
+
+static void mp4_u16(mp4_buf_type *b, unsigned int v) {
+   unsigned char c[2] = { v >> 8, v };
+
+   mp4_put(b, c, 2);
+}
+
+static void mp4_u32(mp4_buf_type *b, unsigned int v) {
+   unsigned char c[4] = { v >> 24, v >> 16, v >> 8, v };
+
+   mp4_put(b, c, 4);
+}
+
+static void mp4_u64(mp4_buf_type *b, unsigned long long v) {
+   mp4_u32(b, v >> 32);
+   mp4_u32(b, v);
+}
+
+static size_t mp4_box(mp4_buf_type *b, const char *type) {
+   size_t at = b->len;
+
+   mp4_u32(b, 0);
+   mp4_put(b, type, 4);
+   return at;
+}
+
+static size_t mp4_full(mp4_buf_type *b, const char *type, int version, unsigned int flags) {
+   size_t at = mp4_box(b, type);
+
+   mp4_u32(b, (version << 24) | flags);
+   return at;
+}
+
+static void mp4_end(mp4_buf_type *b, size_t at) {
+   size_t len = b->len;
+
+   b->len = at;
+   mp4_u32(b, len - at);
+   b->len = len;
+}
+
+/* descriptors (in esds) have a tag and a 7 bits a byte length, 4 bytes of it here */
+static size_t mp4_desc(mp4_buf_type *b, int tag) {
+   size_t at = b->len;
+
+   mp4_u8(b, tag);
+   mp4_u32(b, 0x80808000);
+   return at;
+}
+
+static void mp4_desc_end(mp4_buf_type *b, size_t at) {
+   size_t n = b->len - at - 5;
+
+   b->p[at + 1] = 0x80 | ((n >> 21) & 0x7F);
+   b->p[at + 2] = 0x80 | ((n >> 14) & 0x7F);
+   b->p[at + 3] = 0x80 | ((n >> 7) & 0x7F);
+   b->p[at + 4] = n & 0x7F;
+}
+
+
+/*****************************************************************************
+ * Sharded layout
+ *
+ * With --layout=sharded each mpeg is filed as objects/ab/cd/<key>.mpeg in
+ * the dest dir, where key is 16 hex digits worked out from the clip itself
+ * and ab, cd are its first four. That is at most 65536 directories, none
+ * of them big however many clips go in, and whether a clip is already in
+ * the archive is a couple of fstatat()s on names we know before converting
+ * it. A worker making one holds a flock() on it until it's done (see
+ * shard_claim()), so two given the same clip don't both make it.
+ * The date dirs are still made, holding a relative symlink to each mpeg
+ * and .moi, unless -m; the catalog has the dates either way.
+ *
+ * The key is FNV-1a over the MOI, the MOD's size, and the first and last
+ * SHARD_SAMPLE bytes of the MOD. Hashing every byte would mean reading
+ * the whole MOD to find out we didn't need to, and the MOI already pins
+ * down when the clip was recorded and how long it runs.
+ ****************************************************************************/
+int shard_key(job_type *job, char *key) {
+   unsigned char *buf, size[8];
+   unsigned long long h = HASH_SEED;
+   size_t br;
+   FILE *fp;
+   int i, ok;
+
+   buf = (unsigned char *) mymalloc(SHARD_SAMPLE);
+
+   /* the MOI, all of it */
+   if ( (fp = src_fopen(job->moi_fname)) == NULL ) {
+      fprintf(stderr, "%s: WARNING: cannot read %s for its key\n", this, job->moi_fname);
+      perror(job->moi_fname);
+      free(buf);
+      return 0;
+   }
+   while ( (br = fread(buf, 1, SHARD_SAMPLE, fp)) > 0 ) {
+      throttle_io(THROTTLE_READ, br);
+      h = hash_more(h, buf, br);
+   }
+   ok = !ferror(fp);
+   fclose(fp);
+
+   /* the MOD's size (low byte first, so keys are the same on any machine),
+    * then its ends */
+   for (i = 0; i < 8; i++)
+      size[i] = (unsigned long long) job->mod_size >> (8 * i);
+   h = hash_more(h, size, 8);
+   if ( ok && (fp = src_fopen(job->mod_fname)) != NULL ) {
+      br = fread(buf, 1, SHARD_SAMPLE, fp);
+      throttle_io(THROTTLE_READ, br);
+      h = hash_more(h, buf, br);
+      if ( job->mod_size > 2 * SHARD_SAMPLE && fseeko(fp, job->mod_size - SHARD_SAMPLE, SEEK_SET) < 0 )
+         ok = 0;
+      while ( ok && (br = fread(buf, 1, SHARD_SAMPLE, fp)) > 0 ) {
+         throttle_io(THROTTLE_READ, br);
+         h = hash_more(h, buf, br);
+      }
+      ok = ok && !ferror(fp);
+      fclose(fp);
+   }
+   else
+      ok = 0;
+   free(buf);
+
+   if ( !ok ) {
+      fprintf(stderr, "%s: WARNING: cannot read %s for its key\n", this, job->mod_fname);
+      fprintf(stderr, "   skipping...\n");
+      return 0;
+   }
+   sprintf(key, "%016llx", h);
+   LOG(3, "key", "%s:    key %s\n", this, key);
+   return 1;
+}
+
+/*
+ * Is reldir/key.mpeg in dest, and finished: all size bytes of it, and no
+ * checkpoint beside it? One being made has a checkpoint from before it
+ * grows (see process_job()), so this needs no lock.
+ */
+int shard_archived(dest_type *dest, char *reldir, char *key, long long size) {
+   char name[MAX_PATH_LEN];
+   struct stat st;
+
+   sprintf(name, "%s/%s.mpeg", reldir, key);
+   if ( fstatat(dest->dirfd, name, &st, 0) < 0 || st.st_size != size )
+      return 0;
+   sprintf(name, "%s/.%s.mpeg.ckpt", reldir, key);
+   return fstatat(dest->dirfd, name, &st, 0) < 0;
+}
+
+/*
+ * Take reldir/key.mpeg in dest for the job in hand: create it if need be
+ * and flock() it. Returns SHARD_MAKE with the lock held on *lock_fd, for
+ * the caller to close once the mpeg is done and its checkpoint gone;
+ * SHARD_DONE if it turns out to be archived already (unless -c),
+ * SHARD_BUSY if another worker holds the lock, or -1.
+ *
+ * Only the holder decides what a partial mpeg is (one to resume, or to
+ * start over), so a live one is never taken for a partial or a finished
+ * one; and one left empty by a worker that died before its checkpoint
+ * was written is just made again.
+ */
+int shard_claim(dest_type *dest, char *reldir, char *key, long long size, int *lock_fd) {
+   char name[MAX_PATH_LEN];
+   int fd, err;
+
+   *lock_fd = -1;
+   sprintf(name, "%s/%s.mpeg", reldir, key);
+   if ( (fd = openat(dest->dirfd, name, O_RDONLY | O_CREAT, 0666)) < 0 )
+      return -1;
+   if ( flock(fd, LOCK_EX | LOCK_NB) < 0 ) {
+      err = errno;
+      close(fd);
+      errno = err;
+      return errno == EWOULDBLOCK ? SHARD_BUSY : -1;
+   }
+   if ( noclobber && shard_archived(dest, reldir, key, size) ) {
+      close(fd);
+      return SHARD_DONE;
+   }
+   *lock_fd = fd;
+   return SHARD_MAKE;
+}
+
+/*
+ * Link reldir/base.mpeg (or base_01.mpeg...) in dest to the mpeg we made
+ * in objects, and the .moi beside it. The links are relative, so the dest
+ * dir can be moved or copied as a whole.
+ */
+void shard_link(dest_type *dest, char *reldir, char *base, char *mpeg_fname) {
+   char target[MAX_PATH_LEN], name[MAX_PATH_LEN], buf[MAX_PATH_LEN];
+   char *sp;
+   ssize_t len;
+   int funiq;
+
+   /* up out of reldir, then down to the object */
+   target[0] = '\0';
+   for (sp = reldir; sp; sp = strchr(sp + 1, '/'))
+      strcat(target, "../");
+   strcat(target, mpeg_fname + strlen(dest->dir) + 1);
+
+   for (funiq = 0; ; funiq++) {
+      if ( funiq == 0 )
+         sprintf(name, "%s/%s.mpeg", reldir, base);
+      else
+         sprintf(name, "%s/%s_%02d.mpeg", reldir, base, funiq);
+      if ( symlinkat(target, dest->dirfd, name) == 0 )
+         break;
+      if ( errno != EEXIST ) {
+         fprintf(stderr, "%s: WARNING: unable to link %s/%s to %s\n", this, dest->dir, name, target);
+         perror(name);
+         return;
+      }
+      /* linked before, by a run that was stopped or with -c */
+      if ( (len = readlinkat(dest->dirfd, name, buf, sizeof(buf) - 1)) >= 0 ) {
+         buf[len] = '\0';
+         if ( strcmp(buf, target) == 0 )
+            break;
+      }
+   }
+   LOG(2, "link", "%s:    linked %s/%s\n", this, dest->dir, name);
+
+   strcpy(target + strlen(target) - 5, ".moi");
+   strcpy(name + strlen(name) - 5, ".moi");
+   if ( symlinkat(target, dest->dirfd, name) < 0 && errno != EEXIST ) {
+      fprintf(stderr, "%s: WARNING: unable to link %s/%s to %s\n", this, dest->dir, name, target);
+      perror(name);
+   }
+}
+
+
+/*****************************************************************************
+ * Job server
+ *
+ * With --serve=socket moi stays up and takes jobs over a Unix socket,
+ * instead of being started (and checking its destinations, picking a
+ * scanner...) once per clip. A job is one line of options, as on the
+ * command line:
+ *
+ *    -f /card/PRIVATE/MOV001.MOD -d /video --poster
+ *
+ * Words are separated by blanks; "quote" a word with blanks in it, or put
+ * a \ before them. Per job there is -s or -f, and any of -d, -r, -i, -n,
+ * -c, -t, -m, -v, --catalog, --log-format, --poster, --demux, --mp4,
+ * --fix-display, --frame-rate, --in-place and the --no- options; the rest
+ * are the server's, and so are the defaults for those. A job without -d uses the
+ * server's -d. Relative paths are from the server's directory.
+ *
+ * The server starts -j workers that take connections off the socket
+ * between them. A worker runs the jobs on its connection in order, so a
+ * client wanting several at once opens several connections. Each job runs
+ * in a fork of its (warm) worker: the destinations are open, the scanner
+ * is picked, the throttle is shared and the log writer is going, and a job
+ * that fails (most errors exit) takes nothing else with it. What a job
+ * learns on the way goes with it, though: the name indexes and the date
+ * dirs known to exist start out empty for every job, as they would for a
+ * run from the command line. What the job prints, messages and warnings,
+ * comes back down the connection as it happens (with --log-format=kv,
+ * easier to pick apart), and the job's last line is always
+ *
+ *    job=N status=ok|failed exit=E files=F mpegs=M failed=X bytes=B secs=S
+ *
+ * with N counting jobs on the connection from 1. status=failed if the job
+ * exited non-zero or any of its files got no mpeg. SIGTERM or SIGINT
+ * stops the server and removes the socket; jobs already going are
+ * finished. The socket is made under umask 077: a job runs as the
+ * server's user, so only that user may connect.
+ ****************************************************************************/
+void serve() {
+   struct sockaddr_un addr;
+   struct sigaction sa;
+   struct stat st;
+   pid_t *pool, pid;
+   mode_t mask;
+   int lfd, i, status;
+
+   if ( strlen(serve_path) >= sizeof(addr.sun_path) ) {
+      fprintf(stderr, "%s: Error: socket path %s is too long\n", this, serve_path);
+      exit(1);
+   }
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, serve_path);
+   if ( (lfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ) {
+      perror("socket");
+      exit(1);
+   }
+
+   /* a socket left behind by a server that is gone is ours to take */
+   if ( stat(serve_path, &st) == 0 && S_ISSOCK(st.st_mode) ) {
+      if ( connect(lfd, (struct sockaddr *) &addr, sizeof(addr)) == 0 ) {
+         fprintf(stderr, "%s: Error: there is already a server on %s\n", this, serve_path);
+         exit(1);
+      }
+      unlink(serve_path);
+   }
+   mask = umask(077);   /* no window in which anyone else can connect */
+   if ( bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(lfd, SOMAXCONN) < 0 ) {
+      perror(serve_path);
+      exit(1);
+   }
+   umask(mask);
+
+   memset(&sa, 0, sizeof(sa));
+   sigemptyset(&sa.sa_mask);
+   sa.sa_handler = serve_signal;       /* no SA_RESTART: wait() below returns */
+   sigaction(SIGTERM, &sa, NULL);
+   sigaction(SIGINT, &sa, NULL);
+   sa.sa_handler = SIG_IGN;            /* a client that goes away is only an EPIPE */
+   sigaction(SIGPIPE, &sa, NULL);
+
+   LOG(1, "serve", "%s: serving on %s, %d worker(s)\n", this, serve_path, max_workers);
+   pool = (pid_t *) mymalloc(max_workers * sizeof(pid_t));
+   for (i = 0; i < max_workers; i++)
+      pool[i] = 0;
+   fflush(stdout);
+   fflush(stderr);
+
+   /* keep the pool full until we are told to stop */
+   while ( !serve_stop ) {
+      for (i = 0; i < max_workers; i++) {
+         if ( pool[i] > 0 )
+            continue;
+         if ( (pool[i] = fork()) < 0 ) {
+            perror("fork");
+            pool[i] = 0;
+         }
+         else if ( pool[i] == 0 ) {
+#ifdef __linux__
+            prctl(PR_SET_PDEATHSIG, SIGTERM);   /* don't outlive a server killed -9 */
+#endif
+            serve_worker(lfd);
+            exit(0);
+         }
+      }
+      if ( (pid = wait(&status)) < 0 )
+         continue;
+      for (i = 0; i < max_workers; i++) {
+         if ( pool[i] == pid )
+            pool[i] = 0;
+      }
+      if ( !serve_stop ) {
+         fprintf(stderr, "%s: WARNING: worker %d died, starting another\n", this, (int) pid);
+         sleep(1);
+      }
+   }
+
+   for (i = 0; i < max_workers; i++) {
+      if ( pool[i] > 0 )
+         kill(pool[i], SIGTERM);
+   }
+   while ( wait(&status) > 0 || errno == EINTR )
+      ;
+   close(lfd);
+   unlink(serve_path);
+   LOG(1, "serve", "%s: stopped\n", this);
+   exit(0);
+}
+
+static void serve_signal(int sig) {
+   (void) sig;
+   serve_stop = 1;
+}
+
+/*
+ * one of the pool: take a connection, run its jobs, take the next
+ */
+static void serve_worker(int lfd) {
+   char line[SERVE_LINE_MAX];
+   FILE *in;
+   int cfd, n, c;
+
+   job_stats = (serve_stats_type *) mmap(NULL, sizeof(serve_stats_type), PROT_READ | PROT_WRITE,
+         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if ( job_stats == MAP_FAILED ) {
+      perror("mmap");
+      exit(1);
+   }
+   LOG(3, "serve", "%s: worker %d ready\n", this, (int) getpid());
+
+   /* told to stop, we finish the job in hand and go */
+   while ( !serve_stop ) {
+      if ( (cfd = accept(lfd, NULL, NULL)) < 0 ) {
+         if ( errno == EINTR || errno == ECONNABORTED )
+            continue;
+         perror("accept");
+         exit(1);
+      }
+      if ( (in = fdopen(dup(cfd), "r")) == NULL ) {
+         close(cfd);
+         continue;
+      }
+      LOG(2, "serve", "%s: worker %d: new connection\n", this, (int) getpid());
+      for (n = 0; !serve_stop && fgets(line, sizeof(line), in) != NULL; ) {
+         if ( strchr(line, '\n') == NULL && !feof(in) ) {
+            /* too long to be a job: say so, and skip the rest of it */
+            while ( (c = fgetc(in)) != EOF && c != '\n' )
+               ;
+            dprintf(cfd, "%s: Error: job longer than %d bytes\n", this, SERVE_LINE_MAX);
+            dprintf(cfd, "job=%d status=failed exit=1 files=0 mpegs=0 failed=0 bytes=0 secs=0.000\n", ++n);
+            continue;
+         }
+         chomp(line);
+         if ( line[strspn(line, " \t")] != '\0' )
+            serve_job(cfd, ++n, line);
+      }
+      LOG(2, "serve", "%s: worker %d: connection closed after %d job(s)\n", this, (int) getpid(), n);
+      fclose(in);
+      close(cfd);
+   }
+}
+
+/*
+ * run job n in a fork of ourselves, with its output going to the client,
+ * and tell the client how it went
+ */
+static void serve_job(int cfd, int n, char *line) {
+   long long start = now_ns();
+   int status = 0, code, ok;
+   pid_t pid;
+
+   LOG(2, "serve", "%s: worker %d: job %d: %s\n", this, (int) getpid(), n, line);
+   memset(job_stats, 0, sizeof(serve_stats_type));
+   fflush(stdout);
+   fflush(stderr);
+   if ( (pid = fork()) == 0 ) {
+      if ( dup2(cfd, 1) < 0 || dup2(cfd, 2) < 0 )
+         exit(1);
+      exit(serve_run(line));
+   }
+   if ( pid < 0 )
+      perror("fork");
+   else {
+      while ( waitpid(pid, &status, 0) < 0 && errno == EINTR )
+         ;
+   }
+
+   code = pid < 0 ? -1 : WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+   ok = code == 0 && job_stats->failed == 0;
+   dprintf(cfd, "job=%d status=%s exit=%d files=%d mpegs=%d failed=%d bytes=%lld secs=%.3f\n",
+         n, ok ? "ok" : "failed", code, job_stats->files, job_stats->mpegs, job_stats->failed,
+         job_stats->bytes, (now_ns() - start) / 1e9);
+   LOG(2, "serve", "%s: worker %d: job %d %s, exit %d, %d file(s)\n", this, (int) getpid(), n,
+         ok ? "ok" : "failed", code, job_stats->files);
+}
+
+/*
+ * In the job's own process: take its options on top of the server's, then
+ * queue and run it the way main() would. Returns the exit code.
+ */
+static int serve_run(char *line) {
+   char *argv[SERVE_MAX_ARGS + 2], *src_dir = NULL, *src_file = NULL, *dirs[MAX_DESTS];
+   dest_type known[MAX_DESTS];
+   int argc, c, i, nknown, ndirs = 0, catalog = 0, option_index = 0;
+
+   argv[0] = this;
+   if ( (argc = serve_split(line, argv + 1, SERVE_MAX_ARGS)) < 0 ) {
+      fprintf(stderr, "%s: Error: job has more than %d words, or a quote left open\n", this, SERVE_MAX_ARGS);
+      return 1;
+   }
+   argv[++argc] = NULL;
+
+   optind = 0;   /* getopt_long starts over */
+   while ( (c = getopt_long(argc, argv, "vicmtrnf:s:d:", long_options, &option_index)) != -1 ) {
+      switch(c) {
+         case 0:
+            break;   /* a flag, already set */
+         case 'f':
+            src_file = optarg;
+            break;
+         case 's':
+            src_dir = optarg;
+            break;
+         case 'd':
+            if ( ndirs == MAX_DESTS ) {
+               fprintf(stderr, "%s: Error: at most %d destination directories\n", this, MAX_DESTS);
+               return 1;
+            }
+            dirs[ndirs++] = optarg;
+            break;
+         case 'i':
+            info_only++;
+            break;
+         case 'c':
+            noclobber = 0;
+            break;
+         case 't':
+            date_to_use = MTIME_DATE;
+            break;
+         case 'm':
+            make_dirs = 0;
+            break;
+         case 'r':
+            recursive = 1;
+            break;
+         case 'n':
+            plan_only = 1;
+            break;
+         case 'v':
+            verbose++;
+            break;
+         case 'K':
+            catalog_fname = optarg;
+            catalog = 1;
+            break;
+         case 'L':
+            if ( strcmp(optarg, "text") == 0 )
+               log_format = LOG_TEXT;
+            else if ( strcmp(optarg, "kv") == 0 )
+               log_format = LOG_KV;
+            else {
+               fprintf(stderr, "%s: Error: --log-format must be text or kv\n", this);
+               return 1;
+            }
+            break;
+         case 'I':
+            if ( (poster_nth = optarg ? atoi(optarg) : 1) < 1 ) {
+               fprintf(stderr, "%s: Error: --poster=N counts I-frames from 1\n", this);
+               return 1;
+            }
+            break;
+         case 'P':
+            if ( (frame_rate = parse_frame_rate(optarg)) == 0 ) {
+               fprintf(stderr, "%s: Error: --frame-rate must be 23.976, 24, 25, 29.97, 30, 50, 59.94 or 60\n", this);
+               return 1;
+            }
+            break;
+         case 'G':
+            if ( optarg && strcmp(optarg, "rollback") != 0 ) {
+               fprintf(stderr, "%s: Error: --in-place takes no value, or rollback\n", this);
+               return 1;
+            }
+            in_place = optarg ? IN_PLACE_ROLLBACK : IN_PLACE_FIX;
+            break;
+         case '?':
+            return 1;   /* getopt_long has said why */
+         default:
+            for (i = 0; long_options[i].name && long_options[i].val != c; i++)
+               ;
+            fprintf(stderr, "%s: Error: --%s can't be given per job\n",
+                  this, long_options[i].name ? long_options[i].name : "?");
+            return 1;
+      }
+   }
+   if ( argc > optind ) {
+      fprintf(stderr, "%s: Error: unknown options or extra stuff in the job\n", this);
+      return 1;
+   }
+   if ( !(src_dir || src_file) ) {
+      fprintf(stderr, "%s: Error: a job needs -s or -f\n", this);
+      return 1;
+   }
+
+   /* the job's own destinations, if it has any */
+   if ( in_place || info_only ) {
+      if ( in_place && ndirs ) {
+         fprintf(stderr, "%s: Error: --in-place patches the files themselves, no -d\n", this);
+         return 1;
+      }
+      ndests = 0;
+   }
+   else if ( ndirs ) {
+      memcpy(known, dests, ndests * sizeof(dest_type));
+      nknown = ndests;
+      for (ndests = 0, i = 0; i < ndirs; i++) {
+         if ( !serve_dest(dirs[i], known, nknown) )
+            return 1;
+      }
+      if ( !use_catalog )
+         catalog_fname = NULL;
+      else if ( !catalog ) {
+         catalog_fname = (char *) mymalloc(strlen(dests[0].dir) + strlen(CATALOG_NAME) + 2);
+         sprintf(catalog_fname, "%s/%s", dests[0].dir, CATALOG_NAME);
+      }
+   }
+   else if ( !ndests ) {
+      fprintf(stderr, "%s: Error: no -d, in the job or on the server's command line\n", this);
+      return 1;
+   }
+   else if ( !use_catalog )
+      catalog_fname = NULL;
+
+   /* the pool is what runs jobs side by side */
+   max_workers = 1;
+   queue_sources(src_dir, src_file);
+   if ( src_file && !info_only && njobs == 0 ) {
+      fprintf(stderr, "%s: Error: no MOD/MOI pair to convert at %s\n", this, src_file);
+      return 1;
+   }
+   run_jobs();
+   return 0;
+}
+
+/*
+ * Split a job line into words, in place: blanks between words, "..." to
+ * keep blanks in one, and \ to take the next character as it is. Returns
+ * how many, or -1 if more than max or a quote is left open.
+ */
+static int serve_split(char *line, char **argv, int max) {
+   char *p = line, *w;
+   int n = 0, quote;
+
+   for (;;) {
+      p += strspn(p, " \t");
+      if ( *p == '\0' )
+         return n;
+      if ( n == max )
+         return -1;
+      argv[n++] = w = p;
+      for (quote = 0; *p && (quote || (*p != ' ' && *p != '\t')); p++) {
+         if ( *p == '"' )
+            quote = !quote;
+         else if ( *p == '\\' && p[1] )
+            *w++ = *++p;
+         else
+            *w++ = *p;
+      }
+      if ( quote )
+         return -1;
+      if ( *p )
+         p++;
+      *w = '\0';
+   }
+}
+
+/*
+ * A job's -d: one of the server's own if it names one of those (already
+ * open, and its date directories known), otherwise checked and opened as
+ * on the command line.
+ */
+static int serve_dest(char *dir, dest_type *known, int nknown) {
+   size_t len = strlen(dir);
+   int i;
+
+   while ( len > 1 && dir[len - 1] == '/' )
+      len--;
+   for (i = 0; i < nknown; i++) {
+      if ( strlen(known[i].dir) == len && strncmp(known[i].dir, dir, len) == 0 ) {
+         dests[ndests++] = known[i];
+         return 1;
+      }
+   }
+   return add_dest(dir);
+}
+
+/*
+ * count a MOD file for --progress, and for the job's status line with
+ * --serve
+ */
+static void count_job(job_type *job, int ok) {
+   progress_job(job);
+   if ( !job_stats )
+      return;
+   job_stats->files++;
+   job_stats->mpegs += ok;
+   if ( !ok )
+      job_stats->failed++;
+   job_stats->bytes += job->mod_size;
+}
+
+
+/*****************************************************************************
+ * Progress
+ *
+ * --progress counts what every worker reads in its own slot of shared
+ * memory, one add per block, and a thread in the parent adds the slots up
+ * every so often: a status line redrawn on stderr when that is a terminal,
+ * otherwise a log line of key=value pairs. Percent done and the ETA go by
+ * bytes, out of the sizes of all the MODs and MOIs planned; a job that
+ * reads less than that (skipped, resumed, failed) makes up the rest when
+ * it ends, so the count reaches the total. The ETA uses the rate since
+ * the start, which a resumed or skipped job doesn't inflate.
+ ****************************************************************************/
+void progress_start() {
+   size_t len;
+   int i, err;
+
+   len = sizeof(progress_type) + max_workers * sizeof(progress_slot_type);
+   progress = (progress_type *) mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if ( progress == MAP_FAILED ) {
+      perror("mmap");
+      exit(1);
+   }
+   memset(progress, 0, len);
+   progress->slots = (progress_slot_type *) (progress + 1);
+   progress->nslots = max_workers;
+   progress->nfiles = njobs;
+   for (i = 0; i < njobs; i++)
+      progress->total += jobs[i].mod_size + jobs[i].moi_size;
+   progress->start = now_ns();
+
+   if ( (err = pthread_create(&progress_thread, NULL, progress_main, NULL)) != 0 ) {
+      fprintf(stderr, "%s: WARNING: no --progress: %s\n", this, strerror(err));
+      munmap(progress, len);
+      progress = NULL;
+   }
+}
+
+/* stop the thread and report where we ended up */
+void progress_end() {
+   if ( !progress )
+      return;
+   pthread_mutex_lock(&progress_lock);
+   progress_stop = 1;
+   pthread_cond_signal(&progress_wake);
+   pthread_mutex_unlock(&progress_lock);
+   pthread_join(progress_thread, NULL);
+}
+
+static void progress_read(size_t n) {
+   progress_slot_type *sl;
+
+   if ( !progress )
+      return;
+   sl = &progress->slots[progress_slot];
+   sl->job_read += n;
+   __atomic_add_fetch(&sl->read, n, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&sl->done, n, __ATOMIC_RELAXED);
+}
+
+/* a job is over: whatever of it wasn't read counts as done */
+static void progress_job(job_type *job) {
+   progress_slot_type *sl;
+   long long rest;
+
+   if ( !progress )
+      return;
+   sl = &progress->slots[progress_slot];
+   if ( (rest = job->mod_size + job->moi_size - sl->job_read) > 0 )
+      __atomic_add_fetch(&sl->done, rest, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&sl->files, 1, __ATOMIC_RELAXED);
+   sl->job_read = 0;
+}
+
+static void *progress_main(void *arg) {
+   long long interval = progress_mode == PROGRESS_TTY ? PROGRESS_TTY_NS : PROGRESS_LINES_NS;
+   long long *last, now, then;
+   struct timespec ts;
+   int stop = 0;
+
+   (void) arg;
+
+   /* what each slot had read at the last report */
+   last = (long long *) mymalloc(progress->nslots * sizeof(long long));
+   memset(last, 0, progress->nslots * sizeof(long long));
+
+   then = progress->start;
+   while ( !stop ) {
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += interval / 1000000000LL;
+      if ( (ts.tv_nsec += interval % 1000000000LL) >= 1000000000L ) {
+         ts.tv_sec++;
+         ts.tv_nsec -= 1000000000L;
+      }
+      pthread_mutex_lock(&progress_lock);
+      while ( !progress_stop && pthread_cond_timedwait(&progress_wake, &progress_lock, &ts) != ETIMEDOUT )
+         ;
+      stop = progress_stop;
+      pthread_mutex_unlock(&progress_lock);
+
+      now = now_ns();
+      progress_report(last, now, now - then, stop);
+      then = now;
+   }
+   free(last);
+   return NULL;
+}
+
+/*
+ * One report: the totals, the ETA, and how fast each worker read since the
+ * last one (since ns ago)
+ */
+static void progress_report(long long *last, long long now, long long since, int final) {
+   progress_slot_type *sl;
+   char line[PIPE_BUF], workers[PIPE_BUF / 2], a[16], b[16], c[16];
+   long long read = 0, done = 0, r;
+   double secs, rate, wrate, recent = 0, eta;
+   int i, n = 0, w = 0, files = 0;
+
+   for (i = 0; i < progress->nslots; i++) {
+      sl = &progress->slots[i];
+      r = __atomic_load_n(&sl->read, __ATOMIC_RELAXED);
+      read += r;
+      done += __atomic_load_n(&sl->done, __ATOMIC_RELAXED);
+      files += __atomic_load_n(&sl->files, __ATOMIC_RELAXED);
+
+      wrate = since > 0 ? (r - last[i]) / (since / 1e9) : 0;
+      last[i] = r;
+      recent += wrate;
+      if ( w < (int) sizeof(workers) - 32 ) {
+         if ( progress_mode == PROGRESS_TTY )
+            w += sprintf(workers + w, "%s%s/s", i ? " " : "", size_str(a, wrate));
+         else
+            w += sprintf(workers + w, "%s%.0f", i ? "," : "", wrate);
+      }
+   }
+   if ( done > progress->total )
+      done = progress->total;
+
+   secs = (now - progress->start) / 1e9;
+   rate = secs > 0 ? read / secs : 0;
+   eta = final ? 0 : rate > 0 ? (progress->total - done) / rate : -1;
+
+   if ( progress_mode == PROGRESS_LINES ) {
+      log_msg(0, "progress", "%s: progress: done=%lld total=%lld files=%d/%d rate=%.0f eta=%.0f secs=%.1f workers=%s\n",
+            this, done, progress->total, files, progress->nfiles, rate, eta, secs, workers);
+      return;
+   }
 
+   /* written straight to stderr, as stdio locks don't mix with fork() */
+   n = snprintf(line, sizeof(line), "\r%5.1f%%  %s of %s  %d/%d files  %s/s  ",
+         progress->total ? 100.0 * done / progress->total : 100.0, size_str(a, done), size_str(b, progress->total),
+         files, progress->nfiles, size_str(c, final ? rate : recent));
+   if ( n >= (int) sizeof(line) )
+      n = sizeof(line) - 1;
+   if ( final )
+      n += snprintf(line + n, sizeof(line) - n, "in %d:%02d:%02d\033[K\n", (int) secs / 3600, (int) secs / 60 % 60, (int) secs % 60);
+   else if ( eta < 0 )
+      n += snprintf(line + n, sizeof(line) - n, "ETA --:--  [%s]\033[K", workers);
+   else
+      n += snprintf(line + n, sizeof(line) - n, "ETA %d:%02d:%02d  [%s]\033[K",
+            (int) eta / 3600, (int) eta / 60 % 60, (int) eta % 60, workers);
+   if ( n >= (int) sizeof(line) )
+      n = sizeof(line) - 1;
+   if ( write(2, line, n) < 0 )
+      return;
+}
 
-   //sprintf(mpeg_fname, "%s.mpeg", dest_fname_base);
+/* n bytes as 12.3G, 456.7M and so on, powers of 1024 as for --read-limit */
+static char *size_str(char *s, double n) {
+   if ( n >= 1024.0 * 1024 * 1024 )
+      sprintf(s, "%.1fG", n / (1024.0 * 1024 * 1024));
+   else if ( n >= 1024.0 * 1024 )
+      sprintf(s, "%.1fM", n / (1024.0 * 1024));
+   else if ( n >= 1024.0 )
+      sprintf(s, "%.1fk", n / 1024.0);
+   else
+      sprintf(s, "%.0f", n);
+   return s;
+}
 
-   if ( verbose >= 2 )
-      printf("%s: creating mpeg file %s\n", this, mpeg_fname);
-
-   /* test to see if the file already exists */
-   if ( noclobber ) {
-      if (mpeg = fopen(mpeg_fname, "r")) {
-         fclose(mpeg);
-         if ( verbose >= 1 ) {
-            fprintf(stderr, "   %s exists!\n", mpeg_fname);
-            fprintf(stderr, "   skipping... file exists and noclobber is on\n");
-         }
-         return;
-      }
-   }
 
-   /* open mpeg file */
-   if ( (mpeg = fopen(mpeg_fname, "wb")) == NULL ) {
-      fprintf(stderr, "%s: unable to open %s\n", this, mpeg_fname);
-      perror(mpeg_fname);
+/*****************************************************************************
+ * I/O throttling
+ *
+ * Token buckets for read bytes, write bytes and I/O calls, kept in memory
+ * shared with the -j workers so the limits cover the whole run rather than
+ * each worker. A caller takes what it needs even if that leaves the bucket
+ * in debt, then sleeps the debt off; with several callers the later ones
+ * find more debt and sleep longer. Each bucket holds at most one second's
+ * worth, so an idle spell buys a one second burst and no more.
+ ****************************************************************************/
+void throttle_init() {
+   pthread_mutexattr_t attr;
+   struct sigaction sa;
+   long long now = now_ns();
+
+   throttle = (throttle_type *) mmap(NULL, sizeof(throttle_type), PROT_READ | PROT_WRITE,
+         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if ( throttle == MAP_FAILED ) {
+      perror("mmap");
       exit(1);
    }
-   /* open mod file */
-   if ( (mod = fopen(mod_fname, "rb")) == NULL ) {
-      fprintf(stderr, "%s: unable to open %s\n", this, mod_fname);
-      perror(mod_fname);
-      exit(1);
+   memset(throttle, 0, sizeof(throttle_type));
+   pthread_mutexattr_init(&attr);
+   pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+   pthread_mutex_init(&throttle->lock, &attr);
+   pthread_mutexattr_destroy(&attr);
+
+   bucket_set(&throttle->read, read_limit, now);
+   bucket_set(&throttle->write, write_limit, now);
+   bucket_set(&throttle->ops, iops_limit, now);
+
+   if ( throttle_fname ) {
+      throttle->reload = 1;
+      throttle_load(now);
+
+      /* kill -HUP makes us re-read the control file right away */
+      memset(&sa, 0, sizeof(sa));
+      sa.sa_handler = throttle_sighup;
+      sa.sa_flags = SA_RESTART;
+      sigemptyset(&sa.sa_mask);
+      sigaction(SIGHUP, &sa, NULL);
    }
+}
 
-   /* copy data from mod file to the mpeg file */
-   buf = (char *) mymalloc(RW_BLOCK_SIZE);
+static void throttle_sighup(int sig) {
+   (void) sig;
+   __atomic_store_n(&throttle->reload, 1, __ATOMIC_RELAXED);
+}
 
-   /*
-   while( (br = fread(buf, 1, RW_BLOCK_SIZE, mod)) > 0 ) {
-      bw = fwrite(buf, 1, br, mpeg);
-      if ( bw < 0 || ferror(mpeg) ) {
-         perror("write failed");
-         exit(1);
+/*
+ * Account for one read or write call of n bytes, sleeping if we are over
+ * the limit.
+ */
+void throttle_io(int dir, size_t n) {
+   bucket_type *b;
+   long long now, wait, w;
+   int gen;
+
+   if ( !throttle )
+      return;
+   b = dir == THROTTLE_READ ? &throttle->read : &throttle->write;
+
+   now = now_ns();
+   pthread_mutex_lock(&throttle->lock);
+   throttle_check(now);
+   wait = bucket_take(b, n, now);
+   if ( (w = bucket_take(&throttle->ops, 1, now)) > wait )
+      wait = w;
+   gen = b->gen + throttle->ops.gen;
+   pthread_mutex_unlock(&throttle->lock);
+
+   /* sleep in slices, so a new limit takes effect on a long wait too
+    * (changing a rate writes off the debt) */
+   while ( wait > 0 ) {
+      w = wait < THROTTLE_SLICE_NS ? wait : THROTTLE_SLICE_NS;
+      sleep_ns(w);
+      wait -= w;
+      if ( wait > 0 && throttle_fname ) {
+         pthread_mutex_lock(&throttle->lock);
+         throttle_check(now_ns());
+         if ( b->gen + throttle->ops.gen != gen )
+            wait = 0;
+         pthread_mutex_unlock(&throttle->lock);
       }
    }
-   */
+}
 
-   if ( verbose >= 3 ) 
-      printf("%s: processing MOD file in %d byte blocks\n", this, blksize );
+/* re-read the control file if it is time to. Called with throttle->lock held */
+static void throttle_check(long long now) {
+   if ( throttle_fname &&
+         (__atomic_load_n(&throttle->reload, __ATOMIC_RELAXED) || now - throttle->ctl_checked >= 1000000000LL) )
+      throttle_load(now);
+}
 
-   hold = buf;
-   while ( (br = fread(buf+chunksize, 1, blksize, mod)) > 0 ) {
-     blk++; 
-      /* 
-       * We want to stop scanning within a headers+signature from the end of
-       * the block.  Then move this remaining chunk to the beginning of the
-       * buffer, set buffer pointer at the end of this chunk and do our next
-       * fread.  Not sure what to do about the last block - but I doubt there
-       * is a sequence header at the very end of the file...  At least I hope
-       * not.
-       */
-      p = end = buf;
-      end = buf + br + chunksize;  /* this had better add up! */
-      stop = end - 8;  /* signature + 4 bytes of header */
+/* take n tokens, return how long to sleep (ns) to pay for them */
+static long long bucket_take(bucket_type *b, double n, long long now) {
+   if ( b->rate <= 0 )
+      return 0;
 
-      if ( verbose >= 4 )
-         printf("%s: blk(%d) br=%d, end-buf=%ld, stop-buf=%ld, end-stop=%ld, buf-hold=%ld\n",
-               this, blk, br, end-buf, stop-buf, end-stop, buf-hold);
-      
-      /* scan through the buffer */
-      while ( p <= stop ) {
+   b->tokens += b->rate * (now - b->last) / 1e9;
+   b->last = now;
+   if ( b->tokens > b->rate )
+      b->tokens = b->rate;
+   b->tokens -= n;
+   if ( b->tokens >= 0 )
+      return 0;
+   return (long long) (-b->tokens / b->rate * 1e9);
+}
 
-         /* skip ahead until we find the first byte of our signature. */
-         while ( *p != sig[0] && p < stop )
-            p++;
+static void bucket_set(bucket_type *b, double rate, long long now) {
+   if ( rate == b->rate )
+      return;
+   b->rate = rate;
+   b->tokens = 0;
+   b->last = now;
+   b->gen++;
+}
 
-         /* found signature */
-         if ( p[0] == sig[0] && p[1] == sig[1] && p[2] == sig[2] && p[3] == sig[3] ) {
-            seqh++;
+/*
+ * Re-read the control file if it changed since we last looked, or we were
+ * sent SIGHUP. Lines are "read RATE", "write RATE" or "iops N"; anything
+ * the file leaves out goes back to what was given on the command line.
+ * Called with throttle->lock held.
+ */
+static void throttle_load(long long now) {
+   FILE *f;
+   struct stat st;
+   char line[256], key[64], val[64];
+   double r = read_limit, w = write_limit, o = iops_limit, v;
+   long long mtime;
+
+   throttle->ctl_checked = now;
+   if ( stat(throttle_fname, &st) < 0 )
+      return;    /* keep what we have until it comes back */
+   mtime = (long long) st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+   if ( !throttle->reload && mtime == throttle->ctl_mtime )
+      return;
+   throttle->reload = 0;
+   throttle->ctl_mtime = mtime;
 
-            if ( verbose >= 5 ) {
-               /* print out the entire sequence header */
-               printf("%s: (blk:%d seqh:%d)", this, blk, seqh);
-               for (i=0; i<12; i++) printf(" %02X", *(p + i));
-               printf("\n");
-            }
-            
-            /* use first sequence header we come to as our reference header
-             *
-             * If all other sequence headers do not match our reference
-             * sequence header, we skip them.  I do this because I've found
-             * some sequence header signatures followed by non-standard data in
-             * some MOD files.  I assume that it is a random occurrence of the
-             * signature in some other data section.  Needs more research, but
-             * this seems to works for now.
-             */
-            if ( reference_seqh[3] == 0 ) {
-               memcpy(reference_seqh, p, 12);
-
-               if ( verbose >= 3 ) {
-                  printf("%s: found first sequence header, using as reference [", this);
-                  for (i=0; i<12; i++) printf(" %02X", *(p + i));
-                  printf(" ]\n");
-               }
-
-               /* 
-                * define arfr - the aspect-ratio|frame-rate byte (offset 7) that we will
-                * use in every other sequence header we find.
-                *
-                * grab seq header offset 7. This has aspect ratio in the upper nibble,
-                * and frame rate in the lower nibble. We keep whatever the frame rate
-                * is and set the aspect ratio to whatever our MOI file said it should be
-                */
-               fr = *(p + 7);  
-               fr |= 0xF0;  /* keep frame rate - set upper nibble to 1111 */
-               if ( strcmp(info->aspect_ratio_str, "1:1") == 0 )
-                  arfr = 0x1F & fr;
-               else if ( strcmp(info->aspect_ratio_str, "4:3") == 0 )
-                  arfr = 0x2F & fr;
-               else if ( strcmp(info->aspect_ratio_str, "16:9") == 0 )
-                  arfr = 0x3F & fr;
-               else if ( strcmp(info->aspect_ratio_str, "2.21:1") == 0 )
-                  arfr = 0x4F & fr;
-               else {
-                  fprintf(stderr, "ERROR: invalid aspect ratio in MOI info structure (%s)\n", info->aspect_ratio_str);
-                  exit(1);
-               }
-              
-               if ( verbose >= 3 ) {
-                  ar = fr = *(p + 7);  
-                  ar >>= 4;    /* shift upper bits to the lower nibble */
-                  ar &= 0x0F;  /* blank out the upper nibble */
-                  fr &= 0x0F;  /* ditto */
-                  printf("%s: found MOD seqh offset 7 = 0x%02X, aspect ratio = 0x%02X (%s), frame rate = 0x%02X (%s)\n",
-                        this, *(p + 7), ar, mpeg_seqh_ar_codes[ar], fr, mpeg_seqh_fr_codes[fr]);
-                  printf("%s: using MPEG seqh offset 7 = 0x%02X\n", this, arfr);
-               }
-            } /* ref seqh */
-
-            /* We've got a sequence header signature, check the rest of the
-             * header against our reference header. If it does not match, skip.
-             * See note above about this. */
-            if ( memcmp(reference_seqh, p, 12) != 0 ) {
-               if ( verbose >= 3 ) {
-                  printf("%s: found sequence header signature followed by non standard data\n   [", this);
-                  for (i=0; i<12; i++) printf(" %02X", *(p + i));
-                  printf(" ] skipping...\n");
-               }
-               p++;
-               continue;
-            }
+   if ( (f = fopen(throttle_fname, "r")) == NULL ) {
+      perror(throttle_fname);
+      return;
+   }
+   while ( fgets(line, sizeof(line), f) ) {
+      if ( sscanf(line, "%63s %63s", key, val) != 2 || key[0] == '#' )
+         continue;
+      if ( (v = parse_rate(val)) < 0 )
+         fprintf(stderr, "%s: %s: bad value for %s: %s\n", this, throttle_fname, key, val);
+      else if ( strcmp(key, "read") == 0 )
+         r = v;
+      else if ( strcmp(key, "write") == 0 )
+         w = v;
+      else if ( strcmp(key, "iops") == 0 )
+         o = v;
+      else
+         fprintf(stderr, "%s: %s: unknown setting %s\n", this, throttle_fname, key);
+   }
+   fclose(f);
 
-            /* set aspect ratio/frame rate */
-            if ( verbose >= 4 )
-               printf("%s: setting aspect ratio (sequence header %d)\n", this, seqh);
-            p += 7;
-            *p = arfr;
+   bucket_set(&throttle->read, r, now);
+   bucket_set(&throttle->write, w, now);
+   bucket_set(&throttle->ops, o, now);
+   LOG(1, "throttle", "%s: limits from %s: read %.0f B/s, write %.0f B/s, %.0f ops/s (0 = none)\n",
+         this, throttle_fname, r, w, o);
+}
 
-         }  /* end found seqh */
-         p++;
+/*
+ * "20M", "512k", "1.5G" or a plain number, per second. 0 or "none" means no
+ * limit. Returns -1 if it makes no sense.
+ */
+double parse_rate(char *s) {
+   char *end;
+   double v;
 
-      }  /* end scan through block */
+   if ( strcmp(s, "none") == 0 )
+      return 0;
+   v = strtod(s, &end);
+   switch ( *end ) {
+      case 'k': case 'K': v *= 1024; end++; break;
+      case 'm': case 'M': v *= 1024 * 1024; end++; break;
+      case 'g': case 'G': v *= 1024 * 1024 * 1024; end++; break;
+   }
+   if ( end == s || *end != '\0' || v < 0 )
+      return -1;
+   return v;
+}
 
-      /* account for last increment block scan loop */
-      p--;  
+static long long now_ns() {
+   struct timespec ts;
 
-      /* write out the buffer */
-      bw = fwrite(buf, 1, p - buf, mpeg);
-      tbw += bw;
-      if ( bw < 0 || ferror(mpeg) ) {
-         perror("write failed");
-         exit(1);
-      }
-      if ( verbose >= 4 )
-         printf("%s: blk(%d) bw=%ld, tbw=%lld \n", this, blk, p - buf, tbw);
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-      /* since seqh may span blocks, move last bit of data from end of buffer
-       * to the beginning of next buffer */
-      chunksize = end - p;
-      blksize = RW_BLOCK_SIZE - chunksize;
+static void sleep_ns(long long ns) {
+   struct timespec ts;
 
-      if ( verbose >= 5 )
-         printf("%s: blk(%d) Bytes to end of block: %d, RW_BLOCK_SIZE: %d, next blocksize: %d\n", 
-               this, blk, chunksize, RW_BLOCK_SIZE, blksize);
+   ts.tv_sec = ns / 1000000000LL;
+   ts.tv_nsec = ns % 1000000000LL;
+   while ( nanosleep(&ts, &ts) < 0 && errno == EINTR )
+      ;
+}
 
-      memmove(buf, p, chunksize);
-   }  /* end fread */
+/*****************************************************************************
+ * Logging
+ *
+ * log_msg() formats the message into a ring buffer owned by the calling
+ * thread and returns; nothing is written on the conversion path. A
+ * background thread drains every ring and writes whole lines to stdout, at
+ * most PIPE_BUF bytes per write(), so lines from parallel workers sharing
+ * one stdout never interleave. If a ring fills up (or the writer is not
+ * running) the caller drains it itself.
+ ****************************************************************************/
+void log_init() {
+   static int done = 0;
 
+   if ( done++ )
+      return;
+   log_pid = getpid();
+   pthread_atfork(log_fork_prepare, log_fork_parent, log_fork_child);
+   atexit(log_shutdown);
+}
 
-   /* write out the last bit of buffer */
-   bw = fwrite(buf, 1, chunksize, mpeg);
-   tbw += bw;
-   if ( bw < 0 || ferror(mpeg) ) {
-      perror("write failed");
-      exit(1);
+void log_msg(int level, const char *event, const char *fmt, ...) {
+   char msg[LOG_LINE_MAX];
+   log_rec_type rec;
+   va_list ap;
+   size_t need, head;
+   int len;
+
+   va_start(ap, fmt);
+   len = vsnprintf(msg, sizeof(msg), fmt, ap);
+   va_end(ap);
+   if ( len < 0 )
+      return;
+   if ( len >= LOG_LINE_MAX )
+      len = LOG_LINE_MAX - 1;
+
+   clock_gettime(CLOCK_REALTIME, &rec.ts);
+   rec.event = event;
+   rec.level = level;
+   rec.len = len;
+   need = sizeof(rec) + len;
+
+   if ( log_ring == NULL ) {
+      log_ring = (log_ring_type *) mymalloc(sizeof(log_ring_type));
+      log_ring->buf = (char *) mymalloc(LOG_RING_SIZE);
+      log_ring->head = log_ring->tail = 0;
+      pthread_mutex_lock(&log_lock);
+      log_ring->next = log_rings;
+      log_rings = log_ring;
+      pthread_mutex_unlock(&log_lock);
    }
-   if ( verbose >= 4 )
-      printf("%s: blk(%d) bw=%ld, tbw=%lld \n", this, blk, p - buf, tbw);
-
+   if ( ! log_running )
+      log_start();
 
-   /* wrap up */
-   if ( (fclose(mpeg)) < 0 ) {
-      fprintf(stderr, "%s: unable to close %s\n", this, mpeg_fname);
-      perror(mpeg_fname);
-      exit(1);
-   }
-   if ( (fclose(mod)) < 0 ) {
-      fprintf(stderr, "%s: unable to close %s\n", this, mod_fname);
-      perror(mod_fname);
-      exit(1);
-   }
+   /* no room - don't wait for the writer, make some */
+   head = log_ring->head;
+   if ( LOG_RING_SIZE - (head - __atomic_load_n(&log_ring->tail, __ATOMIC_ACQUIRE)) < need )
+      log_flush();
 
-   free(buf);
+   log_ring_put(log_ring, head, &rec, sizeof(rec));
+   log_ring_put(log_ring, head + sizeof(rec), msg, len);
+   __atomic_store_n(&log_ring->head, head + need, __ATOMIC_RELEASE);
 }
 
-/*****************************************************************************
- * Return true if fname is one of the file types we are looking for
- * suffixes is an array of file suffixes to look for.
- * last entry must be null
- * case of suffix strings is unimportant (.txt or .TXT will both match)
- * for example, call with
- *   char mytypes[] = { ".txt", ".dat", NULL };
- *   is_file_type(fname, mytypes);
- ****************************************************************************/
-int is_file_type(char *fname, char **suffixes) {
-   char **p;
-   int nlen, slen;
+/* copy len bytes into the ring at absolute position pos, wrapping as needed */
+static void log_ring_put(log_ring_type *ring, size_t pos, const void *src, size_t len) {
+   size_t off = pos % LOG_RING_SIZE, n = LOG_RING_SIZE - off;
 
-   nlen = strlen(fname);
-   for (p = suffixes; *p; p++) {
-      slen = strlen(*p);
-      if ( nlen >= slen && strncasecmp(fname + nlen - slen, *p, slen) == 0 )
-         return 1;
-   }
-   return 0;
+   if ( n > len )
+      n = len;
+   memcpy(ring->buf + off, src, n);
+   memcpy(ring->buf, (const char *) src + n, len - n);
 }
 
-/*****************************************************************************
- * remove newline and/or carriage return from end of a string 
- * return length of new modified string 
- ****************************************************************************/
-static int chomp(char *s) {
-   char *p;
-
-   p = s + strlen(s) - 1; 
+static void log_ring_get(log_ring_type *ring, size_t pos, void *dst, size_t len) {
+   size_t off = pos % LOG_RING_SIZE, n = LOG_RING_SIZE - off;
 
-   while (p >= s && (*p == '\n' || *p == '\r'))
-      *(p--) = 0;
+   if ( n > len )
+      n = len;
+   memcpy(dst, ring->buf + off, n);
+   memcpy((char *) dst + n, ring->buf, len - n);
+}
 
-   return (p - s + 1);
+/* write everything queued so far */
+void log_flush() {
+   pthread_mutex_lock(&log_lock);
+   log_drain();
+   pthread_mutex_unlock(&log_lock);
 }
 
-/*****************************************************************************
- * Return true if file NAME is a directory.
- ****************************************************************************/
-static int isdir(char *fname) {
-   struct stat st;
- 
-   if (stat(fname, &st)) {
-      perror(fname);
-      return 0;
+/* called with log_lock held */
+static void log_drain() {
+   static char out[PIPE_BUF];
+   char msg[LOG_LINE_MAX], line[PIPE_BUF];
+   log_ring_type *ring;
+   log_rec_type rec;
+   size_t head, tail;
+   int n = 0, len;
+
+   for ( ring = log_rings; ring; ring = ring->next ) {
+      tail = ring->tail;
+      head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+      while ( tail < head ) {
+         log_ring_get(ring, tail, &rec, sizeof(rec));
+         log_ring_get(ring, tail + sizeof(rec), msg, rec.len);
+         tail += sizeof(rec) + rec.len;
+         len = log_format_rec(line, &rec, msg);
+         if ( n + len > PIPE_BUF ) {
+            log_write(out, n);
+            n = 0;
+         }
+         memcpy(out + n, line, len);
+         n += len;
+      }
+      __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
    }
-   return(S_ISDIR(st.st_mode));
+   log_write(out, n);
 }
 
-/*****************************************************************************
- * Given the MOD fname, if an MOI file with the same dir/name exists, set
- * moi_fname and return true, else false.
- ****************************************************************************/
-int locate_moi(char *moi_fname, char *mod_fname) {
-   FILE *moi;
-   size_t len;
+/* render one record as a line of output, returns its length */
+static int log_format_rec(char *line, log_rec_type *rec, char *msg) {
+   int n = 0, i, max = PIPE_BUF - 3;  /* room for closing quote, newline, nul */
+
+   if ( log_format == LOG_TEXT ) {
+      /* exactly what was asked for, we only make sure it ends the line */
+      n = rec->len < max ? rec->len : max;
+      memcpy(line, msg, n);
+      if ( n == 0 || line[n - 1] != '\n' )
+         line[n++] = '\n';
+      return n;
+   }
+
+   n = snprintf(line, max, "ts=%ld.%06ld pid=%d level=%d event=%s msg=\"",
+         (long) rec->ts.tv_sec, rec->ts.tv_nsec / 1000, (int) log_pid, rec->level, rec->event);
+   for ( i = 0; i < rec->len && n < max - 1; i++ ) {
+      if ( msg[i] == '\n' ) {
+         if ( i == rec->len - 1 )
+            break;
+         line[n++] = '\\';
+         line[n++] = 'n';
+      }
+      else {
+         if ( msg[i] == '"' || msg[i] == '\\' )
+            line[n++] = '\\';
+         line[n++] = msg[i];
+      }
+   }
+   line[n++] = '"';
+   line[n++] = '\n';
+   return n;
+}
 
-   /* srip .MOD, and replace with .MOI */
-   len = strlen(mod_fname) - 4;
-   memcpy(moi_fname, mod_fname, len);
-   memcpy(moi_fname + len, ".MOI\0", 5);   
+static void log_write(char *buf, int len) {
+   ssize_t w;
 
-   //printf("   Looking for %s...", moi_fname);
-   if (moi = fopen(moi_fname, "rb")) {
-      fclose(moi);
-      return 1;
+   while ( len > 0 ) {
+      if ( (w = write(1, buf, len)) < 0 ) {
+         if ( errno == EINTR )
+            continue;
+         return;    /* nowhere left to complain */
+      }
+      buf += w;
+      len -= w;
    }
+}
 
-   moi_fname[0] = '\0';
-   return 0;
+static void *log_writer(void *arg) {
+   struct timespec ts;
+
+   (void) arg;
+   pthread_mutex_lock(&log_lock);
+   while ( ! log_stop ) {
+      log_drain();
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += LOG_INTERVAL_MS * 1000000L;
+      if ( ts.tv_nsec >= 1000000000L ) {
+         ts.tv_sec++;
+         ts.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&log_wake, &log_lock, &ts);
+   }
+   log_drain();
+   pthread_mutex_unlock(&log_lock);
+   return NULL;
 }
 
-/*****************************************************************************
- * Return true if NAME should not be recursed into
- ****************************************************************************/
-int ignore_ent(char *fname) {
-   static char *ignored_entries[] = { ".", "..", NULL };
-   char **p;
+static void log_start() {
+   pthread_mutex_lock(&log_lock);
+   if ( ! log_running && ! log_stop ) {
+      if ( pthread_create(&log_thread, NULL, log_writer, NULL) == 0 )
+         log_running = 1;
+   }
+   pthread_mutex_unlock(&log_lock);
+}
 
-   for (p = ignored_entries; *p; p++) {
-      if (strcmp (fname, *p) == 0)
-         return 1;
+/* at exit: stop the writer and write whatever is left */
+void log_shutdown() {
+   pthread_mutex_lock(&log_lock);
+   log_stop = 1;
+   pthread_cond_signal(&log_wake);
+   pthread_mutex_unlock(&log_lock);
+   if ( log_running ) {
+      pthread_join(log_thread, NULL);
+      log_running = 0;
    }
-   return 0;
+   log_flush();
 }
 
-/*************************************************************************
- * return true if the file exists
- ************************************************************************/
-int file_exists(char *fname) {
-   FILE *f = NULL;
+/* fork with nothing queued, so neither side writes a line twice */
+static void log_fork_prepare() {
+   pthread_mutex_lock(&log_lock);
+   log_drain();
+}
 
-   if (f = fopen(fname, "r")) {
-      fclose(f);
-      return 1;
-   }
-   return 0;
+static void log_fork_parent() {
+   pthread_mutex_unlock(&log_lock);
+}
+
+/* the child has only the forking thread: forget the other rings and start
+ * its own writer on the first message */
+static void log_fork_child() {
+   pthread_mutex_init(&log_lock, NULL);
+   pthread_cond_init(&log_wake, NULL);
+   log_running = 0;
+   log_stop = 0;
+   log_rings = log_ring;
+   if ( log_ring )
+      log_ring->next = NULL;
+   log_pid = getpid();
 }
 
 /*****************************************************************************
@@ -1104,6 +7226,10 @@ void usage() {
    printf("    recorded in 16:9 ratio, the aspect ratio will not be set correctly in the\n");
    printf("    .MOD file.\n");
    printf("\n");
+   printf("    Some (JVC) camcorders write .TOD files instead, which are MPEG transport\n");
+   printf("    streams with the same problem. These are found and fixed the same way;\n");
+   printf("    the mpeg that comes out is still a transport stream.\n");
+   printf("\n");
    printf("    I have only tested this with my camcorder (Panasonic SDR-H18) on Ubuntu 10.04,\n");
    printf("    11.04 and 12.04\n");
    printf("\n");
@@ -1125,7 +7251,44 @@ void usage() {
    printf("\n");
    printf("    -d, --dest-dir=path/to/dir\n");
    printf("             Destination directory. All files will be saved in this directory.\n");
-   printf("             Path can be either relative or absolute.\n");
+   printf("             Path can be either relative or absolute. May be given more than\n");
+   printf("             once (up to %d) to keep a copy in each; every MOD file is still\n", MAX_DESTS);
+   printf("             read only once. If one destination fails (disk full, etc) the\n");
+   printf("             others carry on.\n");
+   printf("\n");
+   printf("    -T, --tar=file.tar\n");
+   printf("             Instead of -d, write everything as one tar stream to file.tar\n");
+   printf("             (- for stdout, in which case messages go to stderr). Entries are\n");
+   printf("             named as they would be under a dest dir, YYYY/MM/DD/mov-*.mpeg\n");
+   printf("             and .moi. Nothing is seeked or staged, so the tar can be piped\n");
+   printf("             straight to tape or an upload.\n");
+   printf("\n");
+   printf("    --fsync=none|checkpoint|close\n");
+   printf("             When to force data to disk, for the -d options that follow.\n");
+   printf("             checkpoint (the default) syncs before each resume checkpoint is\n");
+   printf("             recorded, close also syncs each file before closing it, and none\n");
+   printf("             leaves it all to the OS. For example, to sync only the backup:\n");
+   printf("                %s -s src -d /archive --fsync=close -d /backup\n", this);
+   printf("\n");
+   printf("    -j, --jobs=N\n");
+   printf("             Convert up to N files at once. MOD files on a spinning disk are\n");
+   printf("             always read one at a time, in the order they lie on the disk;\n");
+   printf("             files on other devices are spread over up to N workers.\n");
+   printf("             Default is 1.\n");
+   printf("\n");
+   printf("    -n, --plan\n");
+   printf("             Dry run. Show where each MOD file would be written, including\n");
+   printf("             any _NN suffix it would get, and check that the destination has\n");
+   printf("             room for all of it. Nothing is created. Use -v to include the\n");
+   printf("             MOI copies. (The space check is also done before a real run.)\n");
+   printf("\n");
+   printf("    --no-resume\n");
+   printf("             An interrupted conversion leaves a hidden .mov-*.mpeg.ckpt\n");
+   printf("             checkpoint next to the partial mpeg, and by default the next run\n");
+   printf("             checks what was written and finishes it from there. With this\n");
+   printf("             option the partial file is left alone and a new one is started.\n");
+   printf("             A partial mpeg is only finished with the --frame-rate and\n");
+   printf("             --fix-display it was started with.\n");
    printf("\n");
    printf("    -r, --recursive\n");
    printf("             When used with -d, will process all subdirectories as well\n");
@@ -1148,6 +7311,14 @@ void usage() {
    printf("             do not want this behavior, use this option, in which case all MPEGs\n");
    printf("             will be output in the dest_dir directory.\n");
    printf("\n");
+   printf("    --layout=date|sharded\n");
+   printf("             date (the default) puts each mpeg in dest_dir/YYYY/MM/DD as above.\n");
+   printf("             sharded files it as dest_dir/%s/ab/cd/<key>.mpeg instead, where\n", SHARD_DIR);
+   printf("             the key is a hash of the MOI and the MOD's size and ends, and\n");
+   printf("             puts a symlink to it in the date dir (none with -m). A clip that\n");
+   printf("             is already there is skipped, unless -c, whatever it was called,\n");
+   printf("             and no directory ever holds more than a few files.\n");
+   printf("\n");
    printf("    -t, --modification-time, --mtime\n");
    printf("             Use the modification time of the MOD file.  Default is to use\n");
    printf("             the time defined in the MOI file.\n");
@@ -1156,6 +7327,115 @@ void usage() {
    printf("             Print status messages and warnings to stdout. Repeat -v option\n");
    printf("             for more verbose output.  Anything above -vvv is mostly debug print.\n");
    printf("\n");
+   printf("    --read-limit=RATE, --write-limit=RATE, --iops=N\n");
+   printf("             Hold reading and writing to RATE bytes a second (k, M and G\n");
+   printf("             suffixes are powers of 1024; writes to several -d count once\n");
+   printf("             for each), and read/write calls to N a second, across all\n");
+   printf("             workers. Default is no limit.\n");
+   printf("\n");
+   printf("    --throttle-file=file\n");
+   printf("             Take the limits from file, lines of \"read RATE\", \"write RATE\"\n");
+   printf("             and \"iops N\" (none for no limit). The file is checked every\n");
+   printf("             second and whenever %s gets SIGHUP, so the limits can be\n", this);
+   printf("             changed while a long run is going. Settings the file leaves\n");
+   printf("             out fall back to the options above.\n");
+   printf("\n");
+   printf("    --frame-rate=rate\n");
+   printf("             Set the frame rate in every sequence header as well as the\n");
+   printf("             aspect ratio: 23.976, 24, 25, 29.97, 30, 50, 59.94 or 60.\n");
+   printf("             Default is to keep the MOD's.\n");
+   printf("\n");
+   printf("    --fix-display\n");
+   printf("             Also set the display size in each sequence display extension to\n");
+   printf("             the picture size, for players that otherwise show a pan&scan\n");
+   printf("             window instead of the whole picture. Check mpegs made with\n");
+   printf("             this or --frame-rate using moi-verify --fix-display or -r.\n");
+   printf("\n");
+   printf("    --poster[=N]\n");
+   printf("             Save the first (or Nth) I-frame of each mpeg, with its sequence\n");
+   printf("             header, next to it as a little .m2v file, for thumbnails. It is\n");
+   printf("             picked out while the mpeg is written, without decoding anything.\n");
+   printf("             Not done when resuming an interrupted mpeg, nor for a tar file.\n");
+   printf("\n");
+   printf("    --demux\n");
+   printf("             Also write each elementary stream in the mpeg next to it, in the\n");
+   printf("             same pass: the video (with the fixed headers) as .e0.m2v, MPEG\n");
+   printf("             audio as .c0.mpa, AC-3 as .80.ac3 and so on. Not done when\n");
+   printf("             resuming an interrupted mpeg, nor for a tar file.\n");
+   printf("\n");
+   printf("    --mp4\n");
+   printf("             Also write a fragmented .mp4 next to each mpeg, in the same pass,\n");
+   printf("             with the video and MPEG or AC-3 audio as they are (nothing is\n");
+   printf("             re-encoded). It is written a GOP at a time, so it can be played\n");
+   printf("             while it is still being written. Not done when resuming an\n");
+   printf("             interrupted mpeg, nor for a tar file.\n");
+   printf("\n");
+   printf("    --in-place[=rollback]\n");
+   printf("             Fix the MOD files (or mpegs made before, with their .moi) where\n");
+   printf("             they are instead of writing new mpegs: a read of each file and a\n");
+   printf("             few bytes written back. No -d. The changes are journaled first,\n");
+   printf("             so an interrupted run is finished by the next one, or undone by\n");
+   printf("             --in-place=rollback.\n");
+   printf("\n");
+   printf("    --serve=socket\n");
+   printf("             Stay up and take jobs on the Unix socket, one line of options\n");
+   printf("             per job as on the command line (-s or -f, and -d, --poster and\n");
+   printf("             the like; the rest are set here, with the defaults for those).\n");
+   printf("             -j workers share the connections; each runs a connection's jobs\n");
+   printf("             in turn, sends back what it prints, and ends each job with\n");
+   printf("             job=N status=ok|failed exit=E files=F mpegs=M failed=X bytes=B\n");
+   printf("             secs=S. For example:\n");
+   printf("                %s --serve=/run/moi.sock -d /video -j 4 &\n", this);
+   printf("                echo \"-f /card/MOV001.MOD\" | socat - UNIX-CONNECT:/run/moi.sock\n");
+   printf("             SIGTERM stops it; jobs going are finished. Only the server's\n");
+   printf("             user can connect to the socket. Each job runs in a fork\n");
+   printf("             of its worker, so it starts without the directory indexes and\n");
+   printf("             date dirs that the jobs before it found.\n");
+   printf("\n");
+   printf("    --progress[=tty|lines]\n");
+   printf("             Report how far along the run is, out of the total size of the\n");
+   printf("             MOD and MOI files found: percent and bytes done, files done,\n");
+   printf("             read rate, ETA, and the rate of each worker. tty redraws one\n");
+   printf("             line on stderr twice a second; lines logs a line every ten\n");
+   printf("             seconds, \"progress: done=B total=B files=F/N rate=B/s eta=S\n");
+   printf("             secs=S workers=B/s,B/s...\". Default is tty if stderr is a\n");
+   printf("             terminal, lines if not.\n");
+   printf("\n");
+   printf("    --no-prefetch\n");
+   printf("             Normally, as each MOD nears its end, the first few MB of the\n");
+   printf("             next one (and its MOI) are read ahead in the background so the\n");
+   printf("             source never sits idle between files. This turns that off.\n");
+   printf("\n");
+   printf("    --image=file\n");
+   printf("             Read the MOD/MOI files straight out of a dd image of the card\n");
+   printf("             (FAT32 or exFAT, whole card or just the partition), without\n");
+   printf("             mounting it. -s and -f then name a directory or file in the\n");
+   printf("             image; the default is -s /. Use -r to find everything, e.g.\n");
+   printf("                %s --image=card.img -r -d /video\n", this);
+   printf("\n");
+   printf("    --catalog=file\n");
+   printf("             Record every mpeg made (date, aspect ratio, sizes, and where the\n");
+   printf("             MOD, MOI and mpeg are) in file. Default is %s in the\n", CATALOG_NAME);
+   printf("             first -d dir; --no-catalog to not keep one. Each mpeg is noted in\n");
+   printf("             file.tail as it's made, and sorted into file at the end of the run.\n");
+   printf("\n");
+   printf("    --query [--from=date] [--to=date] [--aspect=4:3|16:9]\n");
+   printf("             List what the catalog (--catalog, or the one in -d) has recorded\n");
+   printf("             between the two dates, without reading any MOI files. Dates are\n");
+   printf("             like 2012, 2012-06 or \"2012-06-15 10:30\"; --from=2012-06\n");
+   printf("             --to=2012-06 is all of June. Prints date, aspect ratio, mpeg,\n");
+   printf("             size and MOD, tab separated.\n");
+   printf("\n");
+   printf("    --scanner=name\n");
+   printf("             How to search for sequence headers: avx512, avx2, sse2, memchr,\n");
+   printf("             memmem or bytes. By default, whatever moi-scanbench --record\n");
+   printf("             found fastest here, or else the best this CPU supports.\n");
+   printf("\n");
+   printf("    --log-format=text|kv\n");
+   printf("             text (the default) prints messages as shown above. kv prints\n");
+   printf("             one line per message, ts=... pid=... level=... event=... msg=\"...\"\n");
+   printf("             for feeding to other programs.\n");
+   printf("\n");
    printf("    -h, --help\n");
    printf("             Prints this help message\n");
    printf("\n");
@@ -1187,62 +7467,106 @@ void * mymalloc(size_t size) {
    return p;
 }
 
-// -------------- below is borrowed code -------------------------------------
-
-/*
- * mkpath functions by Jonathan Leffler
- * from: http://stackoverflow.com/questions/675039/how-can-i-create-directory-tree-in-c-linux
- */
-static int do_mkdir(const char *path, mode_t mode)
-{
-    struct stat     st;
-    int             status = 0;
-
-    if (stat(path, &st) != 0)
-    {
-        /* Directory does not exist. EEXIST for race condition */
-        if (mkdir(path, mode) != 0 && errno != EEXIST)
-            status = -1;
-    }
-    else if (!S_ISDIR(st.st_mode))
-    {
-        errno = ENOTDIR;
-        status = -1;
-    }
-
-    return(status);
-}
-
-/**
-** mkpath - ensure all directories in path exist
-** Algorithm takes the pessimistic view and works top-down to ensure
-** each directory in path exists, rather than optimistically creating
-** the last element and working backwards.
-*/
-int mkpath(const char *path, mode_t mode)
-{
-    char           *pp;
-    char           *sp;
-    int             status;
-    char           *copypath = strdup(path);
-
-    status = 0;
-    pp = copypath;
-    while (status == 0 && (sp = strchr(pp, '/')) != 0)
-    {
-        if (sp != pp)
-        {
-            /* Neither root nor double slash in path */
-            *sp = '\0';
-            status = do_mkdir(copypath, mode);
-            *sp = '/';
-        }
-        pp = sp + 1;
-    }
-    if (status == 0)
-        status = do_mkdir(path, mode);
-    free(copypath);
-    return (status);
+/* ... and the same for realloc */
+void * myrealloc(void *p, size_t size) {
+   if ( (p = realloc(p, size)) == NULL ) {
+      fprintf(stderr, "%s: cannot allocate memory\n", this);
+      exit(1);
+   }
+   return p;
+}
+
+/*****************************************************************************
+ * Add a -d destination directory. dir is made absolute, and we hang on to
+ * an open handle on it that all date directories are created relative to.
+ ****************************************************************************/
+int add_dest(char *dir) {
+   dest_type *dest = &dests[ndests];
+   char cwd[MAX_PATH_LEN];
+   struct stat st;
+
+   dest->dir = (char *) mymalloc(MAX_PATH_LEN);
+   strcpy(dest->dir, dir);
+
+   /* strip trailing / if any */
+   if ( strlen(dest->dir) > 1 && dest->dir[strlen(dest->dir)-1] == '/' )
+      dest->dir[strlen(dest->dir)-1] = '\0';
+
+   /* turn it into an absolute path */
+   if ( dest->dir[0] != '/' ) {
+      if ( !getcwd(cwd, sizeof cwd) ) {
+         perror("cannot get cwd\n");
+         exit(1);
+      }
+      sprintf(dest->dir, "%s/%s", cwd, dir);
+      if ( dest->dir[strlen(dest->dir)-1] == '/' )
+         dest->dir[strlen(dest->dir)-1] = '\0';
+   }
+
+   /* check to see if dir exists */
+   if ( (dest->dirfd = open(dest->dir, O_RDONLY | O_DIRECTORY)) < 0 || fstat(dest->dirfd, &st) < 0 ) {
+      fprintf(stderr, "%s: destination directory does not exist: %s\n", this, dest->dir);
+      return 0;
+   }
+   dest->dev = st.st_dev;
+   dest->dir_cache = new_name_index(dest->dir);
+   dest->fsync_mode = fsync_mode;
+   ndests++;
+   return 1;
 }
 
+/*****************************************************************************
+ * Make sure reldir (YYYY/MM/DD) exists under dest->dir.
+ *
+ * dir_cache remembers every directory we have seen or created this run, so
+ * for a day in a month we already know about this is a single mkdirat()
+ * relative to dest->dirfd, and nothing at all for a day we already know
+ * about. A directory we had to create is empty, so its name index can be
+ * set up without listing it.
+ ****************************************************************************/
+int make_date_dir(dest_type *dest, char *reldir) {
+   char path[MAX_PATH_LEN];
+   char fullpath[MAX_PATH_LEN];
+   name_index_type *idx;
+   struct stat st;
+   char *sp;
+   int last = 0;
+
+   if ( name_index_has(dest->dir_cache, reldir) )
+      return 0;
+
+   PROBE2(mkdir__start, dest->dir, reldir);
+   strcpy(path, reldir);
+   sp = path;
+   while ( !last ) {
+      if ( (sp = strchr(sp + 1, '/')) == NULL ) {
+         sp = path + strlen(path);
+         last = 1;
+      }
+      *sp = '\0';
+
+      if ( !name_index_has(dest->dir_cache, path) ) {
+         if ( mkdirat(dest->dirfd, path, 0777) == 0 ) {
+            LOG(3, "mkdir", "%s: created target dir %s/%s\n", this, dest->dir, path);
+            sprintf(fullpath, "%s/%s", dest->dir, path);
+            idx = new_name_index(fullpath);
+            idx->next = name_indexes;
+            name_indexes = idx;
+         }
+         else if ( errno != EEXIST || fstatat(dest->dirfd, path, &st, 0) < 0 || !S_ISDIR(st.st_mode) ) {
+            /* something that isn't a directory in the way */
+            if ( errno == EEXIST )
+               errno = ENOTDIR;
+            PROBE3(mkdir__done, dest->dir, reldir, -1);
+            return -1;
+         }
+         name_index_add(dest->dir_cache, path);
+      }
+
+      if ( !last )
+         *sp = '/';
+   }
+   PROBE3(mkdir__done, dest->dir, reldir, 0);
+   return 0;
+}
 
@@ -0,0 +1,195 @@
+/*****************************************************************************
+ *
+ * $Id$
+ *
+ * This file is free software. You can redistribute it and/or modify it
+ * under the terms of the FreeBSD License. See header in main `moi.c` file.
+ *
+ * # Sequence header search kernels
+ *
+ * make_mpeg() spends nearly all of its CPU time looking for the 00 00 01 B3
+ * sequence header signature. There are several ways to look, and which is
+ * fastest depends on the machine, so they all live here behind one function
+ * pointer, seqh_find. moi-scanbench times them against each other and can
+ * record the winner in ~/.moi-scanner, which moi picks up at start up.
+ * Without a recorded choice we take the widest SIMD the CPU has.
+ *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+#include "scan.h"
+
+#define SCAN_RECORD ".moi-scanner"   /* in $HOME */
+
+static const unsigned char sig[] = { 0x00, 0x00, 0x01, 0xB3 };
+
+/*
+ * byte loop - what make_mpeg() always did: step to the next 00, then
+ * check the rest.
+ */
+static unsigned char *find_bytes(unsigned char *p, unsigned char *lim) {
+   for ( ; p + 4 <= lim; p++) {
+      if ( p[0] == 0x00 && p[1] == 0x00 && p[2] == 0x01 && p[3] == 0xB3 )
+         return p;
+   }
+   return NULL;
+}
+
+/* let the C library find each 00 */
+static unsigned char *find_memchr(unsigned char *p, unsigned char *lim) {
+   while ( p + 4 <= lim && (p = memchr(p, 0x00, lim - 3 - p)) != NULL ) {
+      if ( p[1] == 0x00 && p[2] == 0x01 && p[3] == 0xB3 )
+         return p;
+      p++;
+   }
+   return NULL;
+}
+
+static unsigned char *find_memmem(unsigned char *p, unsigned char *lim) {
+   if ( p + 4 > lim )
+      return NULL;
+   return memmem(p, lim - p, sig, 4);
+}
+
+#ifdef SCAN_X86
+/*
+ * SIMD: compare 16/32/64 positions at once against each byte of the
+ * signature (four overlapping loads), and AND the results.
+ */
+__attribute__((target("sse2")))
+static unsigned char *find_sse2(unsigned char *p, unsigned char *lim) {
+   const __m128i z = _mm_setzero_si128(), one = _mm_set1_epi8(0x01), b3 = _mm_set1_epi8((char) 0xB3);
+   unsigned int m;
+
+   for ( ; p + 16 + 3 <= lim; p += 16) {
+      m = _mm_movemask_epi8(_mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), z),
+                          _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 1)), z)),
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 2)), one),
+                          _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 3)), b3))));
+      if ( m )
+         return p + __builtin_ctz(m);
+   }
+   return find_bytes(p, lim);
+}
+
+__attribute__((target("avx2")))
+static unsigned char *find_avx2(unsigned char *p, unsigned char *lim) {
+   const __m256i z = _mm256_setzero_si256(), one = _mm256_set1_epi8(0x01), b3 = _mm256_set1_epi8((char) 0xB3);
+   unsigned int m;
+
+   for ( ; p + 32 + 3 <= lim; p += 32) {
+      m = _mm256_movemask_epi8(_mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) p), z),
+                             _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (p + 1)), z)),
+            _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (p + 2)), one),
+                             _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (p + 3)), b3))));
+      if ( m )
+         return p + __builtin_ctz(m);
+   }
+   return find_bytes(p, lim);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static unsigned char *find_avx512(unsigned char *p, unsigned char *lim) {
+   const __m512i z = _mm512_setzero_si512(), one = _mm512_set1_epi8(0x01), b3 = _mm512_set1_epi8((char) 0xB3);
+   unsigned long long m;
+
+   for ( ; p + 64 + 3 <= lim; p += 64) {
+      m = _mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void *) p), z)
+        & _mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void *) (p + 1)), z)
+        & _mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void *) (p + 2)), one)
+        & _mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void *) (p + 3)), b3);
+      if ( m )
+         return p + __builtin_ctzll(m);
+   }
+   return find_bytes(p, lim);
+}
+
+static int have_sse2(void)   { return __builtin_cpu_supports("sse2"); }
+static int have_avx2(void)   { return __builtin_cpu_supports("avx2"); }
+static int have_avx512(void) { return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"); }
+#endif
+
+static int always(void) { return 1; }
+
+scan_kernel_type scan_kernels[] = {
+#ifdef SCAN_X86
+   { "avx512", find_avx512, have_avx512 },
+   { "avx2",   find_avx2,   have_avx2 },
+   { "sse2",   find_sse2,   have_sse2 },
+#endif
+   { "memchr", find_memchr, always },
+   { "memmem", find_memmem, always },
+   { "bytes",  find_bytes,  always },
+   { NULL, NULL, NULL }
+};
+
+seqh_find_fn seqh_find = find_memchr;
+static const char *selected = "memchr";
+
+/*
+ * Use the named kernel, or with NULL the first one this CPU supports.
+ * Returns 0 if there is no such kernel or the CPU can't run it.
+ */
+int scan_select(const char *name) {
+   scan_kernel_type *k;
+
+   for (k = scan_kernels; k->name; k++) {
+      if ( (name == NULL || strcmp(name, k->name) == 0) && k->supported() ) {
+         seqh_find = k->find;
+         selected = k->name;
+         return 1;
+      }
+   }
+   return 0;
+}
+
+const char *scan_selected() {
+   return selected;
+}
+
+void scan_record_fname(char *fname, int len) {
+   char *home = getenv("HOME");
+
+   snprintf(fname, len, "%s/%s", home ? home : ".", SCAN_RECORD);
+}
+
+/*
+ * select the kernel moi-scanbench recorded, if there is one and it still
+ * runs here, otherwise the best supported
+ */
+int scan_load_choice() {
+   char fname[2048], name[64];
+   FILE *f;
+   int ok = 0;
+
+   scan_record_fname(fname, sizeof(fname));
+   if ( (f = fopen(fname, "r")) != NULL ) {
+      if ( fscanf(f, "%63s", name) == 1 )
+         ok = scan_select(name);
+      fclose(f);
+   }
+   if ( !ok )
+      scan_select(NULL);
+   return ok;
+}
+
+int scan_save_choice(const char *name) {
+   char fname[2048];
+   FILE *f;
+
+   scan_record_fname(fname, sizeof(fname));
+   if ( (f = fopen(fname, "w")) == NULL || fprintf(f, "%s\n", name) < 0 || fclose(f) != 0 ) {
+      perror(fname);
+      return 0;
+   }
+   return 1;
+}
@@ -0,0 +1,36 @@
+/*****************************************************************************
+ *
+ * $Id$
+ *
+ * This file is free software. You can redistribute it and/or modify it
+ * under the terms of the FreeBSD License. See header in main `moi.c` file.
+ *
+ * Sequence header search kernels, shared by moi and moi-scanbench.
+ *
+ ****************************************************************************/
+
+#ifndef MOI_SCAN_H
+#define MOI_SCAN_H
+
+/*
+ * Find the first 00 00 01 B3 that lies wholly in [p, lim), NULL if there
+ * isn't one. Never reads at or past lim.
+ */
+typedef unsigned char *(*seqh_find_fn)(unsigned char *p, unsigned char *lim);
+
+typedef struct scan_kernel {
+   const char   *name;
+   seqh_find_fn  find;
+   int         (*supported)(void);  /* can this CPU run it? */
+} scan_kernel_type;
+
+extern scan_kernel_type scan_kernels[];  /* fastest first, NULL name ends it */
+extern seqh_find_fn seqh_find;           /* the one in use */
+
+int scan_select(const char *name);
+const char *scan_selected();
+void scan_record_fname(char *fname, int len);
+int scan_load_choice();
+int scan_save_choice(const char *name);
+
+#endif